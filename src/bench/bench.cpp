@@ -39,7 +39,11 @@ void benchmark::ConsolePrinter::result(const State& state)
     }
 
     std::cout << std::setprecision(6);
-    std::cout << state.m_name << ", " << state.m_num_evals << ", " << state.m_num_iters << ", " << total << ", " << front << ", " << back << ", " << median << std::endl;
+    std::cout << state.m_name << ", " << state.m_num_evals << ", " << state.m_num_iters << ", " << total << ", " << front << ", " << back << ", " << median;
+    for (const auto& counter : state.m_counters) {
+        std::cout << ", " << counter.first << "=" << state.CounterResult(counter.second);
+    }
+    std::cout << std::endl;
 }
 
 void benchmark::ConsolePrinter::footer() {}
@@ -140,3 +144,16 @@ bool benchmark::State::UpdateTimer(const benchmark::time_point current_time)
     m_num_iters_left = m_num_iters - 1;
     return true;
 }
+
+double benchmark::State::CounterResult(const Counter& counter) const
+{
+    if (counter.m_flags == Counter::kIsRate) {
+        const double seconds = m_num_iters * std::accumulate(m_elapsed_results.begin(), m_elapsed_results.end(), 0.0);
+        return seconds > 0 ? counter.m_value / seconds : 0;
+    }
+    if (counter.m_flags == Counter::kAvgIterations) {
+        const double iters = m_num_iters * m_elapsed_results.size();
+        return iters > 0 ? counter.m_value / iters : 0;
+    }
+    return counter.m_value;
+}
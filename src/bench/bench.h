@@ -36,6 +36,12 @@ static void CODE_TO_TIME(benchmark::State& state)
 // default to running benchmark for 5000 iterations
 BENCHMARK(CODE_TO_TIME, 5000);
 
+// Figures other than time, such as the memory used, are reported next to the
+// timings as counters, set in the benchmark function:
+
+    state.m_counters["bytes"] = bytes;
+    state.m_counters["items"] = benchmark::Counter(items, benchmark::Counter::kIsRate);
+
  */
 
 namespace benchmark {
@@ -51,6 +57,22 @@ using duration = clock::duration;
 
 class Printer;
 
+//! A figure reported with the timings of a benchmark
+struct Counter {
+    enum Flags {
+        kDefault = 0,
+        //! Reported per second of all evaluations
+        kIsRate = 1,
+        //! Reported per iteration of all evaluations
+        kAvgIterations = 2,
+    };
+
+    double m_value;
+    Flags m_flags;
+
+    Counter(double value = 0, Flags flags = kDefault) : m_value(value), m_flags(flags) {}
+};
+
 class State
 {
 public:
@@ -60,9 +82,13 @@ public:
     const uint64_t m_num_evals;
     std::vector<double> m_elapsed_results;
     time_point m_start_time;
+    std::map<std::string, Counter> m_counters;
 
     bool UpdateTimer(time_point finish_time);
 
+    //! The value of a counter as reported, once all evaluations ran
+    double CounterResult(const Counter& counter) const;
+
     State(std::string name, uint64_t num_evals, double num_iters, Printer& printer) : m_name(name), m_num_iters_left(0), m_num_iters(num_iters), m_num_evals(num_evals)
     {
     }
@@ -0,0 +1,113 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <chainparams.h>
+#include <clientversion.h>
+#include <crypto/common.h>
+#include <mappedfile.h>
+#include <primitives/block.h>
+#include <protocol.h>
+#include <streams.h>
+#include <util.h>
+
+namespace block_bench {
+#include <bench/data/block413567.raw.h>
+} // namespace block_bench
+
+// Serving blocks to peers from a finalized block file: opening, seeking and
+// reading the file for every block, as ReadBlockFromDisk and
+// ReadRawBlockFromDisk do for the file blocks are appended to, versus reading
+// them from a mapping of the whole file, as they do for all others. Each
+// iteration reads one block; the blocks counter reports them per second.
+
+static const int BLOCK_FILE_BLOCKS = 20;
+
+//! A block file of copies of the bench block, and where they are in it
+static fs::path WriteBlockFile(std::vector<uint32_t>& positions)
+{
+    const fs::path path = GetDataDir() / "blk00000.dat";
+    CAutoFile fileout(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+    uint32_t pos = 0;
+    for (int i = 0; i < BLOCK_FILE_BLOCKS; i++) {
+        const uint32_t size = sizeof(block_bench::block413567);
+        fileout.write((const char*)Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE);
+        fileout << size;
+        fileout.write((const char*)block_bench::block413567, size);
+        positions.push_back(pos + 8);
+        pos += 8 + size;
+    }
+    return path;
+}
+
+static void BlockReadFile(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<uint32_t> positions;
+    const fs::path path = WriteBlockFile(positions);
+    uint64_t blocks = 0;
+    while (state.KeepRunning()) {
+        CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        const int seek_error = fseek(filein.Get(), positions[blocks++ % positions.size()], SEEK_SET);
+        assert(!seek_error);
+        CBlock block;
+        filein >> block;
+    }
+    state.m_counters["blocks"] = benchmark::Counter(blocks, benchmark::Counter::kIsRate);
+}
+
+static void BlockReadMapped(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<uint32_t> positions;
+    const std::shared_ptr<const MappedFile> file = MappedFile::Open(WriteBlockFile(positions));
+    assert(file);
+    uint64_t blocks = 0;
+    while (state.KeepRunning()) {
+        CBlock block;
+        SpanReader(SER_DISK, CLIENT_VERSION, file->data().subspan(positions[blocks++ % positions.size()])) >> block;
+    }
+    state.m_counters["blocks"] = benchmark::Counter(blocks, benchmark::Counter::kIsRate);
+}
+
+static void RawBlockReadFile(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<uint32_t> positions;
+    const fs::path path = WriteBlockFile(positions);
+    uint64_t blocks = 0;
+    while (state.KeepRunning()) {
+        CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        const int seek_error = fseek(filein.Get(), positions[blocks++ % positions.size()] - 8, SEEK_SET);
+        assert(!seek_error);
+        CMessageHeader::MessageStartChars blk_start;
+        uint32_t blk_size;
+        filein >> blk_start >> blk_size;
+        std::vector<uint8_t> data(blk_size);
+        filein.read((char*)data.data(), blk_size);
+    }
+    state.m_counters["blocks"] = benchmark::Counter(blocks, benchmark::Counter::kIsRate);
+}
+
+static void RawBlockReadMapped(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    std::vector<uint32_t> positions;
+    std::shared_ptr<const MappedFile> file = MappedFile::Open(WriteBlockFile(positions));
+    assert(file);
+    uint64_t blocks = 0;
+    while (state.KeepRunning()) {
+        const uint32_t pos = positions[blocks++ % positions.size()];
+        const uint32_t blk_size = ReadLE32(file->data().data() + pos - 4);
+        SharedBytes data(file, file->data().subspan(pos, blk_size));
+        assert(data.size() == sizeof(block_bench::block413567));
+    }
+    state.m_counters["blocks"] = benchmark::Counter(blocks, benchmark::Counter::kIsRate);
+}
+
+BENCHMARK(BlockReadFile, 100);
+BENCHMARK(BlockReadMapped, 100);
+BENCHMARK(RawBlockReadFile, 1000);
+BENCHMARK(RawBlockReadMapped, 100 * 1000);
@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <chainparams.h>
+#include <mappedfile.h>
+#include <net.h>
+#include <netmessagemaker.h>
+#include <primitives/block.h>
+#include <protocol.h>
+#include <streams.h>
+#include <version.h>
+
+namespace block_bench {
+#include <bench/data/block413567.raw.h>
+} // namespace block_bench
+
+// Queueing a block read from disk to be sent to a peer: deserializing and
+// reserializing it, copying its serialization into the message, or queueing
+// the bytes read from disk themselves, as a witness block is sent now.
+
+//! Queue messages made by make_msg to a peer, reporting the bytes queued per second
+template <typename MakeMsg>
+static void QueueBlocks(benchmark::State& state, MakeMsg make_msg)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    CConnman connman(0x1337, 0x1337);
+    CAddress addr;
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, CAddress(), "", false);
+    const CNetMsgMaker msg_maker(PROTOCOL_VERSION);
+    {
+        // Keep the send queue from ever being empty, so that no message is
+        // sent right away.
+        LOCK(node.cs_vSend);
+        node.vSendMsg.emplace_back();
+    }
+    uint64_t bytes = 0;
+    while (state.KeepRunning()) {
+        connman.PushMessage(&node, make_msg(msg_maker));
+        LOCK(node.cs_vSend);
+        bytes += node.nSendSize;
+        node.nSendSize = 0;
+        node.vSendMsg.resize(1);
+    }
+    state.m_counters["bytes"] = benchmark::Counter(bytes, benchmark::Counter::kIsRate);
+}
+
+static void BlockRelayReserialize(benchmark::State& state)
+{
+    const std::vector<uint8_t> block_data(std::begin(block_bench::block413567), std::end(block_bench::block413567));
+    QueueBlocks(state, [&](const CNetMsgMaker& msg_maker) {
+        CBlock block;
+        SpanReader(SER_NETWORK, PROTOCOL_VERSION, MakeSpan(block_data)) >> block;
+        return msg_maker.Make(NetMsgType::BLOCK, block);
+    });
+}
+
+static void BlockRelayCopy(benchmark::State& state)
+{
+    const std::vector<uint8_t> block_data(std::begin(block_bench::block413567), std::end(block_bench::block413567));
+    QueueBlocks(state, [&](const CNetMsgMaker& msg_maker) {
+        return msg_maker.Make(NetMsgType::BLOCK, MakeSpan(block_data));
+    });
+}
+
+static void BlockRelayShared(benchmark::State& state)
+{
+    const SharedBytes block_data{std::vector<uint8_t>(std::begin(block_bench::block413567), std::end(block_bench::block413567))};
+    QueueBlocks(state, [&](const CNetMsgMaker& msg_maker) {
+        return msg_maker.MakeRaw(NetMsgType::BLOCK, block_data);
+    });
+}
+
+BENCHMARK(BlockRelayReserialize, 100);
+BENCHMARK(BlockRelayCopy, 500);
+BENCHMARK(BlockRelayShared, 500);
@@ -4,11 +4,20 @@
 
 #include <bench/bench.h>
 #include <coins.h>
+#include <memusage.h>
 #include <policy/policy.h>
+#include <random.h>
 #include <wallet/crypter.h>
 
+#include <unordered_map>
 #include <vector>
 
+// Coins in the map for the CCoinsMap benchmarks.
+static const size_t COINS_MAP_SIZE = 100000;
+
+// What CCoinsMap was before it became a flat_hash_map.
+typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsUnorderedMap;
+
 // FIXME: Dedup with SetupDummyInputs in test/transaction_tests.cpp.
 //
 // Helper: create two dummy transactions, each with
@@ -84,4 +93,106 @@ static void CCoinsCaching(benchmark::State& state)
     }
 }
 
+static std::vector<COutPoint> CreateOutPoints(size_t n)
+{
+    FastRandomContext rng(true);
+    std::vector<COutPoint> outpoints(n);
+    for (size_t i = 0; i < n; i++) {
+        outpoints[i] = COutPoint(rng.rand256(), i % 4);
+    }
+    return outpoints;
+}
+
+// A P2PKH output, whose script fits in CScript without a separate allocation.
+static CCoinsCacheEntry CreateEntry(size_t i)
+{
+    CCoinsCacheEntry entry;
+    entry.coin.out.nValue = i;
+    entry.coin.out.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+    entry.coin.nHeight = i;
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    return entry;
+}
+
+template <typename Map>
+static void FillCoinsMap(Map& map, const std::vector<COutPoint>& outpoints)
+{
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        map.emplace(outpoints[i], CreateEntry(i));
+    }
+}
+
+// Everything the map takes up, as CCoinsViewCache::DynamicMemoryUsage() counts it.
+template <typename Map>
+static size_t CoinsMapUsage(const Map& map)
+{
+    size_t usage = memusage::DynamicUsage(map);
+    for (const auto& entry : map) {
+        usage += entry.second.coin.DynamicMemoryUsage();
+    }
+    return usage;
+}
+
+// The memory the map takes per coin, rather than the time, is what decides how
+// much of the UTXO set fits in -dbcache. It is reported as bytes_per_coin.
+template <typename Map>
+static void CoinsMapInsert(benchmark::State& state)
+{
+    const std::vector<COutPoint> outpoints = CreateOutPoints(COINS_MAP_SIZE);
+    {
+        Map map;
+        FillCoinsMap(map, outpoints);
+        state.m_counters["bytes_per_coin"] = (double)CoinsMapUsage(map) / map.size();
+    }
+    while (state.KeepRunning()) {
+        Map map;
+        FillCoinsMap(map, outpoints);
+    }
+}
+
+// Half the lookups hit, as when connecting a block spends coins that are
+// cached and fetches the rest from the database.
+template <typename Map>
+static void CoinsMapLookup(benchmark::State& state)
+{
+    const std::vector<COutPoint> outpoints = CreateOutPoints(COINS_MAP_SIZE * 2);
+    Map map;
+    FillCoinsMap(map, std::vector<COutPoint>(outpoints.begin(), outpoints.begin() + COINS_MAP_SIZE));
+    while (state.KeepRunning()) {
+        size_t found = 0;
+        for (const COutPoint& outpoint : outpoints) {
+            found += map.find(outpoint) != map.end();
+        }
+        assert(found == COINS_MAP_SIZE);
+    }
+}
+
+// Draining one map into another the way CCoinsViewCache::BatchWrite() does.
+template <typename Map>
+static void CoinsMapFlush(benchmark::State& state)
+{
+    const std::vector<COutPoint> outpoints = CreateOutPoints(COINS_MAP_SIZE);
+    while (state.KeepRunning()) {
+        Map child, parent;
+        FillCoinsMap(child, outpoints);
+        for (auto it = child.begin(); it != child.end(); it = child.erase(it)) {
+            parent.emplace(it->first, std::move(it->second));
+        }
+        assert(parent.size() == COINS_MAP_SIZE);
+    }
+}
+
+static void CCoinsMapInsert(benchmark::State& state) { CoinsMapInsert<CCoinsMap>(state); }
+static void CCoinsMapInsertUnordered(benchmark::State& state) { CoinsMapInsert<CCoinsUnorderedMap>(state); }
+static void CCoinsMapLookup(benchmark::State& state) { CoinsMapLookup<CCoinsMap>(state); }
+static void CCoinsMapLookupUnordered(benchmark::State& state) { CoinsMapLookup<CCoinsUnorderedMap>(state); }
+static void CCoinsMapFlush(benchmark::State& state) { CoinsMapFlush<CCoinsMap>(state); }
+static void CCoinsMapFlushUnordered(benchmark::State& state) { CoinsMapFlush<CCoinsUnorderedMap>(state); }
+
 BENCHMARK(CCoinsCaching, 170 * 1000);
+BENCHMARK(CCoinsMapInsert, 20);
+BENCHMARK(CCoinsMapInsertUnordered, 20);
+BENCHMARK(CCoinsMapLookup, 50);
+BENCHMARK(CCoinsMapLookupUnordered, 50);
+BENCHMARK(CCoinsMapFlush, 10);
+BENCHMARK(CCoinsMapFlushUnordered, 10);
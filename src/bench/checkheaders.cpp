@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <chainparams.h>
+#include <pow.h>
+#include <txdb.h>
+#include <util.h>
+#include <validation.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <vector>
+
+// A full "headers" message, which is what a syncing node has to check at once.
+static const size_t HEADERS_BATCH_SIZE = 2000;
+static const int MIN_CORES = 2;
+
+// Build a connected batch of headers on top of the genesis block. The bench
+// only measures proof-of-work checking, so the target is relaxed to something
+// nearly every nonce meets instead of actually mining against mainnet.
+static std::vector<CBlockHeader> CreateHeaders(const CBlockHeader& genesis, Consensus::Params& consensusParams)
+{
+    consensusParams.powLimit = uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+    std::vector<CBlockHeader> headers(HEADERS_BATCH_SIZE);
+    uint256 hashPrev = genesis.GetHash();
+    for (size_t i = 0; i < headers.size(); i++) {
+        CBlockHeader& header = headers[i];
+        header.nVersion = 4;
+        header.hashPrevBlock = hashPrev;
+        header.hashMerkleRoot = uint256S(strprintf("%064x", i));
+        header.nTime = genesis.nTime + 60 * (i + 1);
+        header.nBits = 0x2100ffff;
+        header.nNonce = 0;
+        while (!CheckProofOfWork(header.GetPoWHash(), header.nBits, consensusParams)) {
+            ++header.nNonce;
+        }
+        hashPrev = header.GetHash();
+    }
+    return headers;
+}
+
+static void CheckHeadersPoW(benchmark::State& state, int threads)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    ::pblocktree.reset(new CBlockTreeDB(1 << 20, true));
+    ::pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
+    ::pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
+    bool genesis_loaded{LoadGenesisBlock(Params())};
+    assert(genesis_loaded);
+
+    Consensus::Params consensusParams = Params().GetConsensus();
+    const std::vector<CBlockHeader> headers = CreateHeaders(Params().GenesisBlock(), consensusParams);
+
+    nScriptCheckThreads = threads;
+    boost::thread_group tg;
+    for (int i = 0; i < threads - 1; i++) {
+        tg.create_thread(&ThreadPoWCheck);
+    }
+
+    std::vector<char> vPoWValid;
+    std::vector<uint256> vPoWHash;
+    while (state.KeepRunning()) {
+        CheckBlockHeadersPoW(headers, consensusParams, vPoWValid, vPoWHash);
+        if (threads == 0) {
+            for (size_t i = 0; i < headers.size(); i++) {
+                vPoWValid[i] = CheckProofOfWork(headers[i].GetPoWHash(), headers[i].nBits, consensusParams);
+            }
+        }
+        assert(std::find(vPoWValid.begin(), vPoWValid.end(), 0) == vPoWValid.end());
+    }
+
+    tg.interrupt_all();
+    tg.join_all();
+    nScriptCheckThreads = 0;
+    UnloadBlockIndex();
+    ::pcoinsTip.reset();
+    ::pcoinsdbview.reset();
+    ::pblocktree.reset();
+}
+
+// Headers checked one after another, as before the PoW check threads existed.
+static void CheckHeadersPoWSerial(benchmark::State& state)
+{
+    CheckHeadersPoW(state, 0);
+}
+
+static void CheckHeadersPoWParallel(benchmark::State& state)
+{
+    CheckHeadersPoW(state, std::max(MIN_CORES, GetNumCores()));
+}
+
+BENCHMARK(CheckHeadersPoWSerial, 1);
+BENCHMARK(CheckHeadersPoWParallel, 1);
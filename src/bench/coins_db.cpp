@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
+#include <bench/bench.h>
+#include <chainparams.h>
+#include <coins.h>
+#include <random.h>
+#include <txdb.h>
+#include <util.h>
+
+#include <string.h>
+#include <vector>
+
+// Coins written per CoinsDBWrite iteration, and in the database CoinsDBRead reads from.
+static const int COINS_DB_BATCH = 20000;
+static const int COINS_DB_SIZE = 100000;
+// Coins looked up per CoinsDBRead iteration, half of them not in the database.
+static const int COINS_DB_READS = 1000;
+// Makes the write buffer a realistic fraction of the coins written.
+static const size_t COINS_DB_CACHE = 8 << 20;
+
+static Coin RandomCoin(FastRandomContext& rand)
+{
+    Coin coin;
+    coin.out.nValue = rand.randrange(50 * COIN);
+    // Mostly P2PKH and P2WPKH sized scripts, which compress about as well as real ones.
+    coin.out.scriptPubKey.resize(rand.randbool() ? 25 : 22);
+    for (size_t i = 0; i < coin.out.scriptPubKey.size(); i += 8) {
+        uint64_t r = rand.rand64();
+        memcpy(coin.out.scriptPubKey.data() + i, &r, std::min<size_t>(8, coin.out.scriptPubKey.size() - i));
+    }
+    coin.out.scriptPubKey[0] = 0x76;
+    coin.nHeight = 500000 + rand.randrange(10000);
+    return coin;
+}
+
+static void WriteCoins(CCoinsViewDB& db, FastRandomContext& rand, int count, std::vector<COutPoint>* outpoints = nullptr)
+{
+    CCoinsViewCache cache(&db);
+    for (int i = 0; i < count; i++) {
+        COutPoint outpoint(rand.rand256(), rand.randrange(4));
+        if (outpoints) outpoints->push_back(outpoint);
+        cache.AddCoin(outpoint, RandomCoin(rand), false);
+    }
+    cache.SetBestBlock(rand.rand256());
+    cache.Flush();
+}
+
+// Flushes of the coins cache into the chainstate database, as they happen during
+// IBD. The size of the database on disk is reported as bytes_on_disk.
+static void CoinsDBWrite(benchmark::State& state, const std::string& dboption)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    gArgs.ForceSetArg("-dboption", dboption);
+    FastRandomContext rand(true);
+    {
+        CCoinsViewDB db(COINS_DB_CACHE, false, true);
+        while (state.KeepRunning()) {
+            WriteCoins(db, rand, COINS_DB_BATCH);
+        }
+    }
+    {
+        // Reopening the database writes the coins still in its log out to
+        // table files, which are all EstimateSize() counts.
+        CCoinsViewDB db(COINS_DB_CACHE, false, false);
+        state.m_counters["bytes_on_disk"] = db.EstimateSize();
+    }
+    gArgs.ForceSetArg("-dboption", "");
+}
+
+// Lookups of coins that are not in the cache, hits and misses alike.
+static void CoinsDBRead(benchmark::State& state, const std::string& dboption)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    gArgs.ForceSetArg("-dboption", dboption);
+    FastRandomContext rand(true);
+    {
+        CCoinsViewDB db(COINS_DB_CACHE, false, true);
+        std::vector<COutPoint> outpoints;
+        for (int i = 0; i < COINS_DB_SIZE; i += COINS_DB_BATCH) {
+            WriteCoins(db, rand, COINS_DB_BATCH, &outpoints);
+        }
+        uint64_t found = 0;
+        while (state.KeepRunning()) {
+            for (int i = 0; i < COINS_DB_READS; i++) {
+                Coin coin;
+                const COutPoint outpoint = rand.randbool() ? outpoints[rand.randrange(outpoints.size())] : COutPoint(rand.rand256(), 0);
+                found += db.GetCoin(outpoint, coin);
+            }
+        }
+        assert(found > 0);
+    }
+    gArgs.ForceSetArg("-dboption", "");
+}
+
+static void CoinsDBWriteDefault(benchmark::State& state) { CoinsDBWrite(state, ""); }
+#ifdef USE_SNAPPY
+static void CoinsDBWriteSnappy(benchmark::State& state) { CoinsDBWrite(state, "chainstate.compression=snappy"); }
+#endif
+static void CoinsDBWriteBlockSize16K(benchmark::State& state) { CoinsDBWrite(state, "chainstate.blocksize=16384"); }
+static void CoinsDBWriteBuffer32M(benchmark::State& state) { CoinsDBWrite(state, "chainstate.writebuffer=32"); }
+static void CoinsDBReadDefault(benchmark::State& state) { CoinsDBRead(state, ""); }
+#ifdef USE_SNAPPY
+static void CoinsDBReadSnappy(benchmark::State& state) { CoinsDBRead(state, "chainstate.compression=snappy"); }
+#endif
+static void CoinsDBReadBlockSize16K(benchmark::State& state) { CoinsDBRead(state, "chainstate.blocksize=16384"); }
+static void CoinsDBReadNoBloom(benchmark::State& state) { CoinsDBRead(state, "chainstate.bloombits=0"); }
+
+BENCHMARK(CoinsDBWriteDefault, 5);
+#ifdef USE_SNAPPY
+BENCHMARK(CoinsDBWriteSnappy, 5);
+#endif
+BENCHMARK(CoinsDBWriteBlockSize16K, 5);
+BENCHMARK(CoinsDBWriteBuffer32M, 5);
+BENCHMARK(CoinsDBReadDefault, 20);
+#ifdef USE_SNAPPY
+BENCHMARK(CoinsDBReadSnappy, 20);
+#endif
+BENCHMARK(CoinsDBReadBlockSize16K, 20);
+BENCHMARK(CoinsDBReadNoBloom, 20);
@@ -0,0 +1,100 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <protocol.h>
+#include <random.h>
+
+#include <algorithm>
+#include <array>
+#include <assert.h>
+#include <string.h>
+
+/**
+ * The commands received by a relay node, by how many of every thousand
+ * messages they make up. Mostly inv and tx, as relaying transactions is.
+ */
+static const std::vector<std::pair<const char*, int>> MSG_MIX{
+    {NetMsgType::INV, 450},
+    {NetMsgType::TX, 200},
+    {NetMsgType::GETDATA, 150},
+    {NetMsgType::NOTFOUND, 40},
+    {NetMsgType::PING, 35},
+    {NetMsgType::PONG, 35},
+    {NetMsgType::ADDR, 30},
+    {NetMsgType::HEADERS, 15},
+    {NetMsgType::FEEFILTER, 10},
+    {NetMsgType::GETHEADERS, 10},
+    {NetMsgType::CMPCTBLOCK, 8},
+    {NetMsgType::GETBLOCKTXN, 5},
+    {NetMsgType::BLOCKTXN, 5},
+    {NetMsgType::SENDCMPCT, 4},
+    {NetMsgType::BLOCK, 3},
+};
+
+/** The commands ProcessMessage used to compare against, in its order */
+static const std::vector<const char*> COMPARE_ORDER{
+    NetMsgType::REJECT, NetMsgType::VERSION, NetMsgType::VERACK, NetMsgType::ADDR,
+    NetMsgType::SENDHEADERS, NetMsgType::SENDCMPCT, NetMsgType::INV, NetMsgType::GETDATA,
+    NetMsgType::GETBLOCKS, NetMsgType::GETBLOCKTXN, NetMsgType::GETHEADERS, NetMsgType::TX,
+    NetMsgType::CMPCTBLOCK, NetMsgType::BLOCKTXN, NetMsgType::HEADERS, NetMsgType::BLOCK,
+    NetMsgType::GETADDR, NetMsgType::MEMPOOL, NetMsgType::PING, NetMsgType::PONG,
+    NetMsgType::FILTERLOAD, NetMsgType::FILTERADD, NetMsgType::FILTERCLEAR,
+    NetMsgType::FEEFILTER, NetMsgType::NOTFOUND,
+};
+
+typedef std::array<char, CMessageHeader::COMMAND_SIZE> RawCommand;
+
+/** The command fields of the headers of a thousand messages in MSG_MIX, shuffled */
+static std::vector<RawCommand> MakeCommands()
+{
+    std::vector<RawCommand> commands;
+    for (const auto& entry : MSG_MIX) {
+        RawCommand command{};
+        memcpy(command.data(), entry.first, std::min(strlen(entry.first), command.size()));
+        commands.insert(commands.end(), entry.second, command);
+    }
+    FastRandomContext rng(true);
+    for (size_t i = commands.size() - 1; i > 0; i--) {
+        std::swap(commands[i], commands[rng.randrange(i + 1)]);
+    }
+    return commands;
+}
+
+static void NetMsgDispatchCompare(benchmark::State& state)
+{
+    const std::vector<RawCommand> commands = MakeCommands();
+    uint64_t dispatched = 0;
+    while (state.KeepRunning()) {
+        for (const RawCommand& command : commands) {
+            const std::string strCommand(command.data(), strnlen(command.data(), command.size()));
+            for (size_t i = 0; i < COMPARE_ORDER.size(); i++) {
+                if (strCommand == COMPARE_ORDER[i]) {
+                    dispatched += i;
+                    break;
+                }
+            }
+        }
+    }
+    assert(dispatched > 0);
+}
+
+static void NetMsgDispatchTable(benchmark::State& state)
+{
+    const std::vector<RawCommand> commands = MakeCommands();
+    std::array<size_t, NUM_NET_MSG_IDS + 1> handlers;
+    for (size_t i = 0; i < handlers.size(); i++) {
+        handlers[i] = i;
+    }
+    uint64_t dispatched = 0;
+    while (state.KeepRunning()) {
+        for (const RawCommand& command : commands) {
+            dispatched += handlers[static_cast<size_t>(GetNetMsgId(command.data()))];
+        }
+    }
+    assert(dispatched > 0);
+}
+
+BENCHMARK(NetMsgDispatchCompare, 1000);
+BENCHMARK(NetMsgDispatchTable, 5000);
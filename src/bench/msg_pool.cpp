@@ -0,0 +1,99 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <chainparams.h>
+#include <net.h>
+#include <protocol.h>
+#include <random.h>
+#include <streams.h>
+#include <version.h>
+
+#include <assert.h>
+
+// Receiving the small messages a relay node mostly gets, as the socket
+// handler does, and giving them back a few at a time as the message
+// handler would after processing them. NetMsgPoolNone does not keep
+// anything, so allocates for every message like CNode used to. The messages
+// and payload buffers allocated per message received are reported as
+// counters, from NetMessagePool::GetStats().
+
+/** Payload sizes of a relay node's messages, by how many of every thousand messages have them */
+static const std::vector<std::pair<unsigned int, int>> MSG_SIZES{
+    {37, 400},   // inv or getdata of one transaction
+    {361, 150},  // inv of ten
+    {250, 120},  // tx
+    {500, 80},   // tx
+    {1200, 40},  // tx
+    {8, 70},     // ping, pong
+    {31, 40},    // addr
+    {0, 20},     // verack, sendheaders, getaddr
+    {1000, 40},  // headers, cmpctblock
+    {20000, 30}, // blocktxn
+    {9000, 10},  // large tx
+};
+
+//! How many messages are received before the message handler gives them back
+static const size_t PROCESS_BATCH = 16;
+
+static void ReceiveMessages(benchmark::State& state, NetMessagePool& pool)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const CMessageHeader::MessageStartChars& message_start = Params().MessageStart();
+    std::vector<unsigned int> sizes;
+    for (const auto& entry : MSG_SIZES) {
+        sizes.insert(sizes.end(), entry.second, entry.first);
+    }
+    FastRandomContext rng(true);
+    for (size_t i = sizes.size() - 1; i > 0; i--) {
+        std::swap(sizes[i], sizes[rng.randrange(i + 1)]);
+    }
+    std::vector<CDataStream> headers;
+    for (unsigned int size : sizes) {
+        headers.emplace_back(SER_NETWORK, PROTOCOL_VERSION);
+        headers.back() << CMessageHeader(message_start, NetMsgType::TX, size);
+    }
+    const std::vector<char> payload(20000, 0x42);
+
+    std::list<CNetMessage> msgs;
+    uint64_t messages = 0;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < sizes.size(); i++) {
+            pool.NewMessage(msgs, message_start);
+            CNetMessage& msg = msgs.back();
+            msg.readHeader(headers[i].data(), headers[i].size());
+            pool.ReserveData(msg);
+            if (sizes[i] > 0) {
+                msg.readData(payload.data(), sizes[i]);
+            }
+            assert(msg.complete());
+            if (msgs.size() == PROCESS_BATCH) {
+                messages += msgs.size();
+                pool.Release(msgs);
+            }
+        }
+    }
+    messages += msgs.size();
+    pool.Release(msgs);
+
+    const NetMessagePool::Stats stats = pool.GetStats();
+    state.m_counters["messages_allocated_per_msg"] = (double)stats.messages_allocated / messages;
+    state.m_counters["buffers_allocated_per_msg"] = (double)stats.buffers_allocated / messages;
+}
+
+static void NetMsgPoolNone(benchmark::State& state)
+{
+    NetMessagePool pool(0, 0);
+    ReceiveMessages(state, pool);
+}
+
+static void NetMsgPoolDefault(benchmark::State& state)
+{
+    NetMessagePool pool;
+    ReceiveMessages(state, pool);
+}
+
+BENCHMARK(NetMsgPoolNone, 500);
+BENCHMARK(NetMsgPoolDefault, 500);
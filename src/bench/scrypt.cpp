@@ -0,0 +1,299 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <chainparams.h>
+#include <crypto/common.h>
+#include <crypto/scrypt.h>
+#include <pow.h>
+#include <primitives/block.h>
+#include <uint256.h>
+#include <util.h>
+#include <utilstrencodings.h>
+
+#include <algorithm>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+/* An 80 byte block header, the only input scrypt is ever used on */
+static const size_t HEADER_SIZE = 80;
+// Hashes per iteration of the throughput benchmarks.
+static const size_t BATCH_SIZE = 256;
+// A full "headers" message.
+static const size_t HEADERS_BATCH_SIZE = 2000;
+static const int MIN_CORES = 2;
+
+static void Scrypt(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256(in.data(), BEGIN(hash));
+        in[76] ^= hash.begin()[0];
+    }
+}
+
+static std::vector<char> CreateInputs(size_t n)
+{
+    std::vector<char> in(n * HEADER_SIZE);
+    for (size_t i = 0; i < n; i++) {
+        WriteLE32((unsigned char*)&in[i * HEADER_SIZE + 76], i);
+    }
+    return in;
+}
+
+// The portable kernel, with the scratchpad reused between hashes.
+static void ScryptGeneric(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp_generic(in.data(), BEGIN(hash), scratchpad.data());
+        in[76] ^= hash.begin()[0];
+    }
+}
+
+#if defined(USE_SSE2)
+static void ScryptSSE2(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp_sse2(in.data(), BEGIN(hash), scratchpad.data());
+        in[76] ^= hash.begin()[0];
+    }
+}
+#endif
+
+// A fresh 128 KiB scratchpad from the heap for every hash.
+static void ScryptScratchpadAlloc(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+        scrypt_1024_1_1_256_sp(in.data(), BEGIN(hash), scratchpad.data());
+        in[76] ^= hash.begin()[0];
+    }
+}
+
+static void ScryptScratchpadReuse(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp(in.data(), BEGIN(hash), scratchpad.data());
+        in[76] ^= hash.begin()[0];
+    }
+}
+
+// A scratchpad on the stack, as scrypt_1024_1_1_256 used before it had a
+// per-thread one.
+static void ScryptScratchpadStack(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+        scrypt_1024_1_1_256_sp(in.data(), BEGIN(hash), scratchpad);
+        in[76] ^= hash.begin()[0];
+    }
+}
+
+// An aligned, huge page backed CScryptScratchpad.
+static void ScryptScratchpadContext(benchmark::State& state)
+{
+    std::vector<char> in(HEADER_SIZE, 0);
+    CScryptScratchpad scratchpad;
+    uint256 hash;
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256(in.data(), BEGIN(hash), scratchpad);
+        in[76] ^= hash.begin()[0];
+    }
+}
+
+// The multi-lane kernels with a new 2 MiB scratchpad for every call, as
+// scrypt_1024_1_1_256_multi did before it reused a per-thread one.
+static void ScryptMultiLaneScratchpadAlloc(benchmark::State& state)
+{
+    const std::vector<char> in = CreateInputs(SCRYPT_MAX_LANES);
+    std::vector<char> out(SCRYPT_MAX_LANES * 32);
+    while (state.KeepRunning()) {
+        CScryptScratchpad scratchpad;
+        scrypt_1024_1_1_256_multi(in.data(), out.data(), SCRYPT_MAX_LANES, scratchpad);
+    }
+}
+
+static void ScryptMultiLaneScratchpadReuse(benchmark::State& state)
+{
+    const std::vector<char> in = CreateInputs(SCRYPT_MAX_LANES);
+    std::vector<char> out(SCRYPT_MAX_LANES * 32);
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_multi(in.data(), out.data(), SCRYPT_MAX_LANES);
+    }
+}
+
+// Split [0, n) into one contiguous slice per thread and run f(begin, end) on each.
+template <typename F>
+static void ParallelFor(size_t n, int threads, F f)
+{
+    std::vector<std::thread> workers;
+    const size_t slice = (n + threads - 1) / threads;
+    for (size_t begin = 0; begin < n; begin += slice) {
+        workers.emplace_back(f, begin, std::min(n, begin + slice));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+static void ScryptBatch(benchmark::State& state, int threads, bool multi)
+{
+    const std::vector<char> in = CreateInputs(BATCH_SIZE);
+    std::vector<char> out(BATCH_SIZE * 32);
+    auto hash_range = [&](size_t begin, size_t end) {
+        if (multi) {
+            scrypt_1024_1_1_256_multi(&in[begin * HEADER_SIZE], &out[begin * 32], end - begin);
+            return;
+        }
+        std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+        for (size_t i = begin; i < end; i++) {
+            scrypt_1024_1_1_256_sp(&in[i * HEADER_SIZE], &out[i * 32], scratchpad.data());
+        }
+    };
+    while (state.KeepRunning()) {
+        if (threads == 1) {
+            hash_range(0, BATCH_SIZE);
+        } else {
+            ParallelFor(BATCH_SIZE, threads, hash_range);
+        }
+    }
+}
+
+static void ScryptBatchSingleThread(benchmark::State& state)
+{
+    ScryptBatch(state, 1, false);
+}
+
+static void ScryptBatchMultiThread(benchmark::State& state)
+{
+    ScryptBatch(state, std::max(MIN_CORES, GetNumCores()), false);
+}
+
+// All the lanes of the widest kernel ScryptAutoDetect() found, on one thread.
+static void ScryptBatchMultiLane(benchmark::State& state)
+{
+    ScryptBatch(state, 1, true);
+}
+
+static void ScryptBatchMultiLaneMultiThread(benchmark::State& state)
+{
+    ScryptBatch(state, std::max(MIN_CORES, GetNumCores()), true);
+}
+
+// Proof-of-work validation of a full "headers" message, from the serialized
+// headers to the target comparison. The target is relaxed so the headers
+// don't need mining; only the hashing and comparison are measured. See
+// checkheaders.cpp for the same batch going through CheckBlockHeadersPoW().
+static void ScryptValidateHeaders(benchmark::State& state, int threads)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    Consensus::Params consensusParams = Params().GetConsensus();
+    consensusParams.powLimit = uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+
+    std::vector<CBlockHeader> headers(HEADERS_BATCH_SIZE);
+    for (size_t i = 0; i < headers.size(); i++) {
+        headers[i].nVersion = 4;
+        headers[i].hashMerkleRoot = uint256S(strprintf("%064x", i));
+        headers[i].nBits = 0x2100ffff;
+        headers[i].nNonce = 0;
+        while (!CheckProofOfWork(headers[i].GetPoWHash(), headers[i].nBits, consensusParams)) {
+            ++headers[i].nNonce;
+        }
+    }
+
+    std::vector<char> vPoWValid(headers.size());
+    auto check_range = [&](size_t begin, size_t end) {
+        std::vector<char> in((end - begin) * HEADER_SIZE);
+        std::vector<uint256> hashes(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            memcpy(&in[(i - begin) * HEADER_SIZE], &headers[i].nVersion, HEADER_SIZE);
+        }
+        scrypt_1024_1_1_256_multi(in.data(), BEGIN(hashes[0]), hashes.size());
+        for (size_t i = begin; i < end; i++) {
+            vPoWValid[i] = CheckProofOfWork(hashes[i - begin], headers[i].nBits, consensusParams);
+        }
+    };
+    while (state.KeepRunning()) {
+        if (threads == 0) {
+            for (size_t i = 0; i < headers.size(); i++) {
+                vPoWValid[i] = CheckProofOfWork(headers[i].GetPoWHash(), headers[i].nBits, consensusParams);
+            }
+        } else {
+            ParallelFor(headers.size(), threads, check_range);
+        }
+        assert(std::find(vPoWValid.begin(), vPoWValid.end(), 0) == vPoWValid.end());
+    }
+}
+
+// One GetPoWHash() after another, as a node did before any of the batching.
+static void ScryptValidateHeadersSerial(benchmark::State& state)
+{
+    ScryptValidateHeaders(state, 0);
+}
+
+static void ScryptValidateHeadersParallel(benchmark::State& state)
+{
+    ScryptValidateHeaders(state, std::max(MIN_CORES, GetNumCores()));
+}
+
+// The PBKDF2 prologue and epilogue of one scrypt hash, keying the HMAC with
+// the header separately for each pass.
+static void ScryptPBKDF2(benchmark::State& state)
+{
+    std::vector<uint8_t> in(HEADER_SIZE, 0);
+    uint8_t B[128];
+    uint8_t out[32];
+    while (state.KeepRunning()) {
+        PBKDF2_SHA256(in.data(), in.size(), in.data(), in.size(), 1, B, sizeof(B));
+        PBKDF2_SHA256(in.data(), in.size(), B, sizeof(B), 1, out, sizeof(out));
+    }
+}
+
+// The same two passes sharing one keyed HMAC, as the scrypt kernels do.
+static void ScryptPBKDF2Keyed(benchmark::State& state)
+{
+    std::vector<uint8_t> in(HEADER_SIZE, 0);
+    uint8_t B[128];
+    uint8_t out[32];
+    while (state.KeepRunning()) {
+        const CHMAC_SHA256 hmac(in.data(), in.size());
+        PBKDF2_SHA256_1(hmac, in.data(), in.size(), B, sizeof(B));
+        PBKDF2_SHA256_1(hmac, B, sizeof(B), out, sizeof(out));
+    }
+}
+
+BENCHMARK(Scrypt, 3000);
+BENCHMARK(ScryptGeneric, 3000);
+#if defined(USE_SSE2)
+BENCHMARK(ScryptSSE2, 3000);
+#endif
+BENCHMARK(ScryptScratchpadAlloc, 3000);
+BENCHMARK(ScryptScratchpadReuse, 3000);
+BENCHMARK(ScryptScratchpadStack, 3000);
+BENCHMARK(ScryptScratchpadContext, 3000);
+BENCHMARK(ScryptMultiLaneScratchpadAlloc, 200);
+BENCHMARK(ScryptMultiLaneScratchpadReuse, 200);
+BENCHMARK(ScryptBatchSingleThread, 10);
+BENCHMARK(ScryptBatchMultiThread, 10);
+BENCHMARK(ScryptBatchMultiLane, 10);
+BENCHMARK(ScryptBatchMultiLaneMultiThread, 10);
+BENCHMARK(ScryptValidateHeadersSerial, 1);
+BENCHMARK(ScryptValidateHeadersParallel, 1);
+BENCHMARK(ScryptPBKDF2, 200000);
+BENCHMARK(ScryptPBKDF2Keyed, 250000);
@@ -0,0 +1,205 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <chainparams.h>
+#include <net.h>
+#include <netbase.h>
+#include <netmessagemaker.h>
+#include <protocol.h>
+#include <scheduler.h>
+#include <streams.h>
+#include <util.h>
+#include <utiltime.h>
+
+#include <thread>
+
+#include <pthread.h>
+#include <time.h>
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+// The CPU time of the socket handler thread per connected peer, waiting for
+// the sockets with select() and with epoll: with the peers idle, reported as
+// handler_us_per_peer_second, and with every peer sending a message per
+// iteration, reported as handler_us_per_msg. The timings themselves are of
+// the bench thread waiting.
+
+static const int SOCKET_EVENTS_PEERS = 300;
+
+//! Counts the messages received instead of processing them
+class CountingMsgProc final : public NetEventsInterface
+{
+public:
+    std::atomic<uint64_t> m_messages{0};
+    //! The socket handler thread, which accepts the peers
+    pthread_t m_socket_handler;
+
+    bool ProcessMessages(CNode* pnode, std::atomic<bool>& interrupt) override
+    {
+        LOCK(pnode->cs_vProcessMsg);
+        m_messages += pnode->vProcessMsg.size();
+        pnode->vProcessMsg.clear();
+        pnode->nProcessQueueSize = 0;
+        pnode->fPauseRecv = false;
+        return false;
+    }
+    bool SendMessages(CNode* pnode) override { return false; }
+    void InitializeNode(CNode* pnode) override { m_socket_handler = pthread_self(); }
+    void FinalizeNode(NodeId id, bool& update_connection_time) override {}
+};
+
+//! A free port on the loopback interface to listen on
+static CService GetFreeLoopbackPort()
+{
+    CService addr = LookupNumeric("127.0.0.1", 0);
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    const bool got_sockaddr = addr.GetSockAddr((struct sockaddr*)&sockaddr, &len);
+    assert(got_sockaddr);
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    assert(s != INVALID_SOCKET);
+    const int bind_ret = bind(s, (struct sockaddr*)&sockaddr, len);
+    assert(bind_ret == 0);
+    const int getsockname_ret = getsockname(s, (struct sockaddr*)&sockaddr, &len);
+    assert(getsockname_ret == 0);
+    const bool set_sockaddr = addr.SetSockAddr((struct sockaddr*)&sockaddr);
+    assert(set_sockaddr);
+    CloseSocket(s);
+    return addr;
+}
+
+//! A CConnman listening on the loopback interface, with peers connected to it
+class SocketEventsSetup
+{
+public:
+    CountingMsgProc m_msgproc;
+    CScheduler m_scheduler;
+    CConnman m_connman{0x1337, 0x1337};
+    std::vector<SOCKET> m_peers;
+
+    explicit SocketEventsSetup(SocketEventsMode mode)
+    {
+        SelectParams(CBaseChainParams::MAIN);
+        gArgs.ForceSetArg("-dnsseed", "0");
+        const CService addr = GetFreeLoopbackPort();
+        CConnman::Options options;
+        options.nMaxConnections = SOCKET_EVENTS_PEERS + MAX_OUTBOUND_CONNECTIONS + 1;
+        options.nMaxOutbound = MAX_OUTBOUND_CONNECTIONS;
+        options.nMaxAddnode = MAX_ADDNODE_CONNECTIONS;
+        options.m_msgproc = &m_msgproc;
+        options.nSendBufferMaxSize = 1000 * DEFAULT_MAXSENDBUFFER;
+        options.nReceiveFloodSize = 1000 * DEFAULT_MAXRECEIVEBUFFER;
+        options.vBinds.push_back(addr);
+        options.m_use_addrman_outgoing = false;
+        options.m_socket_events_mode = mode;
+        const bool started = m_connman.Start(m_scheduler, options);
+        assert(started);
+
+        for (int i = 0; i < SOCKET_EVENTS_PEERS; i++) {
+            SOCKET s = CreateSocket(addr);
+            const bool connected = ConnectSocketDirectly(addr, s, 5000, false);
+            assert(connected);
+            m_peers.push_back(s);
+        }
+        // Peers are counted under cs_vNodes once InitializeNode returned,
+        // so m_msgproc.m_socket_handler is set past this loop.
+        while (m_connman.GetNodeCount(CConnman::CONNECTIONS_IN) < m_peers.size()) {
+            MilliSleep(1);
+        }
+    }
+
+    //! CPU time the socket handler thread used so far
+    int64_t SocketHandlerCPUTimeMicros() const
+    {
+        clockid_t clock;
+        const int clock_error = pthread_getcpuclockid(m_msgproc.m_socket_handler, &clock);
+        assert(!clock_error);
+        struct timespec ts;
+        const int time_error = clock_gettime(clock, &ts);
+        assert(!time_error);
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    ~SocketEventsSetup()
+    {
+        for (SOCKET& s : m_peers) {
+            CloseSocket(s);
+        }
+        m_connman.Interrupt();
+        m_connman.Stop();
+    }
+};
+
+static void SocketEventsIdle(benchmark::State& state, SocketEventsMode mode)
+{
+    SocketEventsSetup setup(mode);
+    const int64_t start = GetTimeMicros();
+    const int64_t cpu_start = setup.SocketHandlerCPUTimeMicros();
+    while (state.KeepRunning()) {
+        MilliSleep(10);
+    }
+    const double seconds = (GetTimeMicros() - start) / 1000000.0;
+    state.m_counters["handler_us_per_peer_second"] = (setup.SocketHandlerCPUTimeMicros() - cpu_start) / seconds / SOCKET_EVENTS_PEERS;
+}
+
+static void SocketEventsBusy(benchmark::State& state, SocketEventsMode mode)
+{
+    SocketEventsSetup setup(mode);
+
+    std::vector<unsigned char> msg;
+    {
+        CSerializedNetMsg ping = CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::PING, uint64_t{0});
+        CMessageHeader hdr(Params().MessageStart(), ping.command.c_str(), ping.data.size());
+        uint256 hash = Hash(ping.data.begin(), ping.data.end());
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+        CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, msg, 0, hdr};
+        msg.insert(msg.end(), ping.data.begin(), ping.data.end());
+    }
+
+    const int64_t cpu_start = setup.SocketHandlerCPUTimeMicros();
+    uint64_t messages = 0;
+    while (state.KeepRunning()) {
+        for (SOCKET s : setup.m_peers) {
+            const ssize_t sent = send(s, (const char*)msg.data(), msg.size(), MSG_NOSIGNAL);
+            assert(sent == (ssize_t)msg.size());
+        }
+        messages += setup.m_peers.size();
+        while (setup.m_msgproc.m_messages < messages) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+    state.m_counters["handler_us_per_msg"] = (double)(setup.SocketHandlerCPUTimeMicros() - cpu_start) / messages;
+}
+
+static void SocketEventsIdleSelect(benchmark::State& state)
+{
+    SocketEventsIdle(state, SocketEventsMode::SELECT);
+}
+
+static void SocketEventsBusySelect(benchmark::State& state)
+{
+    SocketEventsBusy(state, SocketEventsMode::SELECT);
+}
+
+BENCHMARK(SocketEventsIdleSelect, 100);
+BENCHMARK(SocketEventsBusySelect, 50);
+
+#ifdef USE_EPOLL
+static void SocketEventsIdleEpoll(benchmark::State& state)
+{
+    SocketEventsIdle(state, SocketEventsMode::EPOLL);
+}
+
+static void SocketEventsBusyEpoll(benchmark::State& state)
+{
+    SocketEventsBusy(state, SocketEventsMode::EPOLL);
+}
+
+BENCHMARK(SocketEventsIdleEpoll, 100);
+BENCHMARK(SocketEventsBusyEpoll, 50);
+#endif
@@ -213,6 +213,11 @@ public:
     uint32_t nBits;
     uint32_t nNonce;
 
+    //! scrypt proof-of-work hash of the header, null if it was never computed
+    //! (e.g. for entries written by older versions). Protected by cs_main once
+    //! the entry is in mapBlockIndex, as the PoW audit thread may set it.
+    uint256 hashPoW;
+
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     int32_t nSequenceId;
 
@@ -240,6 +245,7 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
+        hashPoW        = uint256();
     }
 
     CBlockIndex()
@@ -294,11 +300,6 @@ public:
         return *phashBlock;
     }
 
-    uint256 GetBlockPoWHash() const
-    {
-        return GetBlockHeader().GetPoWHash();
-    }
-
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -371,6 +372,11 @@ int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& fr
 const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex* pb);
 
 
+/** Version of the optional fields appended to serialized CDiskBlockIndex entries. */
+static const int DISK_BLOCK_INDEX_EXT_VERSION = 1;
+/** Set in the version a CDiskBlockIndex entry is written with when optional fields follow it. */
+static const int DISK_BLOCK_INDEX_EXT_FLAG = 0x40000000;
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -385,13 +391,40 @@ public:
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
     }
 
-    ADD_SERIALIZE_METHODS;
+    // Optional fields go after the header, behind their own version number,
+    // and DISK_BLOCK_INDEX_EXT_FLAG is set in the version written before the
+    // entry. Older versions ignore both when reading, and rewrite an entry
+    // with their own version and without the fields, so an entry without
+    // them is simply read as unknown.
+    template <typename Stream>
+    void Serialize(Stream& s) const {
+        int nSerVersion = s.GetVersion() & ~DISK_BLOCK_INDEX_EXT_FLAG;
+        if (!hashPoW.IsNull() && !(s.GetType() & SER_GETHASH))
+            nSerVersion |= DISK_BLOCK_INDEX_EXT_FLAG;
+        NCONST_PTR(this)->SerializationOp(s, CSerActionSerialize(), nSerVersion);
+        if (nSerVersion & DISK_BLOCK_INDEX_EXT_FLAG) {
+            int nExtVersion = DISK_BLOCK_INDEX_EXT_VERSION;
+            s << VARINT(nExtVersion, VarIntMode::NONNEGATIVE_SIGNED);
+            s << hashPoW;
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s) {
+        int nSerVersion = 0;
+        SerializationOp(s, CSerActionUnserialize(), nSerVersion);
+        if (nSerVersion & DISK_BLOCK_INDEX_EXT_FLAG) {
+            int nExtVersion;
+            s >> VARINT(nExtVersion, VarIntMode::NONNEGATIVE_SIGNED);
+            if (nExtVersion >= 1)
+                s >> hashPoW;
+        }
+    }
 
     template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action) {
-        int _nVersion = s.GetVersion();
+    inline void SerializationOp(Stream& s, Operation ser_action, int& nSerVersion) {
         if (!(s.GetType() & SER_GETHASH))
-            READWRITE(VARINT(_nVersion, VarIntMode::NONNEGATIVE_SIGNED));
+            READWRITE(VARINT(nSerVersion, VarIntMode::NONNEGATIVE_SIGNED));
 
         READWRITE(VARINT(nHeight, VarIntMode::NONNEGATIVE_SIGNED));
         READWRITE(VARINT(nStatus));
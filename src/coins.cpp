@@ -31,7 +31,7 @@ size_t CCoinsViewBacked::EstimateSize() const { return base->EstimateSize(); }
 
 SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0), nEpoch(0), nHits(0), nMisses(0), nEvicted(0) {}
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
     return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
@@ -39,12 +39,17 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
 
 CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const {
     CCoinsMap::iterator it = cacheCoins.find(outpoint);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        nHits++;
+        it->second.epoch = nEpoch;
         return it;
+    }
+    nMisses++;
     Coin tmp;
     if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(tmp))).first;
+    ret->second.epoch = nEpoch;
     if (ret->second.coin.IsSpent()) {
         // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
@@ -81,9 +86,22 @@ void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possi
     }
     it->second.coin = std::move(coin);
     it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    it->second.epoch = nEpoch;
     cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
 }
 
+bool CCoinsViewCache::CacheCoin(const COutPoint& outpoint, Coin&& coin) {
+    assert(!coin.IsSpent());
+    CCoinsMap::iterator it;
+    bool inserted;
+    std::tie(it, inserted) = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(coin)));
+    if (inserted) {
+        it->second.epoch = nEpoch;
+        cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+    }
+    return inserted;
+}
+
 void AddCoins(CCoinsViewCache& cache, const CTransaction &tx, int nHeight, bool check) {
     bool fCoinbase = tx.IsCoinBase();
     const uint256& txid = tx.GetHash();
@@ -143,6 +161,7 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
 }
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+    nEpoch++;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
         // Ignore non-dirty entries (optimization).
         if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
@@ -159,6 +178,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                 entry.coin = std::move(it->second.coin);
                 cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
                 entry.flags = CCoinsCacheEntry::DIRTY;
+                entry.epoch = nEpoch;
                 // We can mark it FRESH in the parent if it was FRESH in the child
                 // Otherwise it might have just been flushed from the parent's cache
                 // and already exist in the grandparent
@@ -188,6 +208,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                 itUs->second.coin = std::move(it->second.coin);
                 cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
                 itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                itUs->second.epoch = nEpoch;
                 // NOTE: It is possible the child has a FRESH flag here in
                 // the event the entry we found in the parent is pruned. But
                 // we must not copy that FRESH flag to the parent as that
@@ -207,6 +228,68 @@ bool CCoinsViewCache::Flush() {
     return fOk;
 }
 
+// Entries unused for this many epochs or more count as equally old.
+static const uint32_t MAX_AGE = 1024;
+
+bool CCoinsViewCache::Sync(size_t nTargetUsage) {
+    // The number and coin memory of the unspent entries of each age, and
+    // what is handed to the base whatever is kept.
+    std::vector<size_t> vCount(MAX_AGE + 1), vCoinsUsage(MAX_AGE + 1);
+    size_t nDirty = 0, nDirtyUsage = 0;
+    for (const auto& entry : cacheCoins) {
+        if (entry.second.flags & CCoinsCacheEntry::DIRTY) {
+            nDirty++;
+            nDirtyUsage += entry.second.coin.DynamicMemoryUsage();
+        }
+        if (!entry.second.coin.IsSpent()) {
+            const uint32_t nAge = std::min(nEpoch - entry.second.epoch, MAX_AGE);
+            vCount[nAge]++;
+            vCoinsUsage[nAge] += entry.second.coin.DynamicMemoryUsage();
+        }
+    }
+    nDirtyUsage += memusage::ReservedUsage(cacheCoins, nDirty);
+    // Keep whole ages, youngest first, while they fit next to the modified
+    // entries. Those are copied only if they stay; the rest are moved.
+    uint32_t nMinAge = MAX_AGE + 1;
+    size_t nUnspent = 0, nKeptUsage = 0;
+    for (uint32_t nAge = 0; nAge <= MAX_AGE; nAge++) {
+        nUnspent += vCount[nAge];
+        nKeptUsage += vCoinsUsage[nAge];
+    }
+    size_t nKept = nUnspent;
+    while (nMinAge > 0 && nDirtyUsage + nKeptUsage + memusage::ReservedUsage(cacheCoins, nKept) > nTargetUsage) {
+        nMinAge--;
+        nKept -= vCount[nMinAge];
+        nKeptUsage -= vCoinsUsage[nMinAge];
+    }
+
+    CCoinsMap mapDirty;
+    mapDirty.reserve(nDirty);
+    {
+        CCoinsMap mapKept;
+        mapKept.reserve(nKept);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ++it) {
+            const bool fKeep = !it->second.coin.IsSpent() && std::min(nEpoch - it->second.epoch, MAX_AGE) < nMinAge;
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                if (!fKeep) {
+                    mapDirty.emplace(std::piecewise_construct, std::forward_as_tuple(it->first), std::forward_as_tuple(std::move(it->second)));
+                    continue;
+                }
+                mapDirty.emplace(std::piecewise_construct, std::forward_as_tuple(it->first), std::forward_as_tuple(it->second));
+                it->second.flags = 0;
+            } else if (!fKeep) {
+                continue;
+            }
+            mapKept.emplace(std::piecewise_construct, std::forward_as_tuple(it->first), std::forward_as_tuple(std::move(it->second)));
+        }
+        // The old map is released here, before the base takes its time writing.
+        cacheCoins.swap(mapKept);
+    }
+    cachedCoinsUsage = nKeptUsage;
+    nEvicted += nUnspent - nKept;
+    return base->BatchWrite(mapDirty, hashBlock);
+}
+
 void CCoinsViewCache::Uncache(const COutPoint& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
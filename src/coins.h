@@ -9,6 +9,7 @@
 #include <primitives/transaction.h>
 #include <compressor.h>
 #include <core_memusage.h>
+#include <flathashmap.h>
 #include <hash.h>
 #include <memusage.h>
 #include <serialize.h>
@@ -17,6 +18,7 @@
 #include <assert.h>
 #include <stdint.h>
 
+#include <limits>
 #include <unordered_map>
 
 /**
@@ -85,7 +87,7 @@ class SaltedOutpointHasher
 {
 private:
     /** Salt */
-    const uint64_t k0, k1;
+    uint64_t k0, k1;
 
 public:
     SaltedOutpointHasher();
@@ -104,6 +106,7 @@ struct CCoinsCacheEntry
 {
     Coin coin; // The actual cached data.
     unsigned char flags;
+    uint32_t epoch; // The owning cache's epoch when this entry was last used, for eviction.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -115,11 +118,11 @@ struct CCoinsCacheEntry
          */
     };
 
-    CCoinsCacheEntry() : flags(0) {}
-    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
+    CCoinsCacheEntry() : flags(0), epoch(0) {}
+    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0), epoch(0) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+typedef flat_hash_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -211,6 +214,16 @@ protected:
     /* Cached dynamic memory usage for the inner Coin objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Advanced for every batch of changes written into this cache (every
+     * block, for the tip), and stamped onto entries as they are used. */
+    uint32_t nEpoch;
+
+    /* Lookups answered from the cache, lookups passed on to the base, and
+     * unspent entries dropped by Sync(). */
+    mutable uint64_t nHits;
+    mutable uint64_t nMisses;
+    uint64_t nEvicted;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
 
@@ -254,6 +267,14 @@ public:
      */
     void AddCoin(const COutPoint& outpoint, Coin&& coin, bool potential_overwrite);
 
+    /**
+     * Add a coin read from the backing view ahead of time, unless the outpoint
+     * is in the cache already. The coin must be what the backing view holds
+     * for the outpoint; it is cached unmodified, like a coin fetched on a miss.
+     * Returns whether it was added.
+     */
+    bool CacheCoin(const COutPoint& outpoint, Coin&& coin);
+
     /**
      * Spend a coin. Pass moveto in order to get the deleted data.
      * If no unspent output exists for the passed outpoint, this call
@@ -268,6 +289,17 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush(),
+     * but keep entries cached, now unmodified, while they and the modifications
+     * handed to the base together use at most nTargetUsage. Entries unused for
+     * the most epochs are evicted first, and spent ones are dropped. The kept
+     * entries are moved into a fresh map, so the memory of the others is
+     * returned, and only modified entries that stay cached are copied.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Sync(size_t nTargetUsage = std::numeric_limits<size_t>::max());
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
@@ -280,6 +312,11 @@ public:
     //! Calculate the size of the cache (in bytes)
     size_t DynamicMemoryUsage() const;
 
+    //! Lookups answered from the cache, lookups that went to the base, and entries evicted so far
+    uint64_t GetHits() const { return nHits; }
+    uint64_t GetMisses() const { return nMisses; }
+    uint64_t GetEvicted() const { return nEvicted; }
+
     /**
      * Amount of bitcoins coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -0,0 +1,186 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Copyright (c) 2009-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <coinstats.h>
+
+#include <chain.h>
+#include <coins.h>
+#include <crypto/muhash.h>
+#include <hash.h>
+#include <serialize.h>
+#include <shutdown.h>
+#include <streams.h>
+#include <sync.h>
+#include <txdb.h>
+#include <util.h>
+#include <validation.h>
+
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase ? 1u : 0u);
+    stats.nTransactions++;
+    for (const auto& output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out.scriptPubKey;
+        ss << VARINT(output.second.out.nValue, VarIntMode::NONNEGATIVE_SIGNED);
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += output.second.out.nValue;
+        stats.nBogoSize += GetBogoSize(output.second.out.scriptPubKey);
+    }
+    ss << VARINT(0u);
+}
+
+uint64_t GetBogoSize(const CScript& scriptPubKey)
+{
+    return 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
+           2 /* scriptPubKey len */ + scriptPubKey.size() /* scriptPubKey */;
+}
+
+//! The element a coin is in the MuHash of the UTXO set
+static std::vector<unsigned char> CoinHashElement(const COutPoint& outpoint, const Coin& coin)
+{
+    std::vector<unsigned char> data;
+    CVectorWriter(SER_DISK, PROTOCOL_VERSION, data, 0, outpoint, static_cast<uint32_t>(coin.nHeight * 2 + coin.fCoinBase), coin.out);
+    return data;
+}
+
+void ApplyCoinHash(MuHash3072& muhash, const COutPoint& outpoint, const Coin& coin)
+{
+    const std::vector<unsigned char> data = CoinHashElement(outpoint, coin);
+    muhash.Insert(Span<const unsigned char>(data.data(), data.size()));
+}
+
+void RemoveCoinHash(MuHash3072& muhash, const COutPoint& outpoint, const Coin& coin)
+{
+    const std::vector<unsigned char> data = CoinHashElement(outpoint, coin);
+    muhash.Remove(Span<const unsigned char>(data.data(), data.size()));
+}
+
+//! Add up the coins of one range of txids, hashing them into muhash unless it is null
+static bool ApplyStatsRange(CCoinsViewCursor& cursor, CCoinsStats& stats, MuHash3072* muhash)
+{
+    uint256 prevkey;
+    while (cursor.Valid()) {
+        // The range's thread cannot be interrupted, so it stops on its own.
+        if (ShutdownRequested()) {
+            return false;
+        }
+        COutPoint key;
+        Coin coin;
+        if (!cursor.GetKey(key) || !cursor.GetValue(coin)) {
+            return error("%s: unable to read value", __func__);
+        }
+        // All the outputs of a transaction are next to each other in one range.
+        if (stats.nTransactionOutputs == 0 || key.hash != prevkey) {
+            stats.nTransactions++;
+            prevkey = key.hash;
+        }
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += coin.out.nValue;
+        stats.nBogoSize += GetBogoSize(coin.out.scriptPubKey);
+        if (muhash) {
+            ApplyCoinHash(*muhash, key, coin);
+        }
+        cursor.Next();
+    }
+    return true;
+}
+
+bool GetUTXOStats(CCoinsViewDB* view, CCoinsStats& stats, CoinStatsHashType hash_type, int nThreads)
+{
+    // A serialized hash has to be fed the coins in order.
+    if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
+        nThreads = 1;
+    }
+    nThreads = std::max(1, std::min(nThreads, MAX_UTXO_STATS_THREADS));
+    std::vector<std::unique_ptr<CCoinsViewCursor>> cursors = view->Cursors(nThreads);
+
+    stats.hashBlock = cursors[0]->GetBestBlock();
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindex = LookupBlockIndex(stats.hashBlock);
+        if (pindex) {
+            stats.nHeight = pindex->nHeight;
+        }
+    }
+
+    if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
+        CCoinsViewCursor* pcursor = cursors[0].get();
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << stats.hashBlock;
+        uint256 prevkey;
+        std::map<uint32_t, Coin> outputs;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            COutPoint key;
+            Coin coin;
+            if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+                if (!outputs.empty() && key.hash != prevkey) {
+                    ApplyStats(stats, ss, prevkey, outputs);
+                    outputs.clear();
+                }
+                prevkey = key.hash;
+                outputs[key.n] = std::move(coin);
+            } else {
+                return error("%s: unable to read value", __func__);
+            }
+            pcursor->Next();
+        }
+        if (!outputs.empty()) {
+            ApplyStats(stats, ss, prevkey, outputs);
+        }
+        stats.hashSerialized = ss.GetHash();
+    } else {
+        // Every range is added up on its own; the sums and the MuHashes of
+        // the ranges combine into those of the whole set.
+        std::vector<CCoinsStats> vStats(nThreads);
+        std::vector<MuHash3072> vMuHash(nThreads);
+        std::vector<char> vOk(nThreads);
+        auto scan = [&](int i) {
+            try {
+                vOk[i] = ApplyStatsRange(*cursors[i], vStats[i], hash_type == CoinStatsHashType::MUHASH ? &vMuHash[i] : nullptr);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 1; i < nThreads; i++) {
+            threads.emplace_back([&scan, i] {
+                RenameThread("stredle-utxo");
+                scan(i);
+            });
+        }
+        scan(0);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        MuHash3072 muhash;
+        for (int i = 0; i < nThreads; i++) {
+            if (!vOk[i]) {
+                return false;
+            }
+            stats.nTransactions += vStats[i].nTransactions;
+            stats.nTransactionOutputs += vStats[i].nTransactionOutputs;
+            stats.nTotalAmount += vStats[i].nTotalAmount;
+            stats.nBogoSize += vStats[i].nBogoSize;
+            muhash *= vMuHash[i];
+        }
+        if (hash_type == CoinStatsHashType::MUHASH) {
+            muhash.Finalize(stats.hashSerialized);
+        }
+    }
+    stats.nDiskSize = view->EstimateSize();
+    return true;
+}
@@ -0,0 +1,57 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Copyright (c) 2009-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSTATS_H
+#define BITCOIN_COINSTATS_H
+
+#include <amount.h>
+#include <uint256.h>
+
+#include <stdint.h>
+
+class CCoinsViewDB;
+class COutPoint;
+class CScript;
+class Coin;
+class MuHash3072;
+
+/** Which hash of the UTXO set to compute along with the statistics. */
+enum class CoinStatsHashType {
+    //! hash_serialized_2: SHA256 over the whole set in key order; one thread has to walk it all
+    HASH_SERIALIZED,
+    //! MuHash3072 over the coins, which does not depend on their order
+    MUHASH,
+    NONE,
+};
+
+struct CCoinsStats
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nBogoSize;
+    uint256 hashSerialized;
+    uint64_t nDiskSize;
+    CAmount nTotalAmount;
+
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
+};
+
+/** Maximum number of threads GetUTXOStats() splits the set between */
+static const int MAX_UTXO_STATS_THREADS = 16;
+
+//! Calculate statistics about the unspent transaction output set. Unless a
+//! serialized hash is asked for, the set is split between nThreads threads.
+bool GetUTXOStats(CCoinsViewDB* view, CCoinsStats& stats, CoinStatsHashType hash_type, int nThreads = 1);
+
+//! A meaningless metric for the size of a coin in the UTXO set
+uint64_t GetBogoSize(const CScript& scriptPubKey);
+
+//! Add a coin to, or take it out of, a MuHash of the UTXO set
+void ApplyCoinHash(MuHash3072& muhash, const COutPoint& outpoint, const Coin& coin);
+void RemoveCoinHash(MuHash3072& muhash, const COutPoint& outpoint, const Coin& coin);
+
+#endif // BITCOIN_COINSTATS_H
@@ -102,6 +102,14 @@ typedef void* sockopt_arg_type;
 typedef char* sockopt_arg_type;
 #endif
 
+// The socket handler waits for sockets with edge-triggered epoll where it is
+// available, which is not limited to FD_SETSIZE sockets. Other waits for a
+// single socket then use poll() for the same reason.
+#if defined(__linux__)
+#define USE_EPOLL
+#endif
+
+/** Whether a socket can be waited for with select(), which only takes sockets below FD_SETSIZE */
 bool static inline IsSelectableSocket(const SOCKET& s) {
 #ifdef WIN32
     return true;
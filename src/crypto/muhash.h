@@ -0,0 +1,101 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <serialize.h>
+#include <span.h>
+#include <uint256.h>
+
+#include <stdint.h>
+
+/** An integer modulo the prime 2^3072 - 1103717. */
+class Num3072
+{
+public:
+    static constexpr size_t BYTE_SIZE = 384;
+
+#ifdef __SIZEOF_INT128__
+    typedef unsigned __int128 double_limb_t;
+    typedef uint64_t limb_t;
+    static constexpr int LIMBS = 48;
+    static constexpr int LIMB_SIZE = 64;
+#else
+    typedef uint64_t double_limb_t;
+    typedef uint32_t limb_t;
+    static constexpr int LIMBS = 96;
+    static constexpr int LIMB_SIZE = 32;
+#endif
+    static_assert(LIMBS * LIMB_SIZE == 3072, "Num3072 is not 3072 bits");
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    /** Load a little-endian number; any 3072-bit value is accepted and reduced when used. */
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    void Divide(const Num3072& a);
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        for (limb_t& limb : limbs) {
+            READWRITE(limb);
+        }
+    }
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+    void Reduce(const limb_t (&product)[2 * LIMBS]);
+    Num3072 GetInverse() const;
+};
+
+/** A hash of a set of byte strings that can be updated an element at a time,
+ *  in any order: MuHash over the multiplicative group modulo 2^3072 - 1103717.
+ *
+ * Every element is hashed to a number with SHA256 and ChaCha20; the set is the
+ * product of those numbers. Removing an element divides by its number, so the
+ * hash of a set does not depend on how it was arrived at, and hashes of
+ * disjoint sets combine by multiplication. Divisions are collected in a
+ * separate denominator so that the one expensive inversion happens only in
+ * Finalize().
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(Span<const unsigned char> in);
+
+public:
+    /** The hash of the empty set. */
+    MuHash3072() {}
+
+    MuHash3072& Insert(Span<const unsigned char> in);
+    MuHash3072& Remove(Span<const unsigned char> in);
+
+    /** Combine with the hash of a disjoint set, or take out that of a subset. */
+    MuHash3072& operator*=(const MuHash3072& mul);
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    /** The 256-bit hash of the set. Leaves this object equivalent to what it was. */
+    void Finalize(uint256& out);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(numerator);
+        READWRITE(denominator);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -28,11 +28,21 @@
  */
 
 #include <crypto/scrypt.h>
+#include <crypto/common.h>
 
+#include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <openssl/sha.h>
+
+#include <new>
+#include <vector>
+
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
 #ifdef _MSC_VER
@@ -42,6 +52,20 @@
 // GCC Linux or i686-w64-mingw32
 #include <cpuid.h>
 #endif
+#elif defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+namespace scrypt_avx2
+{
+void ROMix_8way(uint32_t* state, uint32_t* scratchpad);
+}
+
+namespace scrypt_avx512f
+{
+void ROMix_16way(uint32_t* state, uint32_t* scratchpad);
+}
 #endif
 #ifndef __FreeBSD__
 static inline uint32_t be32dec(const void *pp)
@@ -61,74 +85,6 @@ static inline void be32enc(void *pp, uint32_t x)
 }
 
 #endif
-typedef struct HMAC_SHA256Context {
-	SHA256_CTX ictx;
-	SHA256_CTX octx;
-} HMAC_SHA256_CTX;
-
-/* Initialize an HMAC-SHA256 operation with the given key. */
-static void
-HMAC_SHA256_Init(HMAC_SHA256_CTX *ctx, const void *_K, size_t Klen)
-{
-	unsigned char pad[64];
-	unsigned char khash[32];
-	const unsigned char *K = (const unsigned char *)_K;
-	size_t i;
-
-	/* If Klen > 64, the key is really SHA256(K). */
-	if (Klen > 64) {
-		SHA256_Init(&ctx->ictx);
-		SHA256_Update(&ctx->ictx, K, Klen);
-		SHA256_Final(khash, &ctx->ictx);
-		K = khash;
-		Klen = 32;
-	}
-
-	/* Inner SHA256 operation is SHA256(K xor [block of 0x36] || data). */
-	SHA256_Init(&ctx->ictx);
-	memset(pad, 0x36, 64);
-	for (i = 0; i < Klen; i++)
-		pad[i] ^= K[i];
-	SHA256_Update(&ctx->ictx, pad, 64);
-
-	/* Outer SHA256 operation is SHA256(K xor [block of 0x5c] || hash). */
-	SHA256_Init(&ctx->octx);
-	memset(pad, 0x5c, 64);
-	for (i = 0; i < Klen; i++)
-		pad[i] ^= K[i];
-	SHA256_Update(&ctx->octx, pad, 64);
-
-	/* Clean the stack. */
-	memset(khash, 0, 32);
-}
-
-/* Add bytes to the HMAC-SHA256 operation. */
-static void
-HMAC_SHA256_Update(HMAC_SHA256_CTX *ctx, const void *in, size_t len)
-{
-	/* Feed data to the inner SHA256 operation. */
-	SHA256_Update(&ctx->ictx, in, len);
-}
-
-/* Finish an HMAC-SHA256 operation. */
-static void
-HMAC_SHA256_Final(unsigned char digest[32], HMAC_SHA256_CTX *ctx)
-{
-	unsigned char ihash[32];
-
-	/* Finish the inner SHA256 operation. */
-	SHA256_Final(ihash, &ctx->ictx);
-
-	/* Feed the inner hash to the outer SHA256 operation. */
-	SHA256_Update(&ctx->octx, ihash, 32);
-
-	/* Finish the outer SHA256 operation. */
-	SHA256_Final(digest, &ctx->octx);
-
-	/* Clean the stack. */
-	memset(ihash, 0, 32);
-}
-
 /**
  * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
  * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
@@ -138,37 +94,36 @@ void
 PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
     size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen)
 {
-	HMAC_SHA256_CTX PShctx, hctx;
-	size_t i;
-	uint8_t ivec[4];
+	const CHMAC_SHA256 Phctx(passwd, passwdlen);
 	uint8_t U[32];
 	uint8_t T[32];
 	uint64_t j;
 	int k;
-	size_t clen;
+
+	if (c == 1) {
+		PBKDF2_SHA256_1(Phctx, salt, saltlen, buf, dkLen);
+		return;
+	}
 
 	/* Compute HMAC state after processing P and S. */
-	HMAC_SHA256_Init(&PShctx, passwd, passwdlen);
-	HMAC_SHA256_Update(&PShctx, salt, saltlen);
+	CHMAC_SHA256 PShctx = Phctx;
+	PShctx.Write(salt, saltlen);
 
 	/* Iterate through the blocks. */
-	for (i = 0; i * 32 < dkLen; i++) {
+	for (size_t i = 0; i * 32 < dkLen; i++) {
+		uint8_t ivec[4];
 		/* Generate INT(i + 1). */
 		be32enc(ivec, (uint32_t)(i + 1));
 
 		/* Compute U_1 = PRF(P, S || INT(i)). */
-		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
-		HMAC_SHA256_Update(&hctx, ivec, 4);
-		HMAC_SHA256_Final(U, &hctx);
+		CHMAC_SHA256(PShctx).Write(ivec, 4).Finalize(U);
 
 		/* T_i = U_1 ... */
 		memcpy(T, U, 32);
 
 		for (j = 2; j <= c; j++) {
 			/* Compute U_j. */
-			HMAC_SHA256_Init(&hctx, passwd, passwdlen);
-			HMAC_SHA256_Update(&hctx, U, 32);
-			HMAC_SHA256_Final(U, &hctx);
+			CHMAC_SHA256(Phctx).Write(U, 32).Finalize(U);
 
 			/* ... xor U_j ... */
 			for (k = 0; k < 32; k++)
@@ -176,14 +131,44 @@ PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
 		}
 
 		/* Copy as many bytes as necessary into buf. */
-		clen = dkLen - i * 32;
+		size_t clen = dkLen - i * 32;
 		if (clen > 32)
 			clen = 32;
 		memcpy(&buf[i * 32], T, clen);
 	}
+}
 
-	/* Clean PShctx, since we never called _Final on it. */
-	memset(&PShctx, 0, sizeof(HMAC_SHA256_CTX));
+/**
+ * PBKDF2_SHA256_1(Phctx, salt, saltlen, buf, dkLen):
+ * Compute PBKDF2(passwd, salt, 1, dkLen) from an HMAC-SHA256 already keyed
+ * with passwd.  Both PBKDF2 passes of a scrypt hash use the block header as
+ * the password, so keying once lets them share the inner and outer midstates.
+ */
+void
+PBKDF2_SHA256_1(const CHMAC_SHA256& Phctx, const uint8_t *salt,
+    size_t saltlen, uint8_t *buf, size_t dkLen)
+{
+	uint8_t U[32];
+
+	/* Compute HMAC state after processing P and S. */
+	CHMAC_SHA256 PShctx = Phctx;
+	PShctx.Write(salt, saltlen);
+
+	/* Iterate through the blocks. */
+	for (size_t i = 0; i * 32 < dkLen; i++) {
+		uint8_t ivec[4];
+		/* Generate INT(i + 1). */
+		be32enc(ivec, (uint32_t)(i + 1));
+
+		/* With a single iteration, T_i = U_1 = PRF(P, S || INT(i)). */
+		size_t clen = dkLen - i * 32;
+		if (clen >= 32) {
+			CHMAC_SHA256(PShctx).Write(ivec, 4).Finalize(&buf[i * 32]);
+		} else {
+			CHMAC_SHA256(PShctx).Write(ivec, 4).Finalize(U);
+			memcpy(&buf[i * 32], U, clen);
+		}
+	}
 }
 
 #define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
@@ -263,7 +248,8 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 
 	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
 
-	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
+	const CHMAC_SHA256 hmac((const uint8_t *)input, 80);
+	PBKDF2_SHA256_1(hmac, (const uint8_t *)input, 80, B, 128);
 
 	for (k = 0; k < 32; k++)
 		X[k] = le32dec(&B[4 * k]);
@@ -284,7 +270,7 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 	for (k = 0; k < 32; k++)
 		le32enc(&B[4 * k], X[k]);
 
-	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
+	PBKDF2_SHA256_1(hmac, B, 128, (uint8_t *)output, 32);
 }
 
 #if defined(USE_SSE2)
@@ -325,8 +311,233 @@ std::string scrypt_detect_sse2()
 }
 #endif
 
+// Transparent huge pages only back 2 MiB aligned regions.
+static const size_t SCRYPT_SCRATCHPAD_ALIGN = 1 << 21;
+static const size_t SCRYPT_SCRATCHPAD_BYTES = 1024 * 32 * sizeof(uint32_t) * SCRYPT_MAX_LANES;
+
+CScryptScratchpad::~CScryptScratchpad()
+{
+#ifdef WIN32
+    _aligned_free(m_data);
+#else
+    free(m_data);
+#endif
+}
+
+char* CScryptScratchpad::Get()
+{
+    if (m_data != nullptr)
+        return m_data;
+#ifdef WIN32
+    m_data = (char *)_aligned_malloc(SCRYPT_SCRATCHPAD_BYTES, SCRYPT_SCRATCHPAD_ALIGN);
+#else
+    void *p = nullptr;
+    if (posix_memalign(&p, SCRYPT_SCRATCHPAD_ALIGN, SCRYPT_SCRATCHPAD_BYTES) == 0)
+        m_data = (char *)p;
+#if defined(MADV_HUGEPAGE)
+    // Only a hint; without huge page support this fails and nothing changes.
+    if (m_data != nullptr)
+        madvise(m_data, SCRYPT_SCRATCHPAD_BYTES, MADV_HUGEPAGE);
+#endif
+#endif
+    if (m_data == nullptr)
+        throw std::bad_alloc();
+    return m_data;
+}
+
+#if defined(HAVE_THREAD_LOCAL)
+static CScryptScratchpad& ThreadScratchpad()
+{
+    static thread_local CScryptScratchpad scratchpad;
+    return scratchpad;
+}
+#endif
+
+void scrypt_1024_1_1_256(const char *input, char *output, CScryptScratchpad& scratchpad)
+{
+    scrypt_1024_1_1_256_sp(input, output, scratchpad.Get());
+}
+
 void scrypt_1024_1_1_256(const char *input, char *output)
 {
+#if defined(HAVE_THREAD_LOCAL)
+    scrypt_1024_1_1_256(input, output, ThreadScratchpad());
+#else
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
     scrypt_1024_1_1_256_sp(input, output, scratchpad);
+#endif
+}
+
+namespace {
+
+/** Run the ROMix core of scrypt(1024,1,1) on `lanes` interleaved states.
+ *  state:      32*lanes words, word k of lane l at state[k * lanes + l]
+ *  scratchpad: 1024*32*lanes words, 64-byte aligned
+ */
+typedef void (*ROMixNWayFn)(uint32_t* state, uint32_t* scratchpad);
+
+ROMixNWayFn ROMix_8way = nullptr;
+ROMixNWayFn ROMix_16way = nullptr;
+
+void scrypt_1024_1_1_256_nway(const char *input, char *output, size_t lanes, ROMixNWayFn romix, uint32_t *V)
+{
+    uint8_t B[128];
+    std::vector<uint32_t> X(32 * lanes);
+    std::vector<CHMAC_SHA256> hmac;
+    size_t l, k;
+
+    hmac.reserve(lanes);
+    for (l = 0; l < lanes; l++) {
+        hmac.emplace_back((const uint8_t *)input + 80 * l, 80);
+        PBKDF2_SHA256_1(hmac[l], (const uint8_t *)input + 80 * l, 80, B, 128);
+        for (k = 0; k < 32; k++)
+            X[k * lanes + l] = le32dec(&B[4 * k]);
+    }
+
+    romix(X.data(), V);
+
+    for (l = 0; l < lanes; l++) {
+        for (k = 0; k < 32; k++)
+            le32enc(&B[4 * k], X[k * lanes + l]);
+        PBKDF2_SHA256_1(hmac[l], B, 128, (uint8_t *)output + 32 * l, 32);
+    }
+}
+
+/** Hash n inputs with an n-way kernel as far as possible; returns how many were hashed. */
+size_t scrypt_1024_1_1_256_multi_lanes(const char *input, char *output, size_t n, size_t lanes, ROMixNWayFn romix, CScryptScratchpad& scratchpad)
+{
+    if (romix == nullptr || n < lanes)
+        return 0;
+
+    uint32_t *V = (uint32_t *)scratchpad.Get();
+    size_t done = 0;
+    while (n - done >= lanes) {
+        scrypt_1024_1_1_256_nway(input + 80 * done, output + 32 * done, lanes, romix, V);
+        done += lanes;
+    }
+    return done;
+}
+
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+// We can't use cpuid.h's __get_cpuid as it does not support subleafs.
+void inline cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+#ifdef __GNUC__
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+#else
+  __asm__ ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(leaf), "2"(subleaf));
+#endif
+}
+
+/** Return the extended control register 0 (which state components the OS saves). */
+uint32_t XCR0()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return a;
+}
+#endif
+
+// The first scrypt_hashtest vector from the unit tests.
+const unsigned char selftest_input[80] = {
+    0x02, 0x00, 0x00, 0x00, 0x4c, 0x12, 0x71, 0xc2, 0x11, 0x71, 0x71, 0x98, 0x22, 0x73, 0x92, 0xb0,
+    0x29, 0xa6, 0x4a, 0x79, 0x71, 0x93, 0x1d, 0x35, 0x1b, 0x38, 0x7b, 0xb8, 0x0d, 0xb0, 0x27, 0xf2,
+    0x70, 0x41, 0x1e, 0x39, 0x8a, 0x07, 0x04, 0x6f, 0x7d, 0x4a, 0x08, 0xdd, 0x81, 0x54, 0x12, 0xa8,
+    0x71, 0x2f, 0x87, 0x4a, 0x7e, 0xbf, 0x05, 0x07, 0xe3, 0x87, 0x8b, 0xd2, 0x4e, 0x20, 0xa3, 0xb7,
+    0x3f, 0xd7, 0x50, 0xa6, 0x67, 0xd2, 0xf4, 0x51, 0xea, 0xc7, 0x47, 0x1b, 0x00, 0xde, 0x66, 0x59
+};
+
+/** Check an n-way kernel against the generic implementation, with a different nonce in every lane. */
+bool SelfTest(size_t lanes, ROMixNWayFn romix)
+{
+    if (romix == nullptr)
+        return true;
+
+    std::vector<char> input(80 * lanes), output(32 * lanes);
+    for (size_t l = 0; l < lanes; l++) {
+        memcpy(&input[80 * l], selftest_input, 80);
+        input[80 * l + 76] ^= (char)l;
+    }
+    CScryptScratchpad scratchpad;
+    if (scrypt_1024_1_1_256_multi_lanes(input.data(), output.data(), lanes, lanes, romix, scratchpad) != lanes)
+        return false;
+
+    char expected[32];
+    for (size_t l = 0; l < lanes; l++) {
+        scrypt_1024_1_1_256_sp_generic(&input[80 * l], expected, scratchpad.Get());
+        if (memcmp(expected, &output[32 * l], 32) != 0)
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+std::string ScryptAutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_ASM) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    bool have_avx2 = false;
+    bool have_avx512f = false;
+    bool enabled_avx = false;
+    bool enabled_avx512 = false;
+
+    (void)have_avx2;
+    (void)have_avx512f;
+    (void)enabled_avx;
+    (void)enabled_avx512;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, eax, ebx, ecx, edx);
+    bool have_xsave = (ecx >> 27) & 1;
+    bool have_avx = (ecx >> 28) & 1;
+    if (have_xsave && have_avx) {
+        uint32_t xcr0 = XCR0();
+        // YMM state for AVX2, plus opmask and ZMM state for AVX-512.
+        enabled_avx = (xcr0 & 0x06) == 0x06;
+        enabled_avx512 = (xcr0 & 0xe6) == 0xe6;
+    }
+    cpuid(0, 0, eax, ebx, ecx, edx);
+    if (eax >= 7) {
+        cpuid(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+        have_avx512f = (ebx >> 16) & 1;
+    }
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx2 && enabled_avx) {
+        ROMix_8way = scrypt_avx2::ROMix_8way;
+        ret = "avx2(8way)";
+    }
+#endif
+#if defined(ENABLE_AVX512F) && !defined(BUILD_BITCOIN_INTERNAL)
+    if (have_avx512f && enabled_avx512) {
+        ROMix_16way = scrypt_avx512f::ROMix_16way;
+        ret = ROMix_8way ? ret + ",avx512f(16way)" : "avx512f(16way)";
+    }
+#endif
+#endif
+
+    assert(SelfTest(8, ROMix_8way));
+    assert(SelfTest(16, ROMix_16way));
+    return ret;
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t n, CScryptScratchpad& scratchpad)
+{
+    static_assert(SCRYPT_MAX_LANES >= 16, "scratchpad too small for the 16-way kernel");
+    size_t done = scrypt_1024_1_1_256_multi_lanes(input, output, n, 16, ROMix_16way, scratchpad);
+    done += scrypt_1024_1_1_256_multi_lanes(input + 80 * done, output + 32 * done, n - done, 8, ROMix_8way, scratchpad);
+    for (; done < n; done++)
+        scrypt_1024_1_1_256(input + 80 * done, output + 32 * done, scratchpad);
+}
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t n)
+{
+#if defined(HAVE_THREAD_LOCAL)
+    scrypt_1024_1_1_256_multi(input, output, n, ThreadScratchpad());
+#else
+    CScryptScratchpad scratchpad;
+    scrypt_1024_1_1_256_multi(input, output, n, scratchpad);
+#endif
 }
@@ -1,16 +1,47 @@
 #ifndef BITCOIN_CRYPTO_SCRYPT_H
 #define BITCOIN_CRYPTO_SCRYPT_H
 
+#include <crypto/hmac_sha256.h>
+
 #include <stdlib.h>
 #include <stdint.h>
+#include <string>
 
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
+/** Widest multi-lane kernel, in hashes computed at once. */
+static const size_t SCRYPT_MAX_LANES = 16;
+
+/**
+ * A reusable scratchpad for the scrypt kernels, large enough for
+ * SCRYPT_MAX_LANES interleaved hashes (2 MiB). The memory is allocated on
+ * first use, aligned to 2 MiB so that, where the OS supports it, a single
+ * transparent huge page backs it and the random reads of ROMix don't miss
+ * the TLB. Not thread safe: every hashing thread needs its own, so each
+ * thread that hashes through the per-thread scratchpad holds 2 MiB until it
+ * exits, even when it only ever computes one hash at a time.
+ */
+class CScryptScratchpad
+{
+private:
+    char* m_data = nullptr;
+
+public:
+    CScryptScratchpad() {}
+    ~CScryptScratchpad();
+    CScryptScratchpad(const CScryptScratchpad&) = delete;
+    CScryptScratchpad& operator=(const CScryptScratchpad&) = delete;
+
+    /** Return the scratchpad memory, allocating it if needed. Throws std::bad_alloc. */
+    char* Get();
+};
+
+/** Compute scrypt(1024,1,1,256) of an 80 byte input, using a per-thread scratchpad. */
 void scrypt_1024_1_1_256(const char *input, char *output);
+void scrypt_1024_1_1_256(const char *input, char *output, CScryptScratchpad& scratchpad);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
 #if defined(USE_SSE2)
-#include <string>
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
 #define USE_SSE2_ALWAYS 1
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_sse2((input), (output), (scratchpad))
@@ -25,9 +56,26 @@ extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output,
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
 #endif
 
+/** Autodetect the best available multi-lane scrypt implementation.
+ *  Returns the name of the implementation.
+ */
+std::string ScryptAutoDetect();
+
+/** Compute multiple scrypt(1024,1,1,256) hashes at once.
+ *  output:  pointer to an n*32 byte output buffer
+ *  input:   pointer to n consecutive 80 byte inputs
+ *  n:       the number of hashes to compute.
+ *  Without an explicit scratchpad, a per-thread one is used.
+ */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t n);
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t n, CScryptScratchpad& scratchpad);
+
 void
 PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
     size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen);
+void
+PBKDF2_SHA256_1(const CHMAC_SHA256& Phctx, const uint8_t *salt,
+    size_t saltlen, uint8_t *buf, size_t dkLen);
 
 #ifndef __FreeBSD__
 static inline uint32_t le32dec(const void *pp)
@@ -0,0 +1,103 @@
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace scrypt_avx2 {
+namespace {
+
+__m256i inline K(uint32_t x) { return _mm256_set1_epi32(x); }
+
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+__m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+__m256i inline ShL(__m256i x, int n) { return _mm256_slli_epi32(x, n); }
+__m256i inline ShR(__m256i x, int n) { return _mm256_srli_epi32(x, n); }
+__m256i inline RotL(__m256i x, int n) { return Or(ShL(x, n), ShR(x, 32 - n)); }
+
+/** One quarter round step of Salsa20: a ^= (b + c) <<< n. */
+void inline __attribute__((always_inline)) Step(__m256i& a, __m256i b, __m256i c, int n)
+{
+    a = Xor(a, RotL(Add(b, c), n));
+}
+
+/** Salsa20/8 applied to B ^= Bx, on 8 interleaved lanes. */
+void inline __attribute__((always_inline)) XorSalsa8(__m256i B[16], const __m256i Bx[16])
+{
+    __m256i x[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = B[i] = Xor(B[i], Bx[i]);
+    }
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        Step(x[ 4], x[ 0], x[12],  7);  Step(x[ 9], x[ 5], x[ 1],  7);
+        Step(x[14], x[10], x[ 6],  7);  Step(x[ 3], x[15], x[11],  7);
+
+        Step(x[ 8], x[ 4], x[ 0],  9);  Step(x[13], x[ 9], x[ 5],  9);
+        Step(x[ 2], x[14], x[10],  9);  Step(x[ 7], x[ 3], x[15],  9);
+
+        Step(x[12], x[ 8], x[ 4], 13);  Step(x[ 1], x[13], x[ 9], 13);
+        Step(x[ 6], x[ 2], x[14], 13);  Step(x[11], x[ 7], x[ 3], 13);
+
+        Step(x[ 0], x[12], x[ 8], 18);  Step(x[ 5], x[ 1], x[13], 18);
+        Step(x[10], x[ 6], x[ 2], 18);  Step(x[15], x[11], x[ 7], 18);
+
+        /* Operate on rows. */
+        Step(x[ 1], x[ 0], x[ 3],  7);  Step(x[ 6], x[ 5], x[ 4],  7);
+        Step(x[11], x[10], x[ 9],  7);  Step(x[12], x[15], x[14],  7);
+
+        Step(x[ 2], x[ 1], x[ 0],  9);  Step(x[ 7], x[ 6], x[ 5],  9);
+        Step(x[ 8], x[11], x[10],  9);  Step(x[13], x[12], x[15],  9);
+
+        Step(x[ 3], x[ 2], x[ 1], 13);  Step(x[ 4], x[ 7], x[ 6], 13);
+        Step(x[ 9], x[ 8], x[11], 13);  Step(x[14], x[13], x[12], 13);
+
+        Step(x[ 0], x[ 3], x[ 2], 18);  Step(x[ 5], x[ 4], x[ 7], 18);
+        Step(x[10], x[ 9], x[ 8], 18);  Step(x[15], x[14], x[13], 18);
+    }
+    for (int i = 0; i < 16; i++) {
+        B[i] = Add(B[i], x[i]);
+    }
+}
+
+}
+
+void ROMix_8way(uint32_t* state, uint32_t* scratchpad)
+{
+    __m256i X[32];
+    __m256i* V = (__m256i*)scratchpad;
+
+    for (int k = 0; k < 32; k++) {
+        X[k] = _mm256_loadu_si256((const __m256i*)(state + 8 * k));
+    }
+
+    for (int i = 0; i < 1024; i++) {
+        for (int k = 0; k < 32; k++) {
+            _mm256_store_si256(&V[i * 32 + k], X[k]);
+        }
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    // Each lane picks its own row of V, so the reads are gathers. Word k of
+    // row j for lane l lives at scratchpad[j * 256 + k * 8 + l].
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i = 0; i < 1024; i++) {
+        __m256i base = Add(ShL(And(X[16], K(1023)), 8), lanes);
+        for (int k = 0; k < 32; k++) {
+            __m256i v = _mm256_i32gather_epi32((const int*)scratchpad, Add(base, K(k * 8)), 4);
+            X[k] = Xor(X[k], v);
+        }
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    for (int k = 0; k < 32; k++) {
+        _mm256_storeu_si256((__m256i*)(state + 8 * k), X[k]);
+    }
+}
+
+}
+
+#endif
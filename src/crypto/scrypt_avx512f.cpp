@@ -0,0 +1,104 @@
+#ifdef ENABLE_AVX512F
+
+#include <stdint.h>
+#include <immintrin.h>
+
+namespace scrypt_avx512f {
+namespace {
+
+__m512i inline K(uint32_t x) { return _mm512_set1_epi32(x); }
+
+__m512i inline Add(__m512i x, __m512i y) { return _mm512_add_epi32(x, y); }
+__m512i inline Xor(__m512i x, __m512i y) { return _mm512_xor_si512(x, y); }
+__m512i inline And(__m512i x, __m512i y) { return _mm512_and_si512(x, y); }
+__m512i inline Or(__m512i x, __m512i y) { return _mm512_or_si512(x, y); }
+__m512i inline ShL(__m512i x, int n) { return _mm512_slli_epi32(x, n); }
+
+// The rotate amount has to be an immediate.
+#define RotL(x, n) _mm512_rol_epi32((x), (n))
+
+/** One quarter round step of Salsa20: a ^= (b + c) <<< n. */
+#define Step(a, b, c, n) ((a) = Xor((a), RotL(Add((b), (c)), (n))))
+
+/** Salsa20/8 applied to B ^= Bx, on 16 interleaved lanes. */
+void inline __attribute__((always_inline)) XorSalsa8(__m512i B[16], const __m512i Bx[16])
+{
+    __m512i x[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = B[i] = Xor(B[i], Bx[i]);
+    }
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        Step(x[ 4], x[ 0], x[12],  7);  Step(x[ 9], x[ 5], x[ 1],  7);
+        Step(x[14], x[10], x[ 6],  7);  Step(x[ 3], x[15], x[11],  7);
+
+        Step(x[ 8], x[ 4], x[ 0],  9);  Step(x[13], x[ 9], x[ 5],  9);
+        Step(x[ 2], x[14], x[10],  9);  Step(x[ 7], x[ 3], x[15],  9);
+
+        Step(x[12], x[ 8], x[ 4], 13);  Step(x[ 1], x[13], x[ 9], 13);
+        Step(x[ 6], x[ 2], x[14], 13);  Step(x[11], x[ 7], x[ 3], 13);
+
+        Step(x[ 0], x[12], x[ 8], 18);  Step(x[ 5], x[ 1], x[13], 18);
+        Step(x[10], x[ 6], x[ 2], 18);  Step(x[15], x[11], x[ 7], 18);
+
+        /* Operate on rows. */
+        Step(x[ 1], x[ 0], x[ 3],  7);  Step(x[ 6], x[ 5], x[ 4],  7);
+        Step(x[11], x[10], x[ 9],  7);  Step(x[12], x[15], x[14],  7);
+
+        Step(x[ 2], x[ 1], x[ 0],  9);  Step(x[ 7], x[ 6], x[ 5],  9);
+        Step(x[ 8], x[11], x[10],  9);  Step(x[13], x[12], x[15],  9);
+
+        Step(x[ 3], x[ 2], x[ 1], 13);  Step(x[ 4], x[ 7], x[ 6], 13);
+        Step(x[ 9], x[ 8], x[11], 13);  Step(x[14], x[13], x[12], 13);
+
+        Step(x[ 0], x[ 3], x[ 2], 18);  Step(x[ 5], x[ 4], x[ 7], 18);
+        Step(x[10], x[ 9], x[ 8], 18);  Step(x[15], x[14], x[13], 18);
+    }
+    for (int i = 0; i < 16; i++) {
+        B[i] = Add(B[i], x[i]);
+    }
+}
+
+}
+
+#undef Step
+#undef RotL
+
+void ROMix_16way(uint32_t* state, uint32_t* scratchpad)
+{
+    __m512i X[32];
+    __m512i* V = (__m512i*)scratchpad;
+
+    for (int k = 0; k < 32; k++) {
+        X[k] = _mm512_loadu_si512((const __m512i*)(state + 16 * k));
+    }
+
+    for (int i = 0; i < 1024; i++) {
+        for (int k = 0; k < 32; k++) {
+            _mm512_store_si512(&V[i * 32 + k], X[k]);
+        }
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    // Each lane picks its own row of V, so the reads are gathers. Word k of
+    // row j for lane l lives at scratchpad[j * 512 + k * 16 + l].
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for (int i = 0; i < 1024; i++) {
+        __m512i base = Add(ShL(And(X[16], K(1023)), 9), lanes);
+        for (int k = 0; k < 32; k++) {
+            __m512i v = _mm512_i32gather_epi32(Add(base, K(k * 16)), scratchpad, 4);
+            X[k] = Xor(X[k], v);
+        }
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    for (int k = 0; k < 32; k++) {
+        _mm512_storeu_si512((__m512i*)(state + 16 * k), X[k]);
+    }
+}
+
+}
+
+#endif
@@ -2,6 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
 #include <dbwrapper.h>
 
 #include <memory>
@@ -97,13 +101,79 @@ static void SetMaxOpenFiles(leveldb::Options *options) {
              options->max_open_files, default_open_files);
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+bool ParseDBOption(const std::string& arg, std::string& db, DBOptions& options, std::string& error)
+{
+    const size_t dot = arg.find('.');
+    const size_t eq = arg.find('=', dot == std::string::npos ? 0 : dot);
+    if (dot == 0 || dot == std::string::npos || eq == std::string::npos) {
+        error = strprintf("'%s' is not of the form <db>.<option>=<value>", arg);
+        return false;
+    }
+    db = arg.substr(0, dot);
+    const std::string name = arg.substr(dot + 1, eq - dot - 1);
+    const std::string value = arg.substr(eq + 1);
+    int32_t n;
+    if (name == "compression") {
+        if (value != "none" && value != "snappy") {
+            error = strprintf("Compression of %s must be none or snappy", db);
+            return false;
+        }
+#ifndef USE_SNAPPY
+        // LevelDB would silently store the blocks uncompressed.
+        if (value == "snappy") {
+            error = strprintf("Compression of %s is not available: LevelDB is built without Snappy", db);
+            return false;
+        }
+#endif
+        options.compression = value == "snappy";
+    } else if (name == "blocksize") {
+        if (!ParseInt32(value, &n) || n < 1024 || n > (4 << 20)) {
+            error = strprintf("Block size of %s must be from 1024 to %d bytes", db, 4 << 20);
+            return false;
+        }
+        options.block_size = n;
+    } else if (name == "bloombits") {
+        if (!ParseInt32(value, &n) || n < 0 || n > 64) {
+            error = strprintf("Bloom filter bits of %s must be from 0 to 64", db);
+            return false;
+        }
+        options.bloom_bits = n;
+    } else if (name == "writebuffer") {
+        if (!ParseInt32(value, &n) || n < 1 || n > 1024) {
+            error = strprintf("Write buffer size of %s must be from 1 to 1024 MiB", db);
+            return false;
+        }
+        options.write_buffer_size = (size_t)n << 20;
+    } else {
+        error = strprintf("Unknown database option '%s'", name);
+        return false;
+    }
+    return true;
+}
+
+DBOptions GetDBOptions(const std::string& name)
+{
+    DBOptions options;
+    // Malformed settings are rejected at startup; the later of two for the same option wins.
+    for (const std::string& arg : gArgs.GetArgs("-dboption")) {
+        std::string db, error;
+        DBOptions parsed = options;
+        if (ParseDBOption(arg, db, parsed, error) && db == name) {
+            options = parsed;
+        }
+    }
+    return options;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const DBOptions& db_options)
 {
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = db_options.write_buffer_size ? db_options.write_buffer_size : nCacheSize / 4;
+    options.block_size = db_options.block_size;
+    options.filter_policy = db_options.bloom_bits ? leveldb::NewBloomFilterPolicy(db_options.bloom_bits) : nullptr;
+    options.compression = db_options.compression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     options.info_log = new CBitcoinLevelDBLogger();
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
@@ -122,7 +192,10 @@ CDBWrapper::CDBWrapper(const fs::path& path, size_t nCacheSize, bool fMemory, bo
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    const DBOptions db_options = GetDBOptions(m_name);
+    options = GetOptions(nCacheSize, db_options);
+    LogPrint(BCLog::LEVELDB, "LevelDB options for %s: compression=%s, blocksize=%u, bloombits=%d, writebuffer=%u\n",
+             m_name, db_options.compression ? "snappy" : "none", options.block_size, db_options.bloom_bits, options.write_buffer_size);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
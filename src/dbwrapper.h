@@ -43,6 +43,26 @@ const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
 };
 
+/** LevelDB settings that can be tuned for each database with -dboption */
+struct DBOptions
+{
+    //! Whether table blocks are compressed with Snappy
+    bool compression = false;
+    //! Approximate amount of uncompressed data per table block
+    size_t block_size = 4096;
+    //! Bits per key of the bloom filters, 0 for none
+    int bloom_bits = 10;
+    //! Amount of writes to buffer in memory before sorting them into a table, 0 for a quarter of the cache
+    size_t write_buffer_size = 0;
+};
+
+/** Parse one -dboption value, "<db>.<option>=<value>", into the name of the
+ *  database and its options. Returns false with an error for a malformed one. */
+bool ParseDBOption(const std::string& arg, std::string& db, DBOptions& options, std::string& error);
+
+/** The options of the database with the given name, according to -dboption */
+DBOptions GetDBOptions(const std::string& name);
+
 /** Batch of changes queued to be written to a CDBWrapper */
 class CDBBatch
 {
@@ -119,15 +139,18 @@ class CDBIterator
 private:
     const CDBWrapper &parent;
     leveldb::Iterator *piter;
+    //! The snapshot the iterator reads, if any, kept until the iterator is gone
+    std::shared_ptr<const leveldb::Snapshot> snapshot;
 
 public:
 
     /**
      * @param[in] _parent          Parent CDBWrapper instance.
      * @param[in] _piter           The original leveldb iterator.
+     * @param[in] _snapshot        The snapshot _piter reads, if it was created with one.
      */
-    CDBIterator(const CDBWrapper &_parent, leveldb::Iterator *_piter) :
-        parent(_parent), piter(_piter) { };
+    CDBIterator(const CDBWrapper &_parent, leveldb::Iterator *_piter, std::shared_ptr<const leveldb::Snapshot> _snapshot = nullptr) :
+        parent(_parent), piter(_piter), snapshot(std::move(_snapshot)) { };
     ~CDBIterator();
 
     bool Valid() const;
@@ -215,7 +238,9 @@ private:
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
-     * @param[in] nCacheSize  Configures various leveldb cache settings.
+     * @param[in] nCacheSize  Configures various leveldb cache settings. The other
+     *                        settings are looked up by the path's last component
+     *                        with GetDBOptions().
      * @param[in] fMemory     If true, use leveldb's memory environment.
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
@@ -310,6 +335,24 @@ public:
         return new CDBIterator(*this, pdb->NewIterator(iteroptions));
     }
 
+    /**
+     * The state of the database as of now, for iterators that have to agree
+     * with each other while it is being written to. It is released when the
+     * last iterator reading it is gone.
+     */
+    std::shared_ptr<const leveldb::Snapshot> GetSnapshot() const
+    {
+        leveldb::DB* db = pdb;
+        return std::shared_ptr<const leveldb::Snapshot>(pdb->GetSnapshot(), [db](const leveldb::Snapshot* snapshot) { db->ReleaseSnapshot(snapshot); });
+    }
+
+    CDBIterator *NewIterator(std::shared_ptr<const leveldb::Snapshot> snapshot)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = snapshot.get();
+        return new CDBIterator(*this, pdb->NewIterator(options), std::move(snapshot));
+    }
+
     /**
      * Return true if the database managed by this class contains no entries.
      */
@@ -0,0 +1,427 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATHASHMAP_H
+#define BITCOIN_FLATHASHMAP_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/** Hash map with open addressing, for large maps of small values.
+ *
+ * The table is a flat array of one control byte per slot, followed by an
+ * array of pointers to the entries. A control byte is either empty, deleted,
+ * or holds 7 bits of the hash of the entry in that slot, so a lookup compares
+ * a whole group of 16 slots at once (with SSE2 where available) and usually
+ * touches exactly one entry: the one it is looking for.
+ *
+ * Entries live in an arena of ever larger chunks rather than in nodes of their
+ * own, which saves the per-allocation overhead, and erased entries are reused
+ * before the arena grows. Entries never move, so like with std::unordered_map
+ * references to them stay valid until they are erased; iterators are
+ * invalidated by inserting, but not by erasing other entries.
+ *
+ * Only the parts of the std::unordered_map interface the coins cache uses are
+ * provided.
+ */
+template <typename K, typename T, typename Hash>
+class flat_hash_map
+{
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::pair<const K, T> value_type;
+    typedef size_t size_type;
+
+    static const size_type GROUP_WIDTH = 16;
+
+private:
+    static const int8_t CTRL_EMPTY = -128;
+    static const int8_t CTRL_DELETED = -2;
+    static const size_type MIN_CHUNK_SIZE = 16;
+    static const size_type MAX_CHUNK_SIZE = 4096;
+
+    union ArenaSlot {
+        value_type value;
+        ArenaSlot* next_free;
+        ArenaSlot() {}
+        ~ArenaSlot() {}
+    };
+
+    //! One allocation: bucket_count control bytes, then bucket_count entry pointers
+    char* table = nullptr;
+    size_type capacity = 0;
+    size_type count = 0;
+    //! Slots that are neither empty nor occupied, which lookups have to probe past
+    size_type deleted = 0;
+    std::vector<std::pair<ArenaSlot*, size_type>> chunks;
+    //! Unused entries in the last chunk
+    size_type chunk_free = 0;
+    ArenaSlot* free_list = nullptr;
+    Hash hasher;
+
+    int8_t* ctrl() const { return (int8_t*)table; }
+    value_type** slots() const { return (value_type**)(table + capacity); }
+
+    static int8_t H2(size_t hash) { return hash & 0x7f; }
+    static size_t H1(size_t hash) { return hash >> 7; }
+
+    /** Bit i is set for each byte i of the group at ctrl() + pos that equals c. */
+    uint32_t Match(size_type pos, int8_t c) const
+    {
+#if defined(__SSE2__)
+        __m128i group = _mm_load_si128((const __m128i*)(ctrl() + pos));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+        uint32_t mask = 0;
+        for (size_type i = 0; i < GROUP_WIDTH; i++) {
+            mask |= uint32_t(ctrl()[pos + i] == c) << i;
+        }
+        return mask;
+#endif
+    }
+
+    /** Bit i is set for each empty or deleted byte i of the group at ctrl() + pos. */
+    uint32_t MatchFree(size_type pos) const
+    {
+#if defined(__SSE2__)
+        // Both have the sign bit set, which occupied slots never do.
+        return _mm_movemask_epi8(_mm_load_si128((const __m128i*)(ctrl() + pos)));
+#else
+        uint32_t mask = 0;
+        for (size_type i = 0; i < GROUP_WIDTH; i++) {
+            mask |= uint32_t(ctrl()[pos + i] < 0) << i;
+        }
+        return mask;
+#endif
+    }
+
+    static int CountTrailingZeros(uint32_t mask)
+    {
+#if defined(__GNUC__)
+        return __builtin_ctz(mask);
+#else
+        int n = 0;
+        while (!(mask & 1)) {
+            mask >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    /** Visit the groups on the probe sequence of hash until f returns true. */
+    template <typename F>
+    void Probe(size_t hash, F f) const
+    {
+        const size_type groups_mask = capacity / GROUP_WIDTH - 1;
+        size_type group = H1(hash) & groups_mask;
+        for (size_type step = 1; !f(group * GROUP_WIDTH); step++) {
+            // Triangular probing visits every group once as the count is a power of two.
+            group = (group + step) & groups_mask;
+        }
+    }
+
+    size_type FindSlot(const K& key, size_t hash) const
+    {
+        size_type found = capacity;
+        if (capacity == 0) return found;
+        const int8_t h2 = H2(hash);
+        Probe(hash, [&](size_type pos) {
+            for (uint32_t mask = Match(pos, h2); mask; mask &= mask - 1) {
+                const size_type i = pos + CountTrailingZeros(mask);
+                if (slots()[i]->first == key) {
+                    found = i;
+                    return true;
+                }
+            }
+            return Match(pos, CTRL_EMPTY) != 0;
+        });
+        return found;
+    }
+
+    size_type FindFreeSlot(size_t hash) const
+    {
+        size_type found = 0;
+        Probe(hash, [&](size_type pos) {
+            const uint32_t mask = MatchFree(pos);
+            if (mask) found = pos + CountTrailingZeros(mask);
+            return mask != 0;
+        });
+        return found;
+    }
+
+    void Rehash(size_type new_capacity)
+    {
+        char* old_table = table;
+        const size_type old_capacity = capacity;
+        value_type** old_slots = slots();
+
+        table = (char*)AllocTable(new_capacity);
+        capacity = new_capacity;
+        deleted = 0;
+        memset(table, CTRL_EMPTY, capacity);
+        for (size_type i = 0; i < old_capacity; i++) {
+            if (((int8_t*)old_table)[i] >= 0) {
+                const size_t hash = hasher(old_slots[i]->first);
+                const size_type slot = FindFreeSlot(hash);
+                ctrl()[slot] = H2(hash);
+                slots()[slot] = old_slots[i];
+            }
+        }
+        FreeTable(old_table);
+    }
+
+    static void* AllocTable(size_type n)
+    {
+        // The control bytes are loaded a group at a time with aligned loads.
+        void* p = nullptr;
+#if defined(WIN32)
+        p = _aligned_malloc(n * (1 + sizeof(value_type*)), GROUP_WIDTH);
+#else
+        if (posix_memalign(&p, GROUP_WIDTH, n * (1 + sizeof(value_type*))) != 0) p = nullptr;
+#endif
+        if (!p) throw std::bad_alloc();
+        return p;
+    }
+
+    static void FreeTable(void* p)
+    {
+#if defined(WIN32)
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+    ArenaSlot* AllocEntry()
+    {
+        if (free_list) {
+            ArenaSlot* slot = free_list;
+            free_list = slot->next_free;
+            return slot;
+        }
+        if (chunk_free == 0) {
+            const size_type size = chunks.empty() ? MIN_CHUNK_SIZE : std::min(chunks.back().second * 2, MAX_CHUNK_SIZE);
+            chunks.emplace_back(static_cast<ArenaSlot*>(::operator new(size * sizeof(ArenaSlot))), size);
+            chunk_free = size;
+        }
+        return chunks.back().first + chunks.back().second - chunk_free--;
+    }
+
+    void FreeEntry(ArenaSlot* slot)
+    {
+        slot->next_free = free_list;
+        free_list = slot;
+    }
+
+    /** Make room for one more entry. */
+    void Reserve()
+    {
+        if (capacity == 0) {
+            Rehash(GROUP_WIDTH);
+        } else if ((count + deleted + 1) * 8 > capacity * 7) {
+            // Keep the table at most 7/8 full; if much of that is deleted
+            // slots, clearing those out is enough.
+            Rehash(deleted * 2 > count ? capacity : capacity * 2);
+        }
+    }
+
+    void DestroyAll()
+    {
+        for (size_type i = 0; i < capacity; i++) {
+            if (ctrl()[i] >= 0) slots()[i]->~value_type();
+        }
+        for (const auto& chunk : chunks) {
+            ::operator delete(chunk.first);
+        }
+        chunks.clear();
+        chunk_free = 0;
+        free_list = nullptr;
+        count = 0;
+    }
+
+public:
+    template <bool Const>
+    class iterator_base
+    {
+        friend class flat_hash_map;
+        typedef typename std::conditional<Const, const flat_hash_map, flat_hash_map>::type map_type;
+        map_type* map;
+        size_type pos;
+
+        void SkipFree()
+        {
+            while (pos < map->capacity && map->ctrl()[pos] < 0) pos++;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename std::conditional<Const, const typename flat_hash_map::value_type, typename flat_hash_map::value_type>::type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator_base() : map(nullptr), pos(0) {}
+        iterator_base(map_type* map_, size_type pos_) : map(map_), pos(pos_) {}
+        template <bool C = Const, typename = typename std::enable_if<C>::type>
+        iterator_base(const iterator_base<false>& it) : map(it.map), pos(it.pos) {}
+
+        reference operator*() const { return *map->slots()[pos]; }
+        pointer operator->() const { return map->slots()[pos]; }
+        iterator_base& operator++() { pos++; SkipFree(); return *this; }
+        iterator_base operator++(int) { iterator_base copy(*this); ++(*this); return copy; }
+        bool operator==(const iterator_base& x) const { return pos == x.pos; }
+        bool operator!=(const iterator_base& x) const { return pos != x.pos; }
+
+        friend class iterator_base<true>;
+    };
+    typedef iterator_base<false> iterator;
+    typedef iterator_base<true> const_iterator;
+
+    flat_hash_map() {}
+    flat_hash_map(const flat_hash_map&) = delete;
+    flat_hash_map& operator=(const flat_hash_map&) = delete;
+
+    ~flat_hash_map()
+    {
+        DestroyAll();
+        if (table) FreeTable(table);
+    }
+
+    iterator begin() { iterator it(this, 0); if (capacity) it.SkipFree(); return it; }
+    const_iterator begin() const { const_iterator it(this, 0); if (capacity) it.SkipFree(); return it; }
+    iterator end() { return iterator(this, capacity); }
+    const_iterator end() const { return const_iterator(this, capacity); }
+
+    size_type size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_type bucket_count() const { return capacity; }
+    const std::vector<std::pair<ArenaSlot*, size_type>>& arena_chunks() const { return chunks; }
+
+    //! Bytes of entry storage allocated per chunk of the arena
+    static size_type arena_entry_size() { return sizeof(ArenaSlot); }
+    //! Bytes of table allocated per bucket
+    static size_type table_entry_size() { return 1 + sizeof(value_type*); }
+
+    //! Buckets a table needs to hold n entries
+    static size_type bucket_count_for(size_type n)
+    {
+        size_type buckets = GROUP_WIDTH;
+        while (n * 8 > buckets * 7) buckets *= 2;
+        return buckets;
+    }
+
+    /** Size the table and a single arena chunk to hold n entries, in a map that has none yet. */
+    void reserve(size_type n)
+    {
+        assert(count == 0 && chunks.empty());
+        if (n == 0) return;
+        if (bucket_count_for(n) > capacity) Rehash(bucket_count_for(n));
+        chunks.emplace_back(static_cast<ArenaSlot*>(::operator new(n * sizeof(ArenaSlot))), n);
+        chunk_free = n;
+    }
+
+    iterator find(const K& key) { return iterator(this, FindSlot(key, hasher(key))); }
+    const_iterator find(const K& key) const { return const_iterator(this, FindSlot(key, hasher(key))); }
+
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args)
+    {
+        // Construct first to learn the key, as std::unordered_map does.
+        ArenaSlot* entry = AllocEntry();
+        try {
+            new (&entry->value) value_type(std::forward<Args>(args)...);
+        } catch (...) {
+            FreeEntry(entry);
+            throw;
+        }
+        const size_t hash = hasher(entry->value.first);
+        const size_type existing = FindSlot(entry->value.first, hash);
+        if (existing != capacity) {
+            entry->value.~value_type();
+            FreeEntry(entry);
+            return std::make_pair(iterator(this, existing), false);
+        }
+        Reserve();
+        const size_type slot = FindFreeSlot(hash);
+        if (ctrl()[slot] == CTRL_DELETED) deleted--;
+        ctrl()[slot] = H2(hash);
+        slots()[slot] = &entry->value;
+        count++;
+        return std::make_pair(iterator(this, slot), true);
+    }
+
+    T& operator[](const K& key)
+    {
+        iterator it = find(key);
+        if (it != end()) return it->second;
+        return emplace(std::piecewise_construct, std::forward_as_tuple(key), std::tuple<>()).first->second;
+    }
+
+    iterator erase(iterator it)
+    {
+        const size_type pos = it.pos;
+        value_type* value = slots()[pos];
+        value->~value_type();
+        FreeEntry(reinterpret_cast<ArenaSlot*>(value));
+        // A group that still has an empty slot never stopped a probe from
+        // ending there, so its slots can go back to empty rather than deleted.
+        const size_type group = pos & ~(GROUP_WIDTH - 1);
+        if (Match(group, CTRL_EMPTY)) {
+            ctrl()[pos] = CTRL_EMPTY;
+        } else {
+            ctrl()[pos] = CTRL_DELETED;
+            deleted++;
+        }
+        count--;
+        ++it;
+        return it;
+    }
+
+    size_type erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end()) return 0;
+        erase(it);
+        return 1;
+    }
+
+    void swap(flat_hash_map& other)
+    {
+        std::swap(table, other.table);
+        std::swap(capacity, other.capacity);
+        std::swap(count, other.count);
+        std::swap(deleted, other.deleted);
+        chunks.swap(other.chunks);
+        std::swap(chunk_free, other.chunk_free);
+        std::swap(free_list, other.free_list);
+        std::swap(hasher, other.hasher);
+    }
+
+    /** Erase all entries and release the arena, keeping the table like std::unordered_map keeps its buckets. */
+    void clear()
+    {
+        DestroyAll();
+        if (table) memset(table, CTRL_EMPTY, capacity);
+        deleted = 0;
+        std::vector<std::pair<ArenaSlot*, size_type>>().swap(chunks);
+    }
+};
+
+#endif // BITCOIN_FLATHASHMAP_H
@@ -0,0 +1,180 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <index/coinstatsindex.h>
+
+#include <chainparams.h>
+#include <coins.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+constexpr char DB_STATE = 's';
+
+std::unique_ptr<CoinStatsIndex> g_coinstatsindex;
+
+/**
+ * Access to the coinstatsindex database (indexes/coinstats/)
+ *
+ * Besides the block locator every index keeps, the database holds a single
+ * record: the state as of the last block written. It is written with every
+ * block, so it is never behind the locator, which is written less often.
+ */
+class CoinStatsIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    /// Read the state. Returns false if none was written yet.
+    bool ReadState(State& state) const;
+
+    bool WriteState(const State& state);
+};
+
+CoinStatsIndex::DB::DB(size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "coinstats", n_cache_size, f_memory, f_wipe)
+{}
+
+bool CoinStatsIndex::DB::ReadState(State& state) const
+{
+    return Read(DB_STATE, state);
+}
+
+bool CoinStatsIndex::DB::WriteState(const State& state)
+{
+    return Write(DB_STATE, state);
+}
+
+CoinStatsIndex::CoinStatsIndex(size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_db(MakeUnique<CoinStatsIndex::DB>(n_cache_size, f_memory, f_wipe))
+{}
+
+CoinStatsIndex::~CoinStatsIndex() {}
+
+bool CoinStatsIndex::Init()
+{
+    {
+        LOCK(m_cs);
+        if (!m_db->ReadState(m_state)) {
+            m_state = State();
+        }
+    }
+    return BaseIndex::Init();
+}
+
+void CoinStatsIndex::ApplyCoin(const COutPoint& outpoint, const Coin& coin, bool add)
+{
+    if (add) {
+        ApplyCoinHash(m_state.muhash, outpoint, coin);
+        m_state.transaction_output_count++;
+        m_state.bogo_size += GetBogoSize(coin.out.scriptPubKey);
+        m_state.total_amount += coin.out.nValue;
+    } else {
+        RemoveCoinHash(m_state.muhash, outpoint, coin);
+        m_state.transaction_output_count--;
+        m_state.bogo_size -= GetBogoSize(coin.out.scriptPubKey);
+        m_state.total_amount -= coin.out.nValue;
+    }
+}
+
+bool CoinStatsIndex::ApplyBlock(const CBlock& block, const CBlockIndex* pindex, bool revert)
+{
+    // The outputs of the genesis block never make it into the UTXO set.
+    if (pindex->nHeight == 0) {
+        return true;
+    }
+    CBlockUndo blockundo;
+    if (!UndoReadFromDisk(blockundo, pindex)) {
+        return error("%s: Failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size()) {
+        return error("%s: Undo data of block %s does not match it", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    // Like ConnectBlock(), this assumes no transaction overwrites the unspent
+    // outputs of an earlier one with the same txid.
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        for (uint32_t j = 0; j < tx.vout.size(); j++) {
+            if (!tx.vout[j].scriptPubKey.IsUnspendable()) {
+                ApplyCoin(COutPoint(tx.GetHash(), j), Coin(tx.vout[j], pindex->nHeight, tx.IsCoinBase()), !revert);
+            }
+        }
+        if (i == 0) continue;
+
+        const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != tx.vin.size()) {
+            return error("%s: Undo data of block %s does not match it", __func__, pindex->GetBlockHash().ToString());
+        }
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            ApplyCoin(tx.vin[j].prevout, txundo.vprevout[j], revert);
+        }
+    }
+    return true;
+}
+
+bool CoinStatsIndex::RewindTo(const CBlockIndex* pindex)
+{
+    const uint256 hash = pindex ? pindex->GetBlockHash() : uint256();
+    if (m_state.block_hash == hash) {
+        return true;
+    }
+
+    const CBlockIndex* state_index = nullptr;
+    if (!m_state.block_hash.IsNull()) {
+        LOCK(cs_main);
+        state_index = LookupBlockIndex(m_state.block_hash);
+        if (!state_index) {
+            return error("%s: Block %s of the index state not found", __func__, m_state.block_hash.ToString());
+        }
+    }
+
+    const Consensus::Params& consensus_params = Params().GetConsensus();
+    while (state_index && state_index != (pindex ? pindex->GetAncestor(state_index->nHeight) : nullptr)) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, state_index, consensus_params)) {
+            return error("%s: Failed to read block %s from disk", __func__, state_index->GetBlockHash().ToString());
+        }
+        if (!ApplyBlock(block, state_index, true)) {
+            return false;
+        }
+        state_index = state_index->pprev;
+    }
+    if (state_index != pindex) {
+        return error("%s: Index state is behind block %s", __func__, hash.ToString());
+    }
+    m_state.block_hash = hash;
+    return true;
+}
+
+bool CoinStatsIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    LOCK(m_cs);
+    if (!RewindTo(pindex->pprev) || !ApplyBlock(block, pindex, false)) {
+        return false;
+    }
+    m_state.block_hash = pindex->GetBlockHash();
+    return m_db->WriteState(m_state);
+}
+
+BaseIndex::DB& CoinStatsIndex::GetDB() const { return *m_db; }
+
+bool CoinStatsIndex::LookUpStats(const CBlockIndex* block_index, CCoinsStats& stats) const
+{
+    MuHash3072 muhash;
+    {
+        LOCK(m_cs);
+        if (!block_index || m_state.block_hash != block_index->GetBlockHash()) {
+            return false;
+        }
+        stats.hashBlock = m_state.block_hash;
+        stats.nHeight = block_index->nHeight;
+        stats.nTransactionOutputs = m_state.transaction_output_count;
+        stats.nBogoSize = m_state.bogo_size;
+        stats.nTotalAmount = m_state.total_amount;
+        muhash = m_state.muhash;
+    }
+    muhash.Finalize(stats.hashSerialized);
+    return true;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_COINSTATSINDEX_H
+#define BITCOIN_INDEX_COINSTATSINDEX_H
+
+#include <amount.h>
+#include <chain.h>
+#include <coinstats.h>
+#include <crypto/muhash.h>
+#include <index/base.h>
+#include <sync.h>
+
+class Coin;
+
+/**
+ * CoinStatsIndex keeps the statistics gettxoutsetinfo reports about the UTXO
+ * set, with a MuHash3072 of it, up to date block by block, so that they are
+ * available at the tip without walking the whole chainstate. Only the state as
+ * of the block the index is synced to is kept; when that block is no longer
+ * on the way to the next one, for a reorganization or after a restart, it is
+ * rolled back with the undo data of the blocks in between.
+ */
+class CoinStatsIndex final : public BaseIndex
+{
+protected:
+    class DB;
+
+    /// The statistics of the UTXO set as of one block
+    struct State {
+        /// Null before the genesis block is indexed
+        uint256 block_hash;
+        uint64_t transaction_output_count = 0;
+        uint64_t bogo_size = 0;
+        CAmount total_amount = 0;
+        MuHash3072 muhash;
+
+        ADD_SERIALIZE_METHODS;
+
+        template <typename Stream, typename Operation>
+        inline void SerializationOp(Stream& s, Operation ser_action) {
+            READWRITE(block_hash);
+            READWRITE(transaction_output_count);
+            READWRITE(bogo_size);
+            READWRITE(total_amount);
+            READWRITE(muhash);
+        }
+    };
+
+private:
+    const std::unique_ptr<DB> m_db;
+
+    mutable CCriticalSection m_cs;
+    State m_state;
+
+    /// Add a coin to the state, or take it out.
+    void ApplyCoin(const COutPoint& outpoint, const Coin& coin, bool add);
+
+    /// Apply the changes a block made to the UTXO set, or revert them.
+    bool ApplyBlock(const CBlock& block, const CBlockIndex* pindex, bool revert);
+
+    /// Revert blocks until the state is as of pindex, an ancestor of the
+    /// state's block. A null pindex means before the genesis block.
+    bool RewindTo(const CBlockIndex* pindex);
+
+protected:
+    /// Override base class init to load the state from the database.
+    bool Init() override;
+
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "coinstatsindex"; }
+
+public:
+    /// Constructs the index, which becomes available to be queried.
+    explicit CoinStatsIndex(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~CoinStatsIndex() override;
+
+    /// Look up the UTXO set statistics as of a block. Only those of the block
+    /// the index is synced to are available.
+    ///
+    /// @param[in]   block_index  The block the statistics are wanted for.
+    /// @param[out]  stats  The statistics, with the MuHash in hashSerialized
+    ///                     and no transaction count.
+    /// @return  true if the index is at block_index, false otherwise
+    bool LookUpStats(const CBlockIndex* block_index, CCoinsStats& stats) const;
+};
+
+/// The global UTXO set statistics index, used in gettxoutsetinfo. May be null.
+extern std::unique_ptr<CoinStatsIndex> g_coinstatsindex;
+
+#endif // BITCOIN_INDEX_COINSTATSINDEX_H
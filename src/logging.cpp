@@ -119,6 +119,7 @@ const CLogCategoryDesc LogCategories[] =
     {BCLog::COINDB, "coindb"},
     {BCLog::QT, "qt"},
     {BCLog::LEVELDB, "leveldb"},
+    {BCLog::IMPORT, "import"},
     {BCLog::ALL, "1"},
     {BCLog::ALL, "all"},
 };
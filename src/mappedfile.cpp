@@ -0,0 +1,45 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <mappedfile.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef WIN32
+std::shared_ptr<const MappedFile> MappedFile::Open(const fs::path& path)
+{
+    return nullptr;
+}
+
+MappedFile::~MappedFile() {}
+#else
+std::shared_ptr<const MappedFile> MappedFile::Open(const fs::path& path)
+{
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    // The mapping stays valid without the descriptor.
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const uint8_t*>(addr), st.st_size));
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+#endif
@@ -0,0 +1,62 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include <fs.h>
+#include <span.h>
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+/** A whole file mapped into memory, read-only. The file must not be
+ *  truncated while it is mapped. */
+class MappedFile
+{
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+
+    MappedFile(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+public:
+    /** Map the file at path. Returns null if it cannot be mapped, which is
+     *  always the case where memory mapping is not supported. */
+    static std::shared_ptr<const MappedFile> Open(const fs::path& path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    Span<const uint8_t> data() const { return Span<const uint8_t>(m_data, m_size); }
+    size_t size() const { return m_size; }
+};
+
+/** Bytes along with whatever keeps them around: the mapped file they are in,
+ *  or a buffer of their own. Copying one shares the bytes. */
+class SharedBytes
+{
+private:
+    std::shared_ptr<const void> m_owner;
+    Span<const uint8_t> m_bytes;
+
+public:
+    SharedBytes() {}
+    SharedBytes(std::shared_ptr<const MappedFile> file, Span<const uint8_t> bytes) : m_owner(std::move(file)), m_bytes(bytes) {}
+    explicit SharedBytes(std::vector<uint8_t>&& bytes)
+    {
+        auto buffer = std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+        m_bytes = Span<const uint8_t>(buffer->data(), buffer->size());
+        m_owner = std::move(buffer);
+    }
+
+    Span<const uint8_t> span() const { return m_bytes; }
+    const uint8_t* data() const { return m_bytes.data(); }
+    size_t size() const { return m_bytes.size(); }
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include <flathashmap.h>
 #include <indirectmap.h>
 
 #include <stdlib.h>
@@ -165,6 +166,25 @@ static inline size_t DynamicUsage(const std::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const flat_hash_map<X, Y, Z>& m)
+{
+    size_t usage = m.bucket_count() ? MallocUsage(m.table_entry_size() * m.bucket_count()) : 0;
+    for (const auto& chunk : m.arena_chunks()) {
+        usage += MallocUsage(m.arena_entry_size() * chunk.second);
+    }
+    return usage + DynamicUsage(m.arena_chunks());
+}
+
+/** What DynamicUsage() comes to for a map of the same type as m, just reserve()d for n entries. */
+template<typename X, typename Y, typename Z>
+static inline size_t ReservedUsage(const flat_hash_map<X, Y, Z>& m, size_t n)
+{
+    if (n == 0) return 0;
+    return MallocUsage(m.table_entry_size() * m.bucket_count_for(n)) + MallocUsage(m.arena_entry_size() * n) +
+           MallocUsage(sizeof(m.arena_chunks()[0]));
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
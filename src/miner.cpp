@@ -6,6 +6,7 @@
 #include <miner.h>
 
 #include <amount.h>
+#include <arith_uint256.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <coins.h>
@@ -13,6 +14,7 @@
 #include <consensus/tx_verify.h>
 #include <consensus/merkle.h>
 #include <consensus/validation.h>
+#include <crypto/scrypt.h>
 #include <hash.h>
 #include <net.h>
 #include <policy/feerate.h>
@@ -23,10 +25,14 @@
 #include <timedata.h>
 #include <util.h>
 #include <utilmoneystr.h>
+#include <utilstrencodings.h>
 #include <validationinterface.h>
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
 #include <queue>
+#include <thread>
 #include <utility>
 
 // Unconfirmed transactions in the memory pool often depend on other
@@ -52,6 +58,72 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
     return nNewTime - nOldTime;
 }
 
+bool FindNonce(CBlockHeader& block, uint32_t nNonceEnd, int nThreads, const Consensus::Params& consensusParams)
+{
+    const uint32_t nNonceBegin = block.nNonce;
+    if (nNonceBegin >= nNonceEnd)
+        return false;
+    nThreads = std::max(1, nThreads);
+
+    // The number of hashes a valid nonce is expected to take
+    uint64_t nExpected = std::numeric_limits<uint64_t>::max();
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(block.nBits, &fNegative, &fOverflow);
+    if (!fNegative && !fOverflow && bnTarget != 0) {
+        const arith_uint256 bnExpected = ~arith_uint256() / bnTarget;
+        if (bnExpected.bits() < 64)
+            nExpected = bnExpected.GetLow64();
+    }
+
+    // Starting a thread, which allocates its own scrypt scratchpad, is only
+    // worth it with enough hashes to share. On regtest a block takes about
+    // two, so the search stays on the calling thread.
+    nThreads = std::max<uint64_t>(1, std::min<uint64_t>(nThreads, nExpected / MIN_HASHES_PER_THREAD));
+
+    // Hash a batch of nonces at once with the multi-lane kernels, unless the
+    // target is so easy that a batch would mostly be wasted work.
+    const size_t nBatch = nExpected >= SCRYPT_MAX_LANES * nThreads ? SCRYPT_MAX_LANES : 1;
+
+    // Batches are claimed in increasing order and a thread only stops once
+    // its next batch starts above the best nonce found, so every nonce below
+    // the best one gets tried and the lowest valid nonce wins.
+    std::atomic<uint64_t> nNext{nNonceBegin};
+    std::atomic<uint64_t> nBest{nNonceEnd};
+    auto search = [&]() {
+        CBlockHeader header = block;
+        std::vector<char> vInput(nBatch * 80);
+        std::vector<uint256> vHash(nBatch);
+        while (true) {
+            const uint64_t nBegin = nNext.fetch_add(nBatch);
+            const uint64_t nEnd = std::min<uint64_t>(nBegin + nBatch, nBest.load());
+            if (nBegin >= nEnd)
+                break;
+            for (uint64_t nNonce = nBegin; nNonce < nEnd; nNonce++) {
+                header.nNonce = nNonce;
+                memcpy(&vInput[(nNonce - nBegin) * 80], BEGIN(header.nVersion), 80);
+            }
+            scrypt_1024_1_1_256_multi(vInput.data(), BEGIN(vHash[0]), nEnd - nBegin);
+            for (uint64_t nNonce = nBegin; nNonce < nEnd; nNonce++) {
+                if (CheckProofOfWork(vHash[nNonce - nBegin], header.nBits, consensusParams)) {
+                    uint64_t nPrev = nBest.load();
+                    while (nNonce < nPrev && !nBest.compare_exchange_weak(nPrev, nNonce)) {}
+                    break;
+                }
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads; i++)
+        threads.emplace_back(search);
+    search();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    block.nNonce = nBest.load();
+    return block.nNonce < nNonceEnd;
+}
+
 BlockAssembler::Options::Options() {
     blockMinFeeRate = CFeeRate(DEFAULT_BLOCK_MIN_TX_FEE);
     nBlockMaxWeight = DEFAULT_BLOCK_MAX_WEIGHT;
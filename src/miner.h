@@ -22,6 +22,8 @@ class CScript;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -genproclimit, the number of threads the generate RPCs search nonces with */
+static const int DEFAULT_GENERATE_THREADS = 1;
 
 struct CBlockTemplate
 {
@@ -196,5 +198,16 @@ private:
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
+/** FindNonce uses at most one thread per this many hashes a nonce is expected to take */
+static const uint64_t MIN_HASHES_PER_THREAD = 32;
+/**
+ * Search [block.nNonce, nNonceEnd) for the lowest nonce that satisfies the
+ * block's proof of work, on up to nThreads threads: fewer when the target
+ * is too easy to be worth starting them. The result does not depend on
+ * nThreads: block.nNonce is set to the same nonce a serial search finds, or
+ * to nNonceEnd if there is none.
+ * @return whether a nonce was found
+ */
+bool FindNonce(CBlockHeader& block, uint32_t nNonceEnd, int nThreads, const Consensus::Params& consensusParams);
 
 #endif // BITCOIN_MINER_H
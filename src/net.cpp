@@ -26,6 +26,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -73,6 +78,34 @@ enum BindFlags {
 
 const static std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 
+/** The type a message is accounted to: its own if known, *other* otherwise */
+static const std::string& AccountedMsgCmd(size_t msg_id)
+{
+    return msg_id < NUM_NET_MSG_IDS ? getAllNetMessageTypes()[msg_id] : NET_MESSAGE_COMMAND_OTHER;
+}
+
+/** The bytes of each type of message, leaving out the types without any */
+static mapMsgCmdSize MsgCmdSizes(const arrMsgIdSize& sizes)
+{
+    mapMsgCmdSize result;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (sizes[i] > 0)
+            result[AccountedMsgCmd(i)] = sizes[i];
+    }
+    return result;
+}
+
+/** The profile of each type of message, leaving out the types without any */
+static mapMsgCmdProfile MsgCmdProfiles(const arrMsgIdProfile& profiles)
+{
+    mapMsgCmdProfile result;
+    for (size_t i = 0; i < profiles.size(); i++) {
+        if (profiles[i].processing.Count() > 0)
+            result[AccountedMsgCmd(i)] = profiles[i];
+    }
+    return result;
+}
+
 static const uint64_t RANDOMIZER_ID_NETGROUP = 0x6c0edd8036ef4036ULL; // SHA256("netgroup")[0:8]
 static const uint64_t RANDOMIZER_ID_LOCALHOSTNONCE = 0xd93e69e2bbfa5735ULL; // SHA256("localhostnonce")[0:8]
 //
@@ -452,6 +485,11 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         CloseSocket(hSocket);
         return nullptr;
     }
+    if (m_socket_events_mode == SocketEventsMode::SELECT && !IsSelectableSocket(hSocket)) {
+        LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
+        CloseSocket(hSocket);
+        return nullptr;
+    }
 
     // Add node
     NodeId id = GetNewNodeId();
@@ -490,6 +528,15 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint(BCLog::NET, "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        // A child process may still hold a copy of the socket, which would
+        // keep it in the epoll set past the close, with events for a node
+        // that may be deleted by then.
+        if (m_epoll_fd != -1) {
+            epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, hSocket, nullptr);
+            m_epoll_fd = -1;
+        }
+#endif
         CloseSocket(hSocket);
     }
 }
@@ -706,14 +753,18 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     {
         LOCK(cs_vSend);
-        X(mapSendBytesPerMsgCmd);
+        stats.mapSendBytesPerMsgCmd = MsgCmdSizes(arrSendBytesPerMsgId);
         X(nSendBytes);
     }
     {
         LOCK(cs_vRecv);
-        X(mapRecvBytesPerMsgCmd);
+        stats.mapRecvBytesPerMsgCmd = MsgCmdSizes(arrRecvBytesPerMsgId);
         X(nRecvBytes);
     }
+    {
+        LOCK(cs_msg_profile);
+        stats.mapMsgProfile = MsgCmdProfiles(arrMsgProfile);
+    }
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -738,7 +789,7 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete)
+bool CNode::ReceiveMsgBytes(NetMessagePool& pool, const char *pch, unsigned int nBytes, bool& complete)
 {
     complete = false;
     int64_t nTimeMicros = GetTimeMicros();
@@ -750,13 +801,14 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            pool.NewMessage(vRecvMsg, Params().MessageStart());
 
         CNetMessage& msg = vRecvMsg.back();
 
         // absorb network data
         int handled;
-        if (!msg.in_data)
+        const bool in_header = !msg.in_data;
+        if (in_header)
             handled = msg.readHeader(pch, nBytes);
         else
             handled = msg.readData(pch, nBytes);
@@ -769,18 +821,16 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
             return false;
         }
 
+        if (in_header && msg.in_data)
+            pool.ReserveData(msg);
+
         pch += handled;
         nBytes -= handled;
 
         if (msg.complete()) {
 
             //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+            arrRecvBytesPerMsgId[static_cast<size_t>(msg.m_msg_id)] += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
 
             msg.nTime = nTimeMicros;
             complete = true;
@@ -842,6 +892,8 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
         return -1;
 
+    m_msg_id = GetNetMsgId(hdr.pchCommand);
+
     // switch state to reading message data
     in_data = true;
 
@@ -873,6 +925,113 @@ const uint256& CNetMessage::GetMessageHash() const
     return data_hash;
 }
 
+void CNetMessage::Reset(const CMessageHeader::MessageStartChars& pchMessageStartIn)
+{
+    hasher.Reset();
+    data_hash.SetNull();
+    in_data = false;
+    hdrbuf.clear();
+    hdrbuf.SetType(SER_NETWORK);
+    hdrbuf.SetVersion(INIT_PROTO_VERSION);
+    hdrbuf.resize(24);
+    hdr = CMessageHeader(pchMessageStartIn);
+    nHdrPos = 0;
+    vRecv.clear();
+    vRecv.SetType(SER_NETWORK);
+    vRecv.SetVersion(INIT_PROTO_VERSION);
+    nDataPos = 0;
+    nTime = 0;
+    m_msg_id = NetMsgId::UNKNOWN;
+}
+
+NetMessagePool::NetMessagePool(size_t max_messages, size_t max_bytes_per_class) :
+    m_max_messages(max_messages), m_max_bytes_per_class(max_bytes_per_class)
+{
+}
+
+void NetMessagePool::NewMessage(std::list<CNetMessage>& msgs, const CMessageHeader::MessageStartChars& pchMessageStart)
+{
+    bool reused = false;
+    {
+        LOCK(cs_pool);
+        if (!m_messages.empty()) {
+            msgs.splice(msgs.end(), m_messages, m_messages.begin());
+            m_stats.messages_reused++;
+            reused = true;
+        } else {
+            m_stats.messages_allocated++;
+        }
+    }
+    if (reused) {
+        msgs.back().Reset(pchMessageStart);
+    } else {
+        msgs.emplace_back(pchMessageStart, SER_NETWORK, INIT_PROTO_VERSION);
+    }
+}
+
+void NetMessagePool::ReserveData(CNetMessage& msg)
+{
+    const unsigned int size = msg.hdr.nMessageSize;
+    if (size == 0 || size > (1U << MAX_BUFFER_SIZE_LOG2) || msg.vRecv.capacity() >= size)
+        return;
+
+    const unsigned int size_class = std::max<unsigned int>(CountBits(size - 1), MIN_BUFFER_SIZE_LOG2) - MIN_BUFFER_SIZE_LOG2;
+    CDataStream buffer(msg.vRecv.GetType(), msg.vRecv.GetVersion());
+    {
+        LOCK(cs_pool);
+        std::vector<CDataStream>& buffers = m_buffers[size_class];
+        if (!buffers.empty()) {
+            buffer = std::move(buffers.back());
+            buffers.pop_back();
+            m_stats.buffers_reused++;
+            m_stats.bytes_pooled -= buffer.capacity();
+        } else {
+            m_stats.buffers_allocated++;
+        }
+    }
+    if (buffer.capacity() == 0)
+        buffer.reserve(size_t{1} << (MIN_BUFFER_SIZE_LOG2 + size_class));
+    buffer.SetType(msg.vRecv.GetType());
+    buffer.SetVersion(msg.vRecv.GetVersion());
+    msg.vRecv = std::move(buffer);
+}
+
+void NetMessagePool::Release(std::list<CNetMessage>& msgs)
+{
+    // Freed once cs_pool is no longer held
+    std::list<CNetMessage> dropped;
+    std::vector<CDataStream> dropped_buffers;
+
+    LOCK(cs_pool);
+    while (!msgs.empty()) {
+        CDataStream& buffer = msgs.front().vRecv;
+        // Cleared first, as the capacity of a stream excludes what was read of it
+        buffer.clear();
+        const size_t capacity = buffer.capacity();
+        if (capacity > 0) {
+            const unsigned int size_log2 = CountBits(capacity) - 1;
+            const unsigned int size_class = size_log2 - MIN_BUFFER_SIZE_LOG2;
+            if (size_log2 >= MIN_BUFFER_SIZE_LOG2 && size_log2 <= MAX_BUFFER_SIZE_LOG2 &&
+                ((m_buffers[size_class].size() + 1) << size_log2) <= m_max_bytes_per_class) {
+                m_buffers[size_class].push_back(std::move(buffer));
+                m_stats.bytes_pooled += capacity;
+            } else {
+                dropped_buffers.push_back(std::move(buffer));
+            }
+        }
+        std::list<CNetMessage>& to = m_messages.size() < m_max_messages ? m_messages : dropped;
+        to.splice(to.end(), msgs, msgs.begin());
+    }
+}
+
+NetMessagePool::Stats NetMessagePool::GetStats() const
+{
+    LOCK(cs_pool);
+    Stats stats = m_stats;
+    stats.messages_pooled = m_messages.size();
+    return stats;
+}
+
 
 
 
@@ -1074,7 +1233,13 @@ bool CConnman::AttemptToEvictConnection()
 void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
+#ifdef USE_EPOLL
+    SOCKET hSocket = accept4(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len, SOCK_CLOEXEC);
+#else
     SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    if (hSocket != INVALID_SOCKET)
+        SetSocketCloseOnExec(hSocket);
+#endif
     CAddress addr;
     int nInbound = 0;
     int nMaxInbound = nMaxConnections - (nMaxOutbound + nMaxFeeler);
@@ -1107,7 +1272,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (m_socket_events_mode == SocketEventsMode::SELECT && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1146,326 +1311,696 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
 
     LogPrint(BCLog::NET, "connection from %s accepted\n", addr.ToString());
 
+#ifdef USE_EPOLL
+    RegisterNodeSocket(pnode);
+#endif
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
 }
 
-void CConnman::ThreadSocketHandler()
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode)
+{
+    if (str == "select") {
+        mode = SocketEventsMode::SELECT;
+        return true;
+    }
+#ifdef USE_EPOLL
+    if (str == "epoll") {
+        mode = SocketEventsMode::EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string SocketEventsModeToString(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SocketEventsMode::SELECT: return "select";
+    case SocketEventsMode::EPOLL: return "epoll";
+    } // no default case, so the compiler can warn about missing cases
+    assert(false);
+}
+
+std::string SupportedSocketEventsModes()
+{
+#ifdef USE_EPOLL
+    return "select, epoll";
+#else
+    return "select";
+#endif
+}
+
+void CConnman::DisconnectNodes()
 {
-    unsigned int nPrevNodeCount = 0;
-    while (!interruptNet)
     {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
+        LOCK(cs_vNodes);
 
-            if (!fNetworkActive) {
-                // Disconnect any connected nodes
-                for (CNode* pnode : vNodes) {
-                    if (!pnode->fDisconnect) {
-                        LogPrint(BCLog::NET, "Network not active, dropping peer=%d\n", pnode->GetId());
-                        pnode->fDisconnect = true;
-                    }
+        if (!fNetworkActive) {
+            // Disconnect any connected nodes
+            for (CNode* pnode : vNodes) {
+                if (!pnode->fDisconnect) {
+                    LogPrint(BCLog::NET, "Network not active, dropping peer=%d\n", pnode->GetId());
+                    pnode->fDisconnect = true;
                 }
             }
+        }
 
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy)
+        // Disconnect unused nodes
+        std::vector<CNode*> vNodesCopy = vNodes;
+        for (CNode* pnode : vNodesCopy)
+        {
+            if (pnode->fDisconnect)
             {
-                if (pnode->fDisconnect)
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        for (CNode* pnode : vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            for (CNode* pnode : vNodesDisconnectedCopy)
-            {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_inventory, lockInv);
-                        if (lockInv) {
-                            TRY_LOCK(pnode->cs_vSend, lockSend);
-                            if (lockSend) {
-                                fDelete = true;
-                            }
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                    if (lockInv) {
+                        TRY_LOCK(pnode->cs_vSend, lockSend);
+                        if (lockSend) {
+                            fDelete = true;
                         }
                     }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        DeleteNode(pnode);
-                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    DeleteNode(pnode);
                 }
             }
         }
-        size_t vNodesSize;
+    }
+}
+
+void CConnman::NotifyNumConnectionsChanged()
+{
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        if(clientInterface)
+            clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
         {
-            LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            if(clientInterface)
-                clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
         }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+        else if (!pnode->fSuccessfullyConnected)
+        {
+            LogPrint(BCLog::NET, "version handshake timeout from %d\n", pnode->GetId());
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+bool CConnman::SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = 0;
+    {
+        LOCK(pnode->cs_hSocket);
+        if (pnode->hSocket == INVALID_SOCKET)
+            return false;
+        nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    }
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (!pnode->ReceiveMsgBytes(*m_msg_pool, pchBuf, nBytes, notify))
+            pnode->CloseSocketDisconnect();
+        RecordBytesRecv(nBytes);
+        if (notify) {
+            size_t nSizeAdded = 0;
+            auto it(pnode->vRecvMsg.begin());
+            for (; it != pnode->vRecvMsg.end(); ++it) {
+                if (!it->complete())
+                    break;
+                nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+            }
+            {
+                LOCK(pnode->cs_vProcessMsg);
+                pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                pnode->nProcessQueueSize += nSizeAdded;
+                pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
+            }
+            WakeMessageHandler(pnode);
+        }
+        // A full buffer may have left more behind.
+        return nBytes == (int)sizeof(pchBuf);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect) {
+            LogPrint(BCLog::NET, "socket closed\n");
+        }
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
         }
+    }
+    return false;
+}
+
+void CConnman::SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
 
+    for (const ListenSocket& hListenSocket : vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is space left in the receive buffer, select() for
+            //   receiving data.
+            // * Hand off all complete messages to the processor, to be handled without
+            //   blocking here.
+
+            bool select_recv = !pnode->fPauseRecv;
+            bool select_send;
             {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
+                LOCK(pnode->cs_vSend);
+                select_send = !pnode->vSendMsg.empty();
+            }
 
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+                continue;
 
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
 
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            if (select_send) {
+                FD_SET(pnode->hSocket, &fdsetSend);
+                continue;
+            }
+            if (select_recv) {
+                FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        if (interruptNet)
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (interruptNet)
+        return;
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
             return;
+    }
 
-        if (nSelect == SOCKET_ERROR)
+    //
+    // Accept new connections
+    //
+    for (const ListenSocket& hListenSocket : vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
-                return;
+            AcceptConnection(hListenSocket);
         }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        for (CNode* pnode : vNodesCopy)
+            pnode->AddRef();
+    }
+    for (CNode* pnode : vNodesCopy)
+    {
+        if (interruptNet)
+            return;
 
         //
-        // Accept new connections
+        // Receive
         //
-        for (const ListenSocket& hListenSocket : vhListenSocket)
+        bool recvSet = false;
+        bool sendSet = false;
+        bool errorSet = false;
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
-            }
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+                continue;
+            recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
+            sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
+            errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+        }
+        if (recvSet || errorSet)
+        {
+            SocketRecvData(pnode);
         }
 
         //
-        // Service each socket
+        // Send
         //
-        std::vector<CNode*> vNodesCopy;
+        if (sendSet)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy)
-                pnode->AddRef();
+            LOCK(pnode->cs_vSend);
+            size_t nBytes = SocketSendData(pnode);
+            if (nBytes) {
+                RecordBytesSent(nBytes);
+            }
         }
+
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
         for (CNode* pnode : vNodesCopy)
-        {
-            if (interruptNet)
+            pnode->Release();
+    }
+}
+
+#ifdef USE_EPOLL
+bool CConnman::InitSocketEvents()
+{
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd == -1) {
+        LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wake_fd == -1) {
+        LogPrintf("eventfd failed: %s\n", NetworkErrorString(errno));
+        close(m_epoll_fd);
+        m_epoll_fd = -1;
+        return false;
+    }
+
+    // The wake eventfd and the listening sockets are level-triggered, and
+    // told apart from the nodes by their data: nullptr for the former, an
+    // element of vhListenSocket for the latter.
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    bool ok = epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event) == 0;
+    for (ListenSocket& hListenSocket : vhListenSocket) {
+        event.data.ptr = &hListenSocket;
+        ok = ok && epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, hListenSocket.socket, &event) == 0;
+    }
+    if (!ok) {
+        LogPrintf("epoll_ctl failed: %s\n", NetworkErrorString(errno));
+        close(m_wake_fd);
+        close(m_epoll_fd);
+        m_wake_fd = m_epoll_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void CConnman::RegisterNodeSocket(CNode* pnode)
+{
+    if (m_epoll_fd == -1)
+        return;
+
+    // Registered once, edge-triggered: an event comes when data arrives, or
+    // when the socket has room again after a send left data queued.
+    // CloseSocketDisconnect() takes the socket out of the epoll set before
+    // closing it. The node is only deleted by the socket handler thread,
+    // after its socket is closed, so any event it gets points to a live node.
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->GetId(), NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+        return;
+    }
+    pnode->m_epoll_fd = m_epoll_fd;
+}
+
+void CConnman::SocketHandlerEpoll()
+{
+    // Besides socket events, wake up as often as the select() loop does to
+    // disconnect nodes and check for inactivity, and right away when a node
+    // was left with more to receive.
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(m_epoll_fd, events, ARRAYLEN(events), m_recv_pending ? 0 : 50);
+    if (interruptNet)
+        return;
+
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("epoll_wait error %s\n", NetworkErrorString(errno));
+            if (!interruptNet.sleep_for(std::chrono::milliseconds(50)))
                 return;
+        }
+        nEvents = 0;
+    }
 
-            //
-            // Receive
-            //
-            bool recvSet = false;
-            bool sendSet = false;
-            bool errorSet = false;
-            {
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
-            }
-            if (recvSet || errorSet)
-            {
-                // typical socket buffer is 8K-64K
-                char pchBuf[0x10000];
-                int nBytes = 0;
-                {
-                    LOCK(pnode->cs_hSocket);
-                    if (pnode->hSocket == INVALID_SOCKET)
-                        continue;
-                    nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                }
-                if (nBytes > 0)
-                {
-                    bool notify = false;
-                    if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                        pnode->CloseSocketDisconnect();
-                    RecordBytesRecv(nBytes);
-                    if (notify) {
-                        size_t nSizeAdded = 0;
-                        auto it(pnode->vRecvMsg.begin());
-                        for (; it != pnode->vRecvMsg.end(); ++it) {
-                            if (!it->complete())
-                                break;
-                            nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                        }
-                        {
-                            LOCK(pnode->cs_vProcessMsg);
-                            pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                            pnode->nProcessQueueSize += nSizeAdded;
-                            pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                        }
-                        WakeMessageHandler();
-                    }
-                }
-                else if (nBytes == 0)
-                {
-                    // socket closed gracefully
-                    if (!pnode->fDisconnect) {
-                        LogPrint(BCLog::NET, "socket closed\n");
-                    }
-                    pnode->CloseSocketDisconnect();
-                }
-                else if (nBytes < 0)
-                {
-                    // error
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                    {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                        pnode->CloseSocketDisconnect();
-                    }
-                }
-            }
+    for (int i = 0; i < nEvents; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == nullptr) {
+            uint64_t count;
+            while (read(m_wake_fd, &count, sizeof(count)) > 0) {}
+            continue;
+        }
+        const ListenSocket* listen_socket = nullptr;
+        for (const ListenSocket& hListenSocket : vhListenSocket) {
+            if (ptr == &hListenSocket) listen_socket = &hListenSocket;
+        }
+        if (listen_socket) {
+            AcceptConnection(*listen_socket);
+            continue;
+        }
+        CNode* pnode = static_cast<CNode*>(ptr);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->m_recv_ready = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->m_send_ready = true;
+    }
 
-            //
-            // Send
-            //
-            if (sendSet)
-            {
-                LOCK(pnode->cs_vSend);
-                size_t nBytes = SocketSendData(pnode);
-                if (nBytes) {
-                    RecordBytesSent(nBytes);
-                }
+    // Once a second, check every node for inactivity, and retry sending to
+    // those with data queued, in case a send stopped for another reason than
+    // a full socket buffer and no event is coming for it.
+    const int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime != m_last_inactivity_check) {
+        m_last_inactivity_check = nTime;
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            InactivityCheck(pnode);
+            LOCK(pnode->cs_vSend);
+            if (!pnode->vSendMsg.empty())
+                pnode->m_send_ready = true;
+        }
+    }
+
+    std::vector<CNode*> vNodesReady;
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (pnode->m_send_ready || (pnode->m_recv_ready && !pnode->fPauseRecv)) {
+                pnode->AddRef();
+                vNodesReady.push_back(pnode);
             }
+        }
+    }
+    m_recv_pending = false;
+    for (CNode* pnode : vNodesReady)
+    {
+        if (interruptNet)
+            break;
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-                else if (!pnode->fSuccessfullyConnected)
-                {
-                    LogPrint(BCLog::NET, "version handshake timeout from %d\n", pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
+        // As with select(), drain the send queue before receiving more.
+        bool send_pending = false;
+        if (pnode->m_send_ready) {
+            pnode->m_send_ready = false;
+            LOCK(pnode->cs_vSend);
+            size_t nBytes = SocketSendData(pnode);
+            if (nBytes) {
+                RecordBytesSent(nBytes);
             }
+            send_pending = !pnode->vSendMsg.empty();
         }
-        {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-                pnode->Release();
+        if (!send_pending && pnode->m_recv_ready && !pnode->fPauseRecv) {
+            pnode->m_recv_ready = SocketRecvData(pnode);
+            m_recv_pending |= pnode->m_recv_ready;
+        }
+    }
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodesReady)
+            pnode->Release();
+    }
+}
+#endif
+
+void CConnman::ThreadSocketHandler()
+{
+    while (!interruptNet)
+    {
+        DisconnectNodes();
+        NotifyNumConnectionsChanged();
+#ifdef USE_EPOLL
+        if (m_epoll_fd != -1) {
+            SocketHandlerEpoll();
+            continue;
+        }
+#endif
+        SocketHandlerSelect();
+    }
+}
+
+void CConnman::WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (m_wake_fd != -1) {
+        uint64_t one = 1;
+        if (write(m_wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            // The counter is already non-zero, which wakes the thread anyway.
         }
     }
+#endif
 }
 
 void CConnman::WakeMessageHandler()
+{
+    for (int i = 0; i < m_num_msg_handlers; i++) {
+        MessageHandler& handler = m_msg_handlers[i];
+        {
+            std::lock_guard<std::mutex> lock(handler.mutex);
+            handler.fWake = true;
+        }
+        handler.cond.notify_one();
+    }
+}
+
+void CConnman::WakeMessageHandler(const CNode* pnode)
+{
+    MessageHandler& handler = m_msg_handlers[MessageHandlerIndex(pnode)];
+    {
+        std::lock_guard<std::mutex> lock(handler.mutex);
+        handler.fWake = true;
+    }
+    handler.cond.notify_one();
+}
+
+int CConnman::MessageHandlerIndex(const CNode* pnode) const
+{
+    return pnode->GetId() % m_num_msg_handlers;
+}
+
+void CConnman::RecordMessageLatency(const CNode* pnode, NetMsgId msg_id, int64_t micros)
+{
+    MessageHandler& handler = m_msg_handlers[MessageHandlerIndex(pnode)];
+    LOCK(handler.cs_profile);
+    handler.latency[static_cast<size_t>(msg_id)].Add(micros);
+}
+
+std::map<std::string, LatencyHistogram> CConnman::GetMessageLatencies() const
+{
+    std::map<std::string, LatencyHistogram> latencies;
+    for (const MessageHandler& handler : m_msg_handlers) {
+        LOCK(handler.cs_profile);
+        for (size_t i = 0; i < handler.latency.size(); i++) {
+            if (handler.latency[i].Count() > 0)
+                latencies[AccountedMsgCmd(i)].Merge(handler.latency[i]);
+        }
+    }
+    return latencies;
+}
+
+static void AddToProfile(CMessageProfile& profile, uint64_t bytes, int64_t queue_wait, int64_t processing, int64_t cs_main_held)
+{
+    profile.nBytes += bytes;
+    profile.queue_wait.Add(queue_wait);
+    profile.processing.Add(processing);
+    profile.cs_main_held.Add(cs_main_held);
+    profile.latency.Add(queue_wait + processing);
+}
+
+void CConnman::RecordMessageProfile(CNode* pnode, NetMsgId msg_id, uint64_t bytes, int64_t queue_wait, int64_t processing, int64_t cs_main_held)
 {
     {
-        std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+        LOCK(pnode->cs_msg_profile);
+        AddToProfile(pnode->arrMsgProfile[static_cast<size_t>(msg_id)], bytes, queue_wait, processing, cs_main_held);
+    }
+    MessageHandler& handler = m_msg_handlers[MessageHandlerIndex(pnode)];
+    LOCK(handler.cs_profile);
+    AddToProfile(handler.profile[static_cast<size_t>(msg_id)], bytes, queue_wait, processing, cs_main_held);
+}
+
+mapMsgCmdProfile CConnman::GetMessageProfile() const
+{
+    arrMsgIdProfile profiles;
+    for (const MessageHandler& handler : m_msg_handlers) {
+        LOCK(handler.cs_profile);
+        for (size_t i = 0; i < profiles.size(); i++) {
+            profiles[i].Merge(handler.profile[i]);
+        }
+    }
+    return MsgCmdProfiles(profiles);
+}
+
+mapMsgCmdSize CConnman::GetSendBytesPerMsgCmd() const
+{
+    arrMsgIdSize sizes;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        sizes[i] = m_send_bytes_per_msg[i];
+    }
+    return MsgCmdSizes(sizes);
+}
+
+int LatencyHistogram::Bucket(int64_t micros)
+{
+    // Bucket by the position of the highest bit of micros + 1 and the two
+    // bits below it.
+    uint64_t v = (uint64_t)std::max<int64_t>(micros, 0) + 1;
+    int exp = 0;
+    while (exp < 63 && (v >> (exp + 1))) exp++;
+    if (exp >= BUCKETS / SUB_BUCKETS) return BUCKETS - 1;
+    int sub = ((v << 2) >> exp) & (SUB_BUCKETS - 1);
+    return exp * SUB_BUCKETS + sub;
+}
+
+int64_t LatencyHistogram::BucketMax(int bucket)
+{
+    // micros + 1 is below (1 + (sub + 1) / 4) * 2^exp, rounded up for the
+    // buckets narrower than one microsecond.
+    int exp = bucket / SUB_BUCKETS;
+    int sub = bucket % SUB_BUCKETS;
+    return (((int64_t)(SUB_BUCKETS + sub + 1) << exp) + SUB_BUCKETS - 1) / SUB_BUCKETS - 2;
+}
+
+void LatencyHistogram::Add(int64_t micros)
+{
+    m_buckets[Bucket(micros)]++;
+    m_count++;
+    m_sum += micros;
+    m_max = std::max(m_max, micros);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    for (int i = 0; i < BUCKETS; i++) {
+        m_buckets[i] += other.m_buckets[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    m_max = std::max(m_max, other.m_max);
+}
+
+void CMessageProfile::Merge(const CMessageProfile& other)
+{
+    nBytes += other.nBytes;
+    queue_wait.Merge(other.queue_wait);
+    processing.Merge(other.processing);
+    cs_main_held.Merge(other.cs_main_held);
+    latency.Merge(other.latency);
+}
+
+int64_t LatencyHistogram::Percentile(double q) const
+{
+    if (m_count == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(q * m_count));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += m_buckets[i];
+        if (seen >= rank) return i == BUCKETS - 1 ? m_max : std::min(BucketMax(i), m_max);
     }
-    condMsgProc.notify_one();
+    return m_max;
 }
 
 
@@ -2017,22 +2552,28 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
         pnode->m_manual_connection = true;
 
     m_msgproc->InitializeNode(pnode);
+#ifdef USE_EPOLL
+    RegisterNodeSocket(pnode);
+#endif
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int index)
 {
+    MessageHandler& handler = m_msg_handlers[index];
     while (!flagInterruptMsgProc)
     {
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
+            for (CNode* pnode : vNodes) {
+                if (MessageHandlerIndex(pnode) != index)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -2064,11 +2605,11 @@ void CConnman::ThreadMessageHandler()
                 pnode->Release();
         }
 
-        std::unique_lock<std::mutex> lock(mutexMsgProc);
+        std::unique_lock<std::mutex> lock(handler.mutex);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            handler.cond.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [&handler] { return handler.fWake; });
         }
-        fMsgProcWake = false;
+        handler.fWake = false;
     }
 }
 
@@ -2210,7 +2751,7 @@ void CConnman::SetNetworkActive(bool active)
     uiInterface.NotifyNetworkActiveChanged(fNetworkActive);
 }
 
-CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSeed1(nSeed1In)
+CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSeed1(nSeed1In), m_msg_pool(MakeUnique<NetMessagePool>())
 {
     fNetworkActive = true;
     setBannedIsDirty = false;
@@ -2328,6 +2869,18 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 
     fAddressesInitialized = true;
 
+#ifdef USE_EPOLL
+    if (m_socket_events_mode == SocketEventsMode::EPOLL && !InitSocketEvents()) {
+        LogPrintf("Falling back to select() for socket events\n");
+        m_socket_events_mode = SocketEventsMode::SELECT;
+    }
+#endif
+    if (m_socket_events_mode == SocketEventsMode::SELECT && nMaxConnections > m_max_connections_select) {
+        LogPrintf("Reducing -maxconnections from %d to %d, the most select() can wait for\n", nMaxConnections, m_max_connections_select);
+        nMaxConnections = m_max_connections_select;
+        nMaxOutbound = std::min(nMaxOutbound, nMaxConnections);
+    }
+
     if (semOutbound == nullptr) {
         // initialize semaphore
         semOutbound = MakeUnique<CSemaphore>(std::min((nMaxOutbound + nMaxFeeler), nMaxConnections));
@@ -2345,11 +2898,13 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
     interruptNet.reset();
     flagInterruptMsgProc = false;
 
-    {
-        std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+    for (MessageHandler& handler : m_msg_handlers) {
+        std::unique_lock<std::mutex> lock(handler.mutex);
+        handler.fWake = false;
     }
 
+    LogPrintf("Using %s for socket events\n", SocketEventsModeToString(m_socket_events_mode));
+
     // Send and receive from sockets, accept connections
     threadSocketHandler = std::thread(&TraceThread<std::function<void()> >, "net", std::function<void()>(std::bind(&CConnman::ThreadSocketHandler, this)));
 
@@ -2373,7 +2928,12 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    LogPrintf("Using %d message handler threads\n", m_num_msg_handlers);
+    for (int i = 0; i < m_num_msg_handlers; i++) {
+        MessageHandler& handler = m_msg_handlers[i];
+        handler.name = m_num_msg_handlers == 1 ? "msghand" : strprintf("msghand.%d", i);
+        handler.thread = std::thread(&TraceThread<std::function<void()> >, handler.name.c_str(), std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i)));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2398,13 +2958,17 @@ instance_of_cnetcleanup;
 
 void CConnman::Interrupt()
 {
-    {
-        std::lock_guard<std::mutex> lock(mutexMsgProc);
-        flagInterruptMsgProc = true;
+    flagInterruptMsgProc = true;
+    for (MessageHandler& handler : m_msg_handlers) {
+        {
+            std::lock_guard<std::mutex> lock(handler.mutex);
+            handler.fWake = true;
+        }
+        handler.cond.notify_all();
     }
-    condMsgProc.notify_all();
 
     interruptNet();
+    WakeSocketHandler();
     InterruptSocks5(true);
 
     if (semOutbound) {
@@ -2422,8 +2986,10 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (MessageHandler& handler : m_msg_handlers) {
+        if (handler.thread.joinable())
+            handler.thread.join();
+    }
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2446,6 +3012,14 @@ void CConnman::Stop()
         if (hListenSocket.socket != INVALID_SOCKET)
             if (!CloseSocket(hListenSocket.socket))
                 LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_EPOLL
+    // Only after the node sockets, which are taken out of it as they close
+    if (m_epoll_fd != -1) {
+        close(m_wake_fd);
+        close(m_epoll_fd);
+        m_wake_fd = m_epoll_fd = -1;
+    }
+#endif
 
     // clean up some globals (to help leak detection)
     for (CNode *pnode : vNodes) {
@@ -2761,10 +3335,6 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     fPauseSend = false;
     nProcessQueueSize = 0;
 
-    for (const std::string &msg : getAllNetMessageTypes())
-        mapRecvBytesPerMsgCmd[msg] = 0;
-    mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
-
     if (fLogIPs) {
         LogPrint(BCLog::NET, "Added connection to %s peer=%d\n", addrName, id);
     } else {
@@ -2818,32 +3388,39 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
 
 void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 {
-    size_t nMessageSize = msg.data.size();
+    // Only a shared payload is kept shared; any other is queued as it is.
+    SendBuffer payload = msg.shared_data.size() ? SendBuffer(std::move(msg.shared_data)) : SendBuffer(std::move(msg.data));
+    size_t nMessageSize = payload.size();
     size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
     LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
 
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
+    uint256 hash = Hash(payload.data(), payload.data() + nMessageSize);
     CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
 
+    const size_t msg_id = static_cast<size_t>(GetNetMsgId(hdr.pchCommand));
+    if (m_net_profile) {
+        m_send_bytes_per_msg[msg_id] += nTotalSize;
+    }
+
     size_t nBytesSent = 0;
     {
         LOCK(pnode->cs_vSend);
         bool optimisticSend(pnode->vSendMsg.empty());
 
         //log total amount of bytes per command
-        pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
+        pnode->arrSendBytesPerMsgId[msg_id] += nTotalSize;
         pnode->nSendSize += nTotalSize;
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
+        pnode->vSendMsg.emplace_back(std::move(serializedHeader));
         if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+            pnode->vSendMsg.push_back(std::move(payload));
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
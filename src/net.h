@@ -13,6 +13,7 @@
 #include <compat.h>
 #include <hash.h>
 #include <limitedmap.h>
+#include <mappedfile.h>
 #include <netaddress.h>
 #include <policy/feerate.h>
 #include <protocol.h>
@@ -22,8 +23,11 @@
 #include <uint256.h>
 #include <threadinterrupt.h>
 
+#include <array>
 #include <atomic>
 #include <deque>
+#include <limits>
+#include <list>
 #include <stdint.h>
 #include <thread>
 #include <memory>
@@ -85,6 +89,33 @@ static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
+/** -msghandlerthreads default */
+static const int DEFAULT_MSG_HANDLER_THREADS = 1;
+/** Maximum number of message handler threads */
+static const int MAX_MSG_HANDLER_THREADS = 16;
+/** -netprofile default */
+static const bool DEFAULT_NET_PROFILE = false;
+
+/** How the socket handler thread waits for sockets to become ready */
+enum class SocketEventsMode {
+    //! select() on all sockets, with the sets rebuilt every 50ms. Limited to
+    //! sockets below FD_SETSIZE.
+    SELECT,
+    //! Edge-triggered epoll, with sockets registered once
+    EPOLL,
+};
+#ifdef USE_EPOLL
+static const SocketEventsMode DEFAULT_SOCKET_EVENTS_MODE = SocketEventsMode::EPOLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKET_EVENTS_MODE = SocketEventsMode::SELECT;
+#endif
+
+/** Parse a -socketevents value. Returns false if it is unknown or not supported on this platform. */
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode);
+std::string SocketEventsModeToString(SocketEventsMode mode);
+/** The -socketevents values supported on this platform, comma-separated */
+std::string SupportedSocketEventsModes();
+
 typedef int64_t NodeId;
 
 struct AddedNodeInfo
@@ -108,10 +139,86 @@ struct CSerializedNetMsg
     CSerializedNetMsg& operator=(const CSerializedNetMsg&) = delete;
 
     std::vector<unsigned char> data;
+    //! A payload sent as it is instead of data, without copying it
+    SharedBytes shared_data;
     std::string command;
 };
 
+/** Bytes queued to be sent to a node: a buffer of their own, or bytes shared
+ *  with other nodes without copying them, such as a block. */
+class SendBuffer
+{
+private:
+    std::vector<unsigned char> m_owned;
+    SharedBytes m_shared;
+
+public:
+    SendBuffer() {}
+    explicit SendBuffer(std::vector<unsigned char>&& bytes) : m_owned(std::move(bytes)) {}
+    explicit SendBuffer(SharedBytes bytes) : m_shared(std::move(bytes)) {}
+
+    const unsigned char* data() const { return m_shared.size() ? m_shared.data() : m_owned.data(); }
+    size_t size() const { return m_shared.size() ? m_shared.size() : m_owned.size(); }
+};
+
+/**
+ * Histogram of latencies in microseconds, to estimate percentiles from.
+ * Buckets are a quarter of a power of two wide, so estimates are within
+ * about 20% of the actual values.
+ */
+class LatencyHistogram
+{
+public:
+    void Add(int64_t micros);
+    /** Add the samples of another histogram */
+    void Merge(const LatencyHistogram& other);
+    uint64_t Count() const { return m_count; }
+    int64_t Sum() const { return m_sum; }
+    int64_t Max() const { return m_max; }
+    /** Estimate the latency that a fraction q (0 < q <= 1) of the samples
+     *  did not exceed. Returns 0 without samples. */
+    int64_t Percentile(double q) const;
+
+private:
+    static constexpr int SUB_BUCKETS = 4;
+    //! Up to 2^36us, about 19 hours; anything longer goes in the last bucket
+    static constexpr int BUCKETS = 36 * SUB_BUCKETS;
+
+    static int Bucket(int64_t micros);
+    static int64_t BucketMax(int bucket);
+
+    std::array<uint64_t, BUCKETS> m_buckets{};
+    uint64_t m_count = 0;
+    int64_t m_sum = 0;
+    int64_t m_max = 0;
+};
+
+/** Where the time went handling the received messages of one type */
+struct CMessageProfile
+{
+    //! Bytes received, including headers
+    uint64_t nBytes = 0;
+    //! From receiving a message to starting to process it
+    LatencyHistogram queue_wait;
+    LatencyHistogram processing;
+    //! How long cs_main was held while processing
+    LatencyHistogram cs_main_held;
+    //! From receiving a message to having processed it
+    LatencyHistogram latency;
+
+    /** Add the messages of another profile */
+    void Merge(const CMessageProfile& other);
+};
+
+typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
+typedef std::map<std::string, CMessageProfile> mapMsgCmdProfile;
+//! As the above, indexed by NetMsgId so that accounting a message needs no lookup.
+//! NetMsgId::UNKNOWN counts all other commands.
+typedef std::array<uint64_t, NUM_NET_MSG_IDS + 1> arrMsgIdSize;
+typedef std::array<CMessageProfile, NUM_NET_MSG_IDS + 1> arrMsgIdProfile;
+
 class NetEventsInterface;
+class NetMessagePool;
 class CConnman
 {
 public:
@@ -143,6 +250,11 @@ public:
         bool m_use_addrman_outgoing = true;
         std::vector<std::string> m_specified_outgoing;
         std::vector<std::string> m_added_nodes;
+        SocketEventsMode m_socket_events_mode = DEFAULT_SOCKET_EVENTS_MODE;
+        //! nMaxConnections is capped to this if select() is used in place of epoll
+        int m_max_connections_select = std::numeric_limits<int>::max();
+        int m_msg_handler_threads = DEFAULT_MSG_HANDLER_THREADS;
+        bool m_net_profile = DEFAULT_NET_PROFILE;
     };
 
     void Init(const Options& connOptions) {
@@ -156,6 +268,10 @@ public:
         m_msgproc = connOptions.m_msgproc;
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
+        m_socket_events_mode = connOptions.m_socket_events_mode;
+        m_max_connections_select = connOptions.m_max_connections_select;
+        m_num_msg_handlers = std::max(1, std::min(connOptions.m_msg_handler_threads, MAX_MSG_HANDLER_THREADS));
+        m_net_profile = connOptions.m_net_profile;
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -311,7 +427,32 @@ public:
 
     unsigned int GetReceiveFloodSize() const;
 
+    /** Wake all message handler threads */
     void WakeMessageHandler();
+    /** Wake the message handler thread the node is pinned to */
+    void WakeMessageHandler(const CNode* pnode);
+
+    /** Record the time from receiving a message from pnode to having processed it */
+    void RecordMessageLatency(const CNode* pnode, NetMsgId msg_id, int64_t micros);
+    /** The latencies recorded so far by all message handler threads, per message type */
+    std::map<std::string, LatencyHistogram> GetMessageLatencies() const;
+
+    /** Whether to profile message handling (-netprofile) */
+    bool IsProfilingMessages() const { return m_net_profile; }
+    /** Account a processed message to its type, both for the node and in total */
+    void RecordMessageProfile(CNode* pnode, NetMsgId msg_id, uint64_t bytes, int64_t queue_wait, int64_t processing, int64_t cs_main_held);
+    /** The profile of all messages received so far by all message handler threads, per message type */
+    mapMsgCmdProfile GetMessageProfile() const;
+    /** The bytes sent to all nodes so far, per message type. Only counted while profiling. */
+    mapMsgCmdSize GetSendBytesPerMsgCmd() const;
+
+    /** The pool received messages are taken from and given back to once processed */
+    NetMessagePool& GetMessagePool() { return *m_msg_pool; }
+
+    /** Make the socket handler thread look at the nodes again without
+     *  waiting for a socket event, e.g. after a node's receiving was
+     *  unpaused. Only needed with SocketEventsMode::EPOLL. */
+    void WakeSocketHandler();
 
     /** Attempts to obfuscate tx time through exponentially distributed emitting.
         Works assuming that a single interval is used.
@@ -334,8 +475,21 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int index);
+    int MessageHandlerIndex(const CNode* pnode) const;
     void AcceptConnection(const ListenSocket& hListenSocket);
+    void DisconnectNodes();
+    void NotifyNumConnectionsChanged();
+    void InactivityCheck(CNode* pnode);
+    /** Receive once from a node's socket, handing complete messages to the
+     *  message handler. Returns whether there may be more to receive. */
+    bool SocketRecvData(CNode* pnode);
+    void SocketHandlerSelect();
+#ifdef USE_EPOLL
+    bool InitSocketEvents();
+    void RegisterNodeSocket(CNode* pnode);
+    void SocketHandlerEpoll();
+#endif
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
 
@@ -405,6 +559,7 @@ private:
     std::vector<CNode*> vNodes;
     std::list<CNode*> vNodesDisconnected;
     mutable CCriticalSection cs_vNodes;
+    unsigned int nPrevNodeCount = 0;
     std::atomic<NodeId> nLastNodeId;
 
     /** Services this instance offers */
@@ -423,20 +578,51 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
-
-    std::condition_variable condMsgProc;
-    std::mutex mutexMsgProc;
+    /** A message handler thread, processing the messages of the nodes pinned to it */
+    struct MessageHandler {
+        std::string name;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cond;
+        /** flag for waking the message processor. */
+        bool fWake = false;
+        //! Latencies and, with -netprofile, profile of the messages processed
+        //! by this thread, by NetMsgId. Kept per thread so that recording
+        //! them does not contend.
+        mutable CCriticalSection cs_profile;
+        std::array<LatencyHistogram, NUM_NET_MSG_IDS + 1> latency GUARDED_BY(cs_profile);
+        arrMsgIdProfile profile GUARDED_BY(cs_profile);
+    };
+    //! Only the first m_num_msg_handlers are started. Nodes are pinned to
+    //! one by their id, so a node's messages are always processed in order.
+    std::array<MessageHandler, MAX_MSG_HANDLER_THREADS> m_msg_handlers;
+    std::atomic<int> m_num_msg_handlers{DEFAULT_MSG_HANDLER_THREADS};
     std::atomic<bool> flagInterruptMsgProc;
 
+    bool m_net_profile;
+    //! Bytes sent to all nodes by NetMsgId, while profiling
+    std::array<std::atomic<uint64_t>, NUM_NET_MSG_IDS + 1> m_send_bytes_per_msg{};
+
+    const std::unique_ptr<NetMessagePool> m_msg_pool;
+
     CThreadInterrupt interruptNet;
 
+    SocketEventsMode m_socket_events_mode;
+    int m_max_connections_select;
+#ifdef USE_EPOLL
+    //! The epoll instance the sockets are registered with in EPOLL mode
+    int m_epoll_fd = -1;
+    //! An eventfd registered with m_epoll_fd, signalled by WakeSocketHandler()
+    int m_wake_fd = -1;
+    //! Whether a node was left with more to receive by the last iteration
+    bool m_recv_pending = false;
+    int64_t m_last_inactivity_check = 0;
+#endif
+
     std::thread threadDNSAddressSeed;
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -532,7 +718,6 @@ struct LocalServiceInfo {
 
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
-typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
 class CNodeStats
 {
@@ -554,6 +739,7 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    mapMsgCmdProfile mapMsgProfile;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -584,6 +770,7 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
+    NetMsgId m_msg_id;              // hdr's command, decoded once it is complete
 
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
@@ -591,6 +778,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        m_msg_id = NetMsgId::UNKNOWN;
     }
 
     bool complete() const
@@ -610,6 +798,79 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Make this message ready to receive into again, as if newly constructed
+     *  with type SER_NETWORK and INIT_PROTO_VERSION. Keeps the capacity of
+     *  its buffers. */
+    void Reset(const CMessageHeader::MessageStartChars& pchMessageStartIn);
+};
+
+/**
+ * Recycles received messages and their payload buffers, so that receiving
+ * a message does not usually allocate. Messages are handed out to the
+ * socket handler thread and given back by the message handler threads once
+ * processed. Payload buffers are kept in power of two size classes and
+ * handed out by the size in the message header. Larger messages receive
+ * into buffers of their own as before, which are freed once twice the size
+ * of the largest class, as are messages and buffers in excess of the limits.
+ */
+class NetMessagePool
+{
+public:
+    //! The smallest and largest size classes of pooled payload buffers. The
+    //! largest is as far as CNetMessage::readData allocates ahead.
+    static constexpr unsigned int MIN_BUFFER_SIZE_LOG2 = 8;
+    static constexpr unsigned int MAX_BUFFER_SIZE_LOG2 = 18;
+    static constexpr size_t DEFAULT_MAX_MESSAGES = 1024;
+    static constexpr size_t DEFAULT_MAX_BYTES_PER_CLASS = 1 << 20;
+
+    struct Stats {
+        uint64_t messages_allocated = 0;
+        uint64_t messages_reused = 0;
+        uint64_t buffers_allocated = 0;
+        uint64_t buffers_reused = 0;
+        //! Messages and bytes of payload buffers currently pooled
+        size_t messages_pooled = 0;
+        size_t bytes_pooled = 0;
+    };
+
+    explicit NetMessagePool(size_t max_messages = DEFAULT_MAX_MESSAGES, size_t max_bytes_per_class = DEFAULT_MAX_BYTES_PER_CLASS);
+
+    /** Append a message ready to receive into to msgs */
+    void NewMessage(std::list<CNetMessage>& msgs, const CMessageHeader::MessageStartChars& pchMessageStart);
+    /** Give msg, whose header was just read, a payload buffer sized for it */
+    void ReserveData(CNetMessage& msg);
+    /** Take back msgs and their payload buffers, leaving msgs empty */
+    void Release(std::list<CNetMessage>& msgs);
+
+    Stats GetStats() const;
+
+private:
+    static constexpr unsigned int NUM_BUFFER_CLASSES = MAX_BUFFER_SIZE_LOG2 - MIN_BUFFER_SIZE_LOG2 + 1;
+
+    const size_t m_max_messages;
+    const size_t m_max_bytes_per_class;
+
+    mutable CCriticalSection cs_pool;
+    std::list<CNetMessage> m_messages GUARDED_BY(cs_pool);
+    //! Empty streams with a capacity of at least 1 << (MIN_BUFFER_SIZE_LOG2 + i)
+    std::array<std::vector<CDataStream>, NUM_BUFFER_CLASSES> m_buffers GUARDED_BY(cs_pool);
+    Stats m_stats GUARDED_BY(cs_pool);
+};
+
+/** Messages taken off a node's queue, given back to a pool when this goes out of scope */
+class PooledNetMessages
+{
+public:
+    explicit PooledNetMessages(NetMessagePool& pool) : m_pool(pool) {}
+    ~PooledNetMessages() { m_pool.Release(msgs); }
+    PooledNetMessages(const PooledNetMessages&) = delete;
+    PooledNetMessages& operator=(const PooledNetMessages&) = delete;
+
+    std::list<CNetMessage> msgs;
+
+private:
+    NetMessagePool& m_pool;
 };
 
 
@@ -624,9 +885,11 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<SendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
+    //! The epoll instance the socket is registered with, if any
+    int m_epoll_fd GUARDED_BY(cs_hSocket){-1};
     CCriticalSection cs_vRecv;
 
     CCriticalSection cs_vProcessMsg;
@@ -677,18 +940,29 @@ public:
     const uint64_t nKeyedNetGroup;
     std::atomic_bool fPauseRecv;
     std::atomic_bool fPauseSend;
+    //! With SocketEventsMode::EPOLL, whether the socket may have data to
+    //! receive, or room to send, since it was last found to have none. Only
+    //! used by the socket handler thread.
+    bool m_recv_ready{false};
+    bool m_send_ready{false};
 protected:
 
-    mapMsgCmdSize mapSendBytesPerMsgCmd;
-    mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    arrMsgIdSize arrSendBytesPerMsgId{};
+    arrMsgIdSize arrRecvBytesPerMsgId{};
 
 public:
+    // Profile of the messages processed, by type, with -netprofile
+    CCriticalSection cs_msg_profile;
+    arrMsgIdProfile arrMsgProfile GUARDED_BY(cs_msg_profile);
+
     uint256 hashContinue;
     std::atomic<int> nStartingHeight;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    // Other nodes' message handler threads push addresses to relay here
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend GUARDED_BY(cs_addrSend);
+    CRollingBloomFilter addrKnown GUARDED_BY(cs_addrSend);
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -777,7 +1051,7 @@ public:
         return nRefCount;
     }
 
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete);
+    bool ReceiveMsgBytes(NetMessagePool& pool, const char *pch, unsigned int nBytes, bool& complete);
 
     void SetRecvVersion(int nVersionIn)
     {
@@ -809,11 +1083,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
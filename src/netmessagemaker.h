@@ -29,6 +29,16 @@ public:
         return Make(0, std::move(sCommand), std::forward<Args>(args)...);
     }
 
+    /** Make a message of a payload that is already serialized, which is sent
+     *  as it is instead of being copied. */
+    CSerializedNetMsg MakeRaw(std::string sCommand, SharedBytes payload) const
+    {
+        CSerializedNetMsg msg;
+        msg.command = std::move(sCommand);
+        msg.shared_data = std::move(payload);
+        return msg;
+    }
+
 private:
     const int nVersion;
 };
@@ -0,0 +1,112 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <powcache.h>
+
+#include <hash.h>
+#include <memusage.h>
+#include <primitives/block.h>
+#include <random.h>
+#include <util.h>
+
+#include <algorithm>
+#include <limits>
+
+CPoWHashCache g_pow_hash_cache;
+
+SaltedBlockHashHasher::SaltedBlockHashHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t SaltedBlockHashHasher::operator()(const uint256& hash) const
+{
+    return SipHashUint256(k0, k1, hash);
+}
+
+size_t CPoWHashCache::EntryUsage()
+{
+    // A list node holding both hashes, plus an index node holding the key,
+    // the list iterator and (with libstdc++) the cached hash, plus a bucket.
+    return memusage::MallocUsage(2 * sizeof(void*) + 2 * sizeof(uint256)) +
+           memusage::MallocUsage(sizeof(void*) + sizeof(uint256) + sizeof(EntryList::iterator) + sizeof(size_t)) +
+           sizeof(void*);
+}
+
+void CPoWHashCache::Resize(size_t nMaxEntries)
+{
+    LOCK(cs);
+    m_max_entries = nMaxEntries;
+    while (m_entries.size() > m_max_entries) {
+        m_index.erase(m_entries.back().first);
+        m_entries.pop_back();
+    }
+}
+
+bool CPoWHashCache::Get(const uint256& hash, uint256& hashPoW)
+{
+    LOCK(cs);
+    auto it = m_index.find(hash);
+    if (it == m_index.end()) {
+        m_misses++;
+        return false;
+    }
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    hashPoW = it->second->second;
+    m_hits++;
+    return true;
+}
+
+void CPoWHashCache::Insert(const uint256& hash, const uint256& hashPoW)
+{
+    LOCK(cs);
+    if (m_max_entries == 0 || m_index.count(hash))
+        return;
+    m_entries.emplace_front(hash, hashPoW);
+    m_index.emplace(hash, m_entries.begin());
+    if (m_entries.size() > m_max_entries) {
+        m_index.erase(m_entries.back().first);
+        m_entries.pop_back();
+    }
+}
+
+size_t CPoWHashCache::Size() const
+{
+    LOCK(cs);
+    return m_entries.size();
+}
+
+size_t CPoWHashCache::MaxSize() const
+{
+    LOCK(cs);
+    return m_max_entries;
+}
+
+uint64_t CPoWHashCache::Hits() const
+{
+    LOCK(cs);
+    return m_hits;
+}
+
+uint64_t CPoWHashCache::Misses() const
+{
+    LOCK(cs);
+    return m_misses;
+}
+
+void InitPoWHashCache()
+{
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, gArgs.GetArg("-maxpowcachesize", DEFAULT_MAX_POW_CACHE_SIZE)), MAX_MAX_POW_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = nMaxCacheSize / CPoWHashCache::EntryUsage();
+    g_pow_hash_cache.Resize(nElems);
+    LogPrintf("Using %zu MiB for proof-of-work hash cache, able to store %zu elements\n", nMaxCacheSize >> 20, nElems);
+}
+
+uint256 GetPoWHashCached(const CBlockHeader& header)
+{
+    const uint256 hash = header.GetHash();
+    uint256 hashPoW;
+    if (!g_pow_hash_cache.Get(hash, hashPoW)) {
+        hashPoW = header.GetPoWHash();
+        g_pow_hash_cache.Insert(hash, hashPoW);
+    }
+    return hashPoW;
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POWCACHE_H
+#define BITCOIN_POWCACHE_H
+
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+class CBlockHeader;
+
+// Default cache size in MiB, enough for about 45000 headers.
+static const unsigned int DEFAULT_MAX_POW_CACHE_SIZE = 8;
+// Maximum proof-of-work cache size allowed
+static const int64_t MAX_MAX_POW_CACHE_SIZE = 1024;
+
+/** Hash block hashes with a per-process random salt, so peers can't pick headers that collide in the cache. */
+class SaltedBlockHashHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedBlockHashHasher();
+
+    size_t operator()(const uint256& hash) const;
+};
+
+/**
+ * Bounded LRU cache from block hash (SHA256d) to scrypt proof-of-work hash.
+ * The block hash commits to the whole header, which is all scrypt hashes.
+ */
+class CPoWHashCache
+{
+private:
+    typedef std::list<std::pair<uint256, uint256>> EntryList;
+
+    mutable CCriticalSection cs;
+    //! Most recently used entries first
+    EntryList m_entries GUARDED_BY(cs);
+    std::unordered_map<uint256, EntryList::iterator, SaltedBlockHashHasher> m_index GUARDED_BY(cs);
+    size_t m_max_entries GUARDED_BY(cs) = 0;
+    uint64_t m_hits GUARDED_BY(cs) = 0;
+    uint64_t m_misses GUARDED_BY(cs) = 0;
+
+public:
+    /** Approximate memory used per entry, for sizing. */
+    static size_t EntryUsage();
+
+    /** Limit the cache to nMaxEntries, evicting the least recently used entries. 0 disables it. */
+    void Resize(size_t nMaxEntries);
+    /** Look up a block hash, counting a hit or a miss. */
+    bool Get(const uint256& hash, uint256& hashPoW);
+    void Insert(const uint256& hash, const uint256& hashPoW);
+
+    size_t Size() const;
+    size_t MaxSize() const;
+    uint64_t Hits() const;
+    uint64_t Misses() const;
+};
+
+extern CPoWHashCache g_pow_hash_cache;
+
+/** Size g_pow_hash_cache from -maxpowcachesize. */
+void InitPoWHashCache();
+
+/**
+ * Return the scrypt proof-of-work hash of a block header, taking it from
+ * g_pow_hash_cache when the header was hashed before. A block's header is
+ * checked when it is announced, again with CheckBlock when the block itself
+ * arrives and on ReadBlockFromDisk; with the cache only the first check pays
+ * for scrypt. Not for mining: every nonce tried would be a miss.
+ */
+uint256 GetPoWHashCached(const CBlockHeader& header);
+
+#endif // BITCOIN_POWCACHE_H
@@ -5,9 +5,13 @@
 
 #include <protocol.h>
 
+#include <crypto/common.h>
 #include <util.h>
 #include <utilstrencodings.h>
 
+#include <algorithm>
+#include <array>
+
 #ifndef WIN32
 # include <arpa/inet.h>
 #endif
@@ -75,6 +79,68 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::BLOCKTXN,
 };
 const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes+ARRAYLEN(allNetMessageTypes));
+static_assert(ARRAYLEN(allNetMessageTypes) == NUM_NET_MSG_IDS, "NetMsgId must match allNetMessageTypes");
+
+namespace {
+/**
+ * Open addressing hash table from the raw command field of a header to its
+ * NetMsgId. Decoding a command takes a hash and usually a single compare,
+ * instead of comparing it against every message type.
+ */
+class NetMsgIdTable
+{
+private:
+    //! A power of two, with at most half the slots used so probes stay short
+    static constexpr size_t SLOTS = 64;
+    static_assert(NUM_NET_MSG_IDS <= SLOTS / 2, "NetMsgIdTable is too full");
+
+    struct Slot {
+        char command[CMessageHeader::COMMAND_SIZE] = {};
+        NetMsgId id = NetMsgId::UNKNOWN;
+    };
+    std::array<Slot, SLOTS> m_slots;
+
+    static size_t Hash(const char* pchCommand)
+    {
+        uint64_t lo = ReadLE64((const unsigned char*)pchCommand);
+        uint64_t hi = ReadLE32((const unsigned char*)pchCommand + 8);
+        // Multiplicative hashing, taking the top log2(SLOTS) bits.
+        return ((lo ^ (hi << 32 | hi)) * 0x9E3779B97F4A7C15ULL) >> 58;
+    }
+
+public:
+    NetMsgIdTable()
+    {
+        for (size_t i = 0; i < NUM_NET_MSG_IDS; i++) {
+            char command[CMessageHeader::COMMAND_SIZE] = {};
+            const std::string& type = allNetMessageTypes[i];
+            memcpy(command, type.data(), std::min(type.size(), sizeof(command)));
+            size_t slot = Hash(command);
+            while (m_slots[slot].id != NetMsgId::UNKNOWN) {
+                slot = (slot + 1) % SLOTS;
+            }
+            memcpy(m_slots[slot].command, command, CMessageHeader::COMMAND_SIZE);
+            m_slots[slot].id = static_cast<NetMsgId>(i);
+        }
+    }
+
+    NetMsgId Find(const char* pchCommand) const
+    {
+        for (size_t slot = Hash(pchCommand); m_slots[slot].id != NetMsgId::UNKNOWN; slot = (slot + 1) % SLOTS) {
+            if (memcmp(m_slots[slot].command, pchCommand, CMessageHeader::COMMAND_SIZE) == 0) {
+                return m_slots[slot].id;
+            }
+        }
+        return NetMsgId::UNKNOWN;
+    }
+};
+} // namespace
+
+NetMsgId GetNetMsgId(const char* pchCommand)
+{
+    static const NetMsgIdTable table;
+    return table.Find(pchCommand);
+}
 
 CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn)
 {
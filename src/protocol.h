@@ -243,6 +243,46 @@ extern const char *BLOCKTXN;
 /* Get a vector of all valid message types (see above) */
 const std::vector<std::string> &getAllNetMessageTypes();
 
+/** The valid message types, in the order of getAllNetMessageTypes() */
+enum class NetMsgId : uint8_t {
+    VERSION,
+    VERACK,
+    ADDR,
+    INV,
+    GETDATA,
+    MERKLEBLOCK,
+    GETBLOCKS,
+    GETHEADERS,
+    TX,
+    HEADERS,
+    BLOCK,
+    GETADDR,
+    MEMPOOL,
+    PING,
+    PONG,
+    NOTFOUND,
+    FILTERLOAD,
+    FILTERADD,
+    FILTERCLEAR,
+    REJECT,
+    SENDHEADERS,
+    FEEFILTER,
+    SENDCMPCT,
+    CMPCTBLOCK,
+    GETBLOCKTXN,
+    BLOCKTXN,
+    //! Any other command
+    UNKNOWN,
+};
+static constexpr size_t NUM_NET_MSG_IDS = static_cast<size_t>(NetMsgId::UNKNOWN);
+
+/**
+ * Decode the command of a message header, CMessageHeader::COMMAND_SIZE bytes
+ * padded with zeros, into its message type. Commands that are not valid
+ * message types, or not padded with zeros, are UNKNOWN.
+ */
+NetMsgId GetNetMsgId(const char* pchCommand);
+
 /** nServices flags */
 enum ServiceFlags : uint64_t {
     // Nothing
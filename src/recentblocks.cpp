@@ -0,0 +1,124 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <recentblocks.h>
+
+#include <core_memusage.h>
+#include <primitives/block.h>
+#include <streams.h>
+#include <util.h>
+#include <version.h>
+
+#include <algorithm>
+
+CRecentBlockCache g_recent_blocks;
+
+static SharedBytes SerializeBlock(const CBlock& block, int version)
+{
+    std::vector<uint8_t> data;
+    data.reserve(::GetSerializeSize(block, SER_NETWORK, version));
+    CVectorWriter{SER_NETWORK, version, data, 0, block};
+    return SharedBytes(std::move(data));
+}
+
+static bool HasWitness(const CBlock& block)
+{
+    return std::any_of(block.vtx.begin(), block.vtx.end(), [](const CTransactionRef& tx) { return tx->HasWitness(); });
+}
+
+CRecentBlock::CRecentBlock(std::shared_ptr<const CBlock> pblock) :
+    m_usage(RecursiveDynamicUsage(*pblock) + 2 * ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION)),
+    hash(pblock->GetHash()),
+    block(std::move(pblock))
+{}
+
+const SharedBytes& CRecentBlock::Data(bool witness) const
+{
+    std::call_once(m_data_once, [this] { m_data = SerializeBlock(*block, PROTOCOL_VERSION); });
+    if (witness)
+        return m_data;
+    std::call_once(m_data_no_witness_once, [this] {
+        m_data_no_witness = HasWitness(*block) ? SerializeBlock(*block, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS) : m_data;
+    });
+    return m_data_no_witness;
+}
+
+void CRecentBlockCache::Evict()
+{
+    while (!m_entries.empty() && (m_entries.size() > m_max_entries || m_usage > m_max_usage)) {
+        m_usage -= m_entries.back()->DynamicMemoryUsage();
+        m_index.erase(m_entries.back()->hash);
+        m_entries.pop_back();
+    }
+}
+
+void CRecentBlockCache::Resize(size_t nMaxEntries, size_t nMaxUsage)
+{
+    LOCK(cs);
+    m_max_entries = nMaxEntries;
+    m_max_usage = nMaxUsage;
+    Evict();
+}
+
+std::shared_ptr<const CRecentBlock> CRecentBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    auto it = m_index.find(hash);
+    if (it == m_index.end()) {
+        m_misses++;
+        return nullptr;
+    }
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    m_hits++;
+    return *it->second;
+}
+
+void CRecentBlockCache::Insert(std::shared_ptr<const CRecentBlock> entry)
+{
+    LOCK(cs);
+    if (m_max_entries == 0 || m_index.count(entry->hash))
+        return;
+    m_usage += entry->DynamicMemoryUsage();
+    m_entries.push_front(std::move(entry));
+    m_index.emplace(m_entries.front()->hash, m_entries.begin());
+    Evict();
+}
+
+size_t CRecentBlockCache::Size() const
+{
+    LOCK(cs);
+    return m_entries.size();
+}
+
+size_t CRecentBlockCache::MaxSize() const
+{
+    LOCK(cs);
+    return m_max_entries;
+}
+
+size_t CRecentBlockCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return m_usage;
+}
+
+uint64_t CRecentBlockCache::Hits() const
+{
+    LOCK(cs);
+    return m_hits;
+}
+
+uint64_t CRecentBlockCache::Misses() const
+{
+    LOCK(cs);
+    return m_misses;
+}
+
+void InitRecentBlockCache()
+{
+    size_t nMaxBlocks = std::min(std::max((int64_t)0, gArgs.GetArg("-maxrecentblocks", DEFAULT_MAX_RECENT_BLOCKS)), MAX_MAX_RECENT_BLOCKS);
+    size_t nMaxUsage = std::max((int64_t)0, gArgs.GetArg("-maxrecentblocksmem", DEFAULT_MAX_RECENT_BLOCKS_MEMORY)) << 20;
+    g_recent_blocks.Resize(nMaxBlocks, nMaxUsage);
+    LogPrintf("Keeping up to %zu recent blocks, up to %zu MiB, in memory for peers\n", nMaxBlocks, nMaxUsage >> 20);
+}
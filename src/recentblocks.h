@@ -0,0 +1,101 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RECENTBLOCKS_H
+#define BITCOIN_RECENTBLOCKS_H
+
+#include <mappedfile.h>
+#include <powcache.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+
+class CBlock;
+
+// Default number of blocks kept by the recent block cache
+static const unsigned int DEFAULT_MAX_RECENT_BLOCKS = 8;
+// Maximum number of blocks the recent block cache may be set to keep
+static const int64_t MAX_MAX_RECENT_BLOCKS = 144;
+// Default memory limit of the recent block cache in MiB
+static const int64_t DEFAULT_MAX_RECENT_BLOCKS_MEMORY = 64;
+
+/**
+ * A block along with its serializations as sent to peers. They are made when
+ * first asked for, so that keeping a block does not delay announcing it.
+ */
+class CRecentBlock
+{
+private:
+    const size_t m_usage;
+    mutable std::once_flag m_data_once;
+    mutable std::once_flag m_data_no_witness_once;
+    mutable SharedBytes m_data;
+    mutable SharedBytes m_data_no_witness;
+
+public:
+    const uint256 hash;
+    const std::shared_ptr<const CBlock> block;
+
+    explicit CRecentBlock(std::shared_ptr<const CBlock> pblock);
+
+    /** The block serialized with witness data, as for MSG_WITNESS_BLOCK, or
+     *  without, as for MSG_BLOCK. Both are the same bytes when no transaction
+     *  has witness data. */
+    const SharedBytes& Data(bool witness) const;
+
+    /** Memory taken by the block and its serializations, counting both whether made yet or not */
+    size_t DynamicMemoryUsage() const { return m_usage; }
+};
+
+/**
+ * LRU cache of the blocks peers ask for most: the last ones announced and
+ * connected. When a new block is announced every peer asks for it at about
+ * the same time; with the cache it is neither read from disk nor serialized
+ * again for each of them. Bounded both by the number of blocks and by their
+ * memory usage.
+ */
+class CRecentBlockCache
+{
+private:
+    typedef std::list<std::shared_ptr<const CRecentBlock>> EntryList;
+
+    mutable CCriticalSection cs;
+    //! Most recently used entries first
+    EntryList m_entries GUARDED_BY(cs);
+    std::unordered_map<uint256, EntryList::iterator, SaltedBlockHashHasher> m_index GUARDED_BY(cs);
+    size_t m_max_entries GUARDED_BY(cs) = 0;
+    size_t m_max_usage GUARDED_BY(cs) = 0;
+    size_t m_usage GUARDED_BY(cs) = 0;
+    uint64_t m_hits GUARDED_BY(cs) = 0;
+    uint64_t m_misses GUARDED_BY(cs) = 0;
+
+    void Evict() EXCLUSIVE_LOCKS_REQUIRED(cs);
+
+public:
+    /** Limit the cache to nMaxEntries blocks taking up to nMaxUsage bytes,
+     *  evicting the least recently used ones. 0 blocks disables it. */
+    void Resize(size_t nMaxEntries, size_t nMaxUsage);
+    /** Look up a block, counting a hit or a miss. Returns nullptr if it is not cached. */
+    std::shared_ptr<const CRecentBlock> Get(const uint256& hash);
+    void Insert(std::shared_ptr<const CRecentBlock> entry);
+
+    size_t Size() const;
+    size_t MaxSize() const;
+    size_t DynamicMemoryUsage() const;
+    uint64_t Hits() const;
+    uint64_t Misses() const;
+};
+
+extern CRecentBlockCache g_recent_blocks;
+
+/** Size g_recent_blocks from -maxrecentblocks and -maxrecentblocksmem. */
+void InitRecentBlockCache();
+
+#endif // BITCOIN_RECENTBLOCKS_H
@@ -11,9 +11,11 @@
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <coins.h>
+#include <coinstats.h>
 #include <consensus/validation.h>
 #include <validation.h>
 #include <core_io.h>
+#include <index/coinstatsindex.h>
 #include <index/txindex.h>
 #include <key_io.h>
 #include <policy/feerate.h>
@@ -42,6 +44,7 @@
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 
 struct CUpdatedBlock
 {
@@ -838,77 +841,6 @@ static UniValue getblock(const JSONRPCRequest& request)
     return blockToJSON(block, pblockindex, verbosity >= 2);
 }
 
-struct CCoinsStats
-{
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nBogoSize;
-    uint256 hashSerialized;
-    uint64_t nDiskSize;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
-};
-
-static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
-{
-    assert(!outputs.empty());
-    ss << hash;
-    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase ? 1u : 0u);
-    stats.nTransactions++;
-    for (const auto& output : outputs) {
-        ss << VARINT(output.first + 1);
-        ss << output.second.out.scriptPubKey;
-        ss << VARINT(output.second.out.nValue, VarIntMode::NONNEGATIVE_SIGNED);
-        stats.nTransactionOutputs++;
-        stats.nTotalAmount += output.second.out.nValue;
-        stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
-                           2 /* scriptPubKey len */ + output.second.out.scriptPubKey.size() /* scriptPubKey */;
-    }
-    ss << VARINT(0u);
-}
-
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
-{
-    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-    assert(pcursor);
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = LookupBlockIndex(stats.hashBlock)->nHeight;
-    }
-    ss << stats.hashBlock;
-    uint256 prevkey;
-    std::map<uint32_t, Coin> outputs;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        COutPoint key;
-        Coin coin;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
-            if (!outputs.empty() && key.hash != prevkey) {
-                ApplyStats(stats, ss, prevkey, outputs);
-                outputs.clear();
-            }
-            prevkey = key.hash;
-            outputs[key.n] = std::move(coin);
-        } else {
-            return error("%s: unable to read value", __func__);
-        }
-        pcursor->Next();
-    }
-    if (!outputs.empty()) {
-        ApplyStats(stats, ss, prevkey, outputs);
-    }
-    stats.hashSerialized = ss.GetHash();
-    stats.nDiskSize = view->EstimateSize();
-    return true;
-}
-
 static UniValue pruneblockchain(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -958,45 +890,120 @@ static UniValue pruneblockchain(const JSONRPCRequest& request)
     return uint64_t(height);
 }
 
+static CoinStatsHashType ParseHashType(const UniValue& param)
+{
+    if (param.isNull() || param.get_str() == "hash_serialized_2") {
+        return CoinStatsHashType::HASH_SERIALIZED;
+    } else if (param.get_str() == "muhash") {
+        return CoinStatsHashType::MUHASH;
+    } else if (param.get_str() == "none") {
+        return CoinStatsHashType::NONE;
+    }
+    throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("%s is not a valid hash_type", param.get_str()));
+}
+
 static UniValue gettxoutsetinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 1)
         throw std::runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time, unless -coinstatsindex is enabled and a hash_type other than hash_serialized_2 is asked for.\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"   (string, optional, default=\"hash_serialized_2\") Which UTXO set hash to calculate: \"hash_serialized_2\",\n"
+            "                  \"muhash\" or \"none\". The last two are calculated on several threads.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) The hash of the block at the tip of the chain\n"
-            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs\n"
+            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs (not available from -coinstatsindex)\n"
             "  \"txouts\": n,            (numeric) The number of unspent transaction outputs\n"
             "  \"bogosize\": n,          (numeric) A meaningless metric for UTXO set size\n"
-            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash\n"
+            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash (only for hash_type hash_serialized_2)\n"
+            "  \"muhash\": \"hash\",     (string) The MuHash3072 of the set (only for hash_type muhash)\n"
             "  \"disk_size\": n,         (numeric) The estimated size of the chainstate on disk\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"muhash\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
     UniValue ret(UniValue::VOBJ);
 
+    const CoinStatsHashType hash_type = ParseHashType(request.params[0]);
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (GetUTXOStats(pcoinsdbview.get(), stats)) {
-        ret.pushKV("height", (int64_t)stats.nHeight);
-        ret.pushKV("bestblock", stats.hashBlock.GetHex());
+    // The index has the statistics as of the tip ready, once it has caught up.
+    bool fFromIndex = false;
+    if (g_coinstatsindex && hash_type != CoinStatsHashType::HASH_SERIALIZED && g_coinstatsindex->BlockUntilSyncedToCurrentChain()) {
+        const CBlockIndex* tip;
+        {
+            LOCK(cs_main);
+            tip = chainActive.Tip();
+        }
+        fFromIndex = g_coinstatsindex->LookUpStats(tip, stats);
+        stats.nDiskSize = pcoinsdbview->EstimateSize();
+    }
+    if (!fFromIndex) {
+        FlushStateToDisk();
+        if (!GetUTXOStats(pcoinsdbview.get(), stats, hash_type, GetNumCores())) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        }
+    }
+    ret.pushKV("height", (int64_t)stats.nHeight);
+    ret.pushKV("bestblock", stats.hashBlock.GetHex());
+    if (!fFromIndex) {
         ret.pushKV("transactions", (int64_t)stats.nTransactions);
-        ret.pushKV("txouts", (int64_t)stats.nTransactionOutputs);
-        ret.pushKV("bogosize", (int64_t)stats.nBogoSize);
+    }
+    ret.pushKV("txouts", (int64_t)stats.nTransactionOutputs);
+    ret.pushKV("bogosize", (int64_t)stats.nBogoSize);
+    if (hash_type == CoinStatsHashType::HASH_SERIALIZED) {
         ret.pushKV("hash_serialized_2", stats.hashSerialized.GetHex());
-        ret.pushKV("disk_size", stats.nDiskSize);
-        ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
-    } else {
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    } else if (hash_type == CoinStatsHashType::MUHASH) {
+        ret.pushKV("muhash", stats.hashSerialized.GetHex());
     }
+    ret.pushKV("disk_size", stats.nDiskSize);
+    ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
+    return ret;
+}
+
+static UniValue getcoinscacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw std::runtime_error(
+            "getcoinscacheinfo\n"
+            "\nReturns details about the in-memory cache of the unspent transaction output set.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins\": n,           (numeric) The number of coins cached\n"
+            "  \"usage\": n,           (numeric) Memory used by the cache, in bytes\n"
+            "  \"maxusage\": n,        (numeric) Memory the cache may use (-dbcache), in bytes\n"
+            "  \"retain\": n,          (numeric) Percentage of the cache kept after a flush (-dbcacheretain)\n"
+            "  \"pendingusage\": n,    (numeric) Memory used by coins still being written to the database, in bytes\n"
+            "  \"hits\": n,            (numeric) Lookups answered from the cache since startup\n"
+            "  \"misses\": n,          (numeric) Lookups that had to go to the database since startup\n"
+            "  \"hitrate\": x.xxx,     (numeric) hits / (hits + misses)\n"
+            "  \"evicted\": n          (numeric) Unmodified coins evicted after flushes since startup\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcoinscacheinfo", "")
+            + HelpExampleRpc("getcoinscacheinfo", "")
+        );
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    const uint64_t nHits = pcoinsTip->GetHits();
+    const uint64_t nMisses = pcoinsTip->GetMisses();
+    ret.pushKV("coins", (int64_t)pcoinsTip->GetCacheSize());
+    ret.pushKV("usage", (int64_t)pcoinsTip->DynamicMemoryUsage());
+    ret.pushKV("maxusage", (int64_t)nCoinCacheUsage);
+    ret.pushKV("retain", nCoinCacheRetain);
+    ret.pushKV("pendingusage", pcoinswritebehind ? (int64_t)pcoinswritebehind->DynamicMemoryUsage() : 0);
+    ret.pushKV("hits", nHits);
+    ret.pushKV("misses", nMisses);
+    ret.pushKV("hitrate", nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0);
+    ret.pushKV("evicted", pcoinsTip->GetEvicted());
     return ret;
 }
 
@@ -1968,32 +1975,38 @@ static UniValue savemempool(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
-//! Search for a given set of pubkey scripts
-bool FindScriptPubKey(std::atomic<int>& scan_progress, const std::atomic<bool>& should_abort, int64_t& count, CCoinsViewCursor* cursor, const std::set<CScript>& needles, std::map<COutPoint, Coin>& out_results) {
-    scan_progress = 0;
+/** Maximum number of threads scantxoutset splits the UTXO set between */
+static const int MAX_SCAN_THREADS = 16;
+
+//! Search one range of txids for a given set of pubkey scripts. The range
+//! covers [begin, end) of the 2-byte txid prefixes, and scan_progress is
+//! advanced by how many of them were searched, as the scan goes.
+static bool FindScriptPubKey(std::atomic<int>& scan_progress, const std::atomic<bool>& should_abort, int64_t& count, CCoinsViewCursor* cursor, int begin, int end, const std::set<CScript>& needles, std::map<COutPoint, Coin>& out_results) {
+    int position = begin;
     count = 0;
     while (cursor->Valid()) {
         COutPoint key;
         Coin coin;
         if (!cursor->GetKey(key) || !cursor->GetValue(coin)) return false;
-        if (++count % 8192 == 0) {
+        if (++count % 256 == 0) {
             boost::this_thread::interruption_point();
-            if (should_abort) {
+            if (should_abort.load(std::memory_order_relaxed)) {
                 // allow to abort the scan via the abort reference
                 return false;
             }
-        }
-        if (count % 256 == 0) {
             // update progress reference every 256 item
-            uint32_t high = 0x100 * *key.hash.begin() + *(key.hash.begin() + 1);
-            scan_progress = (int)(high * 100.0 / 65536.0 + 0.5);
+            const int high = 0x100 * *key.hash.begin() + *(key.hash.begin() + 1);
+            if (high > position) {
+                scan_progress.fetch_add(high - position, std::memory_order_relaxed);
+                position = high;
+            }
         }
         if (needles.count(coin.out.scriptPubKey)) {
             out_results.emplace(key, coin);
         }
         cursor->Next();
     }
-    scan_progress = 100;
+    scan_progress.fetch_add(end - position, std::memory_order_relaxed);
     return true;
 }
 
@@ -2035,6 +2048,7 @@ UniValue scantxoutset(const JSONRPCRequest& request)
             "scantxoutset <action> ( <scanobjects> )\n"
             "\nEXPERIMENTAL warning: this call may be removed or changed in future releases.\n"
             "\nScans the unspent transaction output set for entries that match certain output descriptors.\n"
+            "The set is split between as many threads as there are cores.\n"
             "Examples of output descriptors are:\n"
             "    addr(<address>)                      Outputs whose scriptPubKey corresponds to the specified address (does not include P2PK)\n"
             "    raw(<hex script>)                    Outputs whose scriptPubKey equals the specified hex scripts\n"
@@ -2084,7 +2098,7 @@ UniValue scantxoutset(const JSONRPCRequest& request)
             // no scan in progress
             return NullUniValue;
         }
-        result.pushKV("progress", g_scan_progress);
+        result.pushKV("progress", (int)(g_scan_progress * 100.0 / 65536.0 + 0.5));
         return result;
     } else if (request.params[0].get_str() == "abort") {
         CoinsViewScanReserver reserver;
@@ -2140,18 +2154,57 @@ UniValue scantxoutset(const JSONRPCRequest& request)
         // Scan the unspent transaction output set for inputs
         UniValue unspents(UniValue::VARR);
         std::vector<CTxOut> input_txos;
-        std::map<COutPoint, Coin> coins;
         g_should_abort_scan = false;
         g_scan_progress = 0;
-        int64_t count = 0;
-        std::unique_ptr<CCoinsViewCursor> pcursor;
+        const int nThreads = std::max(1, std::min(GetNumCores(), MAX_SCAN_THREADS));
+        std::vector<std::unique_ptr<CCoinsViewCursor>> cursors;
         {
             LOCK(cs_main);
             FlushStateToDisk();
-            pcursor = std::unique_ptr<CCoinsViewCursor>(pcoinsdbview->Cursor());
-            assert(pcursor);
+            cursors = pcoinsdbview->Cursors(nThreads);
+        }
+        // Every thread searches a range of its own. One failing stops the
+        // others the way an abort does, as the scan has failed anyway.
+        std::vector<std::map<COutPoint, Coin>> vCoins(nThreads);
+        std::vector<int64_t> vCount(nThreads);
+        std::vector<char> vOk(nThreads);
+        auto scan = [&](int i) {
+            const int begin = 0x100 * (0x100 * i / nThreads), end = 0x100 * (0x100 * (i + 1) / nThreads);
+            try {
+                vOk[i] = FindScriptPubKey(g_scan_progress, g_should_abort_scan, vCount[i], cursors[i].get(), begin, end, needles, vCoins[i]);
+            } catch (const boost::thread_interrupted&) {
+                g_should_abort_scan = true;
+                throw;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+            }
+            if (!vOk[i]) g_should_abort_scan = true;
+        };
+        std::vector<std::thread> threads;
+        for (int i = 1; i < nThreads; i++) {
+            threads.emplace_back([&scan, i] {
+                RenameThread("stredle-scan");
+                scan(i);
+            });
+        }
+        try {
+            scan(0);
+        } catch (...) {
+            for (std::thread& thread : threads) thread.join();
+            throw;
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        bool res = true;
+        int64_t count = 0;
+        std::map<COutPoint, Coin> coins;
+        for (int i = 0; i < nThreads; i++) {
+            res &= vOk[i];
+            count += vCount[i];
+            coins.insert(vCoins[i].begin(), vCoins[i].end());
         }
-        bool res = FindScriptPubKey(g_scan_progress, g_should_abort_scan, count, pcursor.get(), needles, coins);
         result.pushKV("success", res);
         result.pushKV("searched_items", count);
 
@@ -2191,6 +2244,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           {"height"} },
     { "blockchain",         "getblockheader",         &getblockheader,         {"blockhash","verbose"} },
     { "blockchain",         "getchaintips",           &getchaintips,           {} },
+    { "blockchain",         "getcoinscacheinfo",      &getcoinscacheinfo,      {} },
     { "blockchain",         "getdifficulty",          &getdifficulty,          {} },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    {"txid","verbose"} },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  {"txid","verbose"} },
@@ -2198,7 +2252,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {"hash_type"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
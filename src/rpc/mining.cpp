@@ -115,6 +115,9 @@ UniValue generateBlocks(std::shared_ptr<CReserveScript> coinbaseScript, int nGen
         nHeightEnd = nHeight+nGenerate;
     }
     unsigned int nExtraNonce = 0;
+    int nThreads = gArgs.GetArg("-genproclimit", DEFAULT_GENERATE_THREADS);
+    if (nThreads < 0)
+        nThreads = GetNumCores();
     UniValue blockHashes(UniValue::VARR);
     while (nHeight < nHeightEnd && !ShutdownRequested())
     {
@@ -126,10 +129,10 @@ UniValue generateBlocks(std::shared_ptr<CReserveScript> coinbaseScript, int nGen
             LOCK(cs_main);
             IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
         }
-        while (nMaxTries > 0 && pblock->nNonce < nInnerLoopCount && !CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, Params().GetConsensus())) {
-            ++pblock->nNonce;
-            --nMaxTries;
-        }
+        // Finds the same nonce as trying them one by one, whatever nThreads is.
+        const uint32_t nNonceBegin = pblock->nNonce;
+        FindNonce(*pblock, std::min<uint64_t>(nInnerLoopCount, nNonceBegin + nMaxTries), nThreads, Params().GetConsensus());
+        nMaxTries -= pblock->nNonce - nNonceBegin;
         if (nMaxTries == 0) {
             break;
         }
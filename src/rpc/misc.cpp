@@ -13,6 +13,7 @@
 #include <net.h>
 #include <netbase.h>
 #include <outputtype.h>
+#include <powcache.h>
 #include <rpc/blockchain.h>
 #include <rpc/server.h>
 #include <rpc/util.h>
@@ -290,6 +291,18 @@ static UniValue RPCLockedMemoryInfo()
     return obj;
 }
 
+static UniValue RPCPoWCacheInfo()
+{
+    UniValue obj(UniValue::VOBJ);
+    const size_t entries = g_pow_hash_cache.Size();
+    obj.pushKV("entries", uint64_t(entries));
+    obj.pushKV("max_entries", uint64_t(g_pow_hash_cache.MaxSize()));
+    obj.pushKV("usage", uint64_t(entries * CPoWHashCache::EntryUsage()));
+    obj.pushKV("hits", g_pow_hash_cache.Hits());
+    obj.pushKV("misses", g_pow_hash_cache.Misses());
+    return obj;
+}
+
 #ifdef HAVE_MALLOC_INFO
 static std::string RPCMallocInfo()
 {
@@ -331,6 +344,13 @@ static UniValue getmemoryinfo(const JSONRPCRequest& request)
             "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
             "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
             "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  },\n"
+            "  \"powcache\": {             (json object) Information about the block header proof-of-work hash cache\n"
+            "    \"entries\": xxxxx,       (numeric) Number of cached hashes\n"
+            "    \"max_entries\": xxxxx,   (numeric) Maximum number of cached hashes\n"
+            "    \"usage\": xxxxx,         (numeric) Approximate number of bytes used\n"
+            "    \"hits\": xxxxx,          (numeric) Number of scrypt evaluations avoided since startup\n"
+            "    \"misses\": xxxxx,        (numeric) Number of headers scrypt hashed since startup\n"
             "  }\n"
             "}\n"
             "\nResult (mode \"mallocinfo\"):\n"
@@ -344,6 +364,7 @@ static UniValue getmemoryinfo(const JSONRPCRequest& request)
     if (mode == "stats") {
         UniValue obj(UniValue::VOBJ);
         obj.pushKV("locked", RPCLockedMemoryInfo());
+        obj.pushKV("powcache", RPCPoWCacheInfo());
         return obj;
     } else if (mode == "mallocinfo") {
 #ifdef HAVE_MALLOC_INFO
@@ -65,6 +65,34 @@ static UniValue ping(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+static void PushLatencyPercentiles(UniValue& obj, const LatencyHistogram& latency)
+{
+    obj.pushKV("p50", latency.Percentile(0.5));
+    obj.pushKV("p90", latency.Percentile(0.9));
+    obj.pushKV("p99", latency.Percentile(0.99));
+    obj.pushKV("max", latency.Max());
+}
+
+static UniValue LatencyToJSON(const LatencyHistogram& latency)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("total", latency.Sum());
+    PushLatencyPercentiles(obj, latency);
+    return obj;
+}
+
+static UniValue MessageProfileToJSON(const CMessageProfile& profile)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("count", profile.processing.Count());
+    obj.pushKV("bytes", profile.nBytes);
+    obj.pushKV("queue_wait", LatencyToJSON(profile.queue_wait));
+    obj.pushKV("processing", LatencyToJSON(profile.processing));
+    obj.pushKV("cs_main_held", LatencyToJSON(profile.cs_main_held));
+    obj.pushKV("latency", LatencyToJSON(profile.latency));
+    return obj;
+}
+
 static UniValue getpeerinfo(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 0)
@@ -109,6 +137,10 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             "    \"bytesrecv_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes received aggregated by message type\n"
             "       ...\n"
+            "    },\n"
+            "    \"msgprofile\": {           (json object) Only with -netprofile. See getnetprofile for the fields\n"
+            "       \"addr\": {...},          (json object) The profile of the messages received of a type\n"
+            "       ...\n"
             "    }\n"
             "  }\n"
             "  ,...\n"
@@ -184,6 +216,12 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
         }
         obj.pushKV("bytesrecv_per_msg", recvPerMsgCmd);
 
+        UniValue msgProfile(UniValue::VOBJ);
+        for (const mapMsgCmdProfile::value_type &i : stats.mapMsgProfile) {
+            msgProfile.pushKV(i.first, MessageProfileToJSON(i.second));
+        }
+        obj.pushKV("msgprofile", msgProfile);
+
         ret.push_back(obj);
     }
 
@@ -392,6 +430,100 @@ static UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+static UniValue getmessagelatency(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "getmessagelatency\n"
+            "\nReturns, per type of message received, how long it took from receiving a message\n"
+            "to having processed it, including the time it waited behind other messages.\n"
+            "Always recorded, unlike the fuller profile of getnetprofile.\n"
+            "Percentiles are estimates within about 20%. Message types not received are omitted.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"msg\": {              (json object) Message type, *other* for unknown types\n"
+            "    \"count\": n,         (numeric) Number of messages processed\n"
+            "    \"p50\": n,           (numeric) Median latency in microseconds\n"
+            "    \"p90\": n,           (numeric) 90th percentile latency in microseconds\n"
+            "    \"p99\": n,           (numeric) 99th percentile latency in microseconds\n"
+            "    \"max\": n            (numeric) Highest latency in microseconds\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagelatency", "")
+            + HelpExampleRpc("getmessagelatency", "")
+       );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    UniValue obj(UniValue::VOBJ);
+    for (const auto& entry : g_connman->GetMessageLatencies()) {
+        UniValue type(UniValue::VOBJ);
+        type.pushKV("count", entry.second.Count());
+        PushLatencyPercentiles(type, entry.second);
+        obj.pushKV(entry.first, type);
+    }
+    return obj;
+}
+
+static UniValue getnetprofile(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 0)
+        throw std::runtime_error(
+            "getnetprofile\n"
+            "\nReturns where the time went processing each type of message received from all peers,\n"
+            "and the bytes sent per type of message. Only collected with -netprofile.\n"
+            "Times are in microseconds; percentiles are estimates within about 20%.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,     (boolean) Whether -netprofile is set\n"
+            "  \"received\": {\n"
+            "    \"msg\": {                 (json object) Message type, *other* for unknown types\n"
+            "      \"count\": n,            (numeric) Number of messages processed\n"
+            "      \"bytes\": n,            (numeric) Bytes received, including headers\n"
+            "      \"queue_wait\": {        (json object) From receiving a message to starting to process it\n"
+            "        \"total\": n,          (numeric) Summed over all messages\n"
+            "        \"p50\": n,            (numeric) Median\n"
+            "        \"p90\": n,            (numeric) 90th percentile\n"
+            "        \"p99\": n,            (numeric) 99th percentile\n"
+            "        \"max\": n             (numeric) Highest\n"
+            "      },\n"
+            "      \"processing\": {...},   (json object) Processing the message, likewise\n"
+            "      \"cs_main_held\": {...}, (json object) Holding cs_main while processing it, likewise\n"
+            "      \"latency\": {...}       (json object) From receiving a message to having processed it, likewise\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"bytessent_per_msg\": {\n"
+            "    \"addr\": n,               (numeric) The total bytes sent to all peers by message type\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetprofile", "")
+            + HelpExampleRpc("getnetprofile", "")
+       );
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("enabled", g_connman->IsProfilingMessages());
+
+    UniValue received(UniValue::VOBJ);
+    for (const mapMsgCmdProfile::value_type &i : g_connman->GetMessageProfile()) {
+        received.pushKV(i.first, MessageProfileToJSON(i.second));
+    }
+    obj.pushKV("received", received);
+
+    UniValue sendPerMsgCmd(UniValue::VOBJ);
+    for (const mapMsgCmdSize::value_type &i : g_connman->GetSendBytesPerMsgCmd()) {
+        sendPerMsgCmd.pushKV(i.first, i.second);
+    }
+    obj.pushKV("bytessent_per_msg", sendPerMsgCmd);
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -635,6 +767,8 @@ static const CRPCCommand commands[] =
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       {"node"} },
     { "network",            "getnettotals",           &getnettotals,           {} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         {} },
+    { "network",            "getmessagelatency",      &getmessagelatency,      {} },
+    { "network",            "getnetprofile",          &getnetprofile,          {} },
     { "network",            "setban",                 &setban,                 {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             {} },
     { "network",            "clearbanned",            &clearbanned,            {} },
@@ -6,6 +6,7 @@
 
 #include <logging.h>
 #include <utilstrencodings.h>
+#include <utiltime.h>
 
 #include <stdio.h>
 
@@ -190,3 +191,40 @@ void DeleteLock(void* cs)
 }
 
 #endif /* DEBUG_LOCKORDER */
+
+#ifdef HAVE_THREAD_LOCAL
+thread_local LockHoldTimer* g_lock_hold_timer = nullptr;
+#endif
+
+LockHoldTimer::LockHoldTimer(const CCriticalSection& cs) : m_cs(&cs)
+{
+#ifdef HAVE_THREAD_LOCAL
+    assert(!g_lock_hold_timer);
+    g_lock_hold_timer = this;
+#endif
+}
+
+LockHoldTimer::~LockHoldTimer()
+{
+#ifdef HAVE_THREAD_LOCAL
+    g_lock_hold_timer = nullptr;
+#endif
+}
+
+int64_t LockHoldTimer::Elapsed() const
+{
+    return m_depth ? m_held + GetTimeMicros() - m_start : m_held;
+}
+
+void LockHoldTimer::Acquired(const void* cs)
+{
+    if (cs != m_cs) return;
+    if (m_depth++ == 0) m_start = GetTimeMicros();
+}
+
+void LockHoldTimer::Released(const void* cs)
+{
+    // A lock taken before the timer existed was not counted.
+    if (cs != m_cs || m_depth == 0) return;
+    if (--m_depth == 0) m_held += GetTimeMicros() - m_start;
+}
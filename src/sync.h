@@ -6,8 +6,14 @@
 #ifndef BITCOIN_SYNC_H
 #define BITCOIN_SYNC_H
 
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
 #include <threadsafety.h>
 
+#include <stdint.h>
+
 #include <condition_variable>
 #include <thread>
 #include <mutex>
@@ -112,6 +118,54 @@ typedef std::unique_lock<std::mutex> WaitableLock;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/**
+ * Measures how long the current thread holds a lock while the timer exists,
+ * counting recursive locking once. Only sees locking through CCriticalBlock
+ * (LOCK, LOCK2 and TRY_LOCK). A thread can have one timer at a time. Without
+ * thread_local support it measures nothing.
+ */
+class LockHoldTimer
+{
+public:
+    explicit LockHoldTimer(const CCriticalSection& cs);
+    ~LockHoldTimer();
+    LockHoldTimer(const LockHoldTimer&) = delete;
+    LockHoldTimer& operator=(const LockHoldTimer&) = delete;
+
+    /** Microseconds the lock was held for so far */
+    int64_t Elapsed() const;
+
+    void Acquired(const void* cs);
+    void Released(const void* cs);
+
+private:
+    const void* const m_cs;
+    int m_depth = 0;
+    int64_t m_start = 0;
+    int64_t m_held = 0;
+};
+
+#ifdef HAVE_THREAD_LOCAL
+//! The current thread's LockHoldTimer, if any
+extern thread_local LockHoldTimer* g_lock_hold_timer;
+#endif
+
+inline void LockHoldTimerAcquired(const void* cs)
+{
+#ifdef HAVE_THREAD_LOCAL
+    if (g_lock_hold_timer)
+        g_lock_hold_timer->Acquired(cs);
+#endif
+}
+
+inline void LockHoldTimerReleased(const void* cs)
+{
+#ifdef HAVE_THREAD_LOCAL
+    if (g_lock_hold_timer)
+        g_lock_hold_timer->Released(cs);
+#endif
+}
+
 /** Wrapper around std::unique_lock<CCriticalSection> */
 class SCOPED_LOCKABLE CCriticalBlock
 {
@@ -129,6 +183,7 @@ private:
 #ifdef DEBUG_LOCKCONTENTION
         }
 #endif
+        LockHoldTimerAcquired(lock.mutex());
     }
 
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
@@ -137,6 +192,8 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else
+            LockHoldTimerAcquired(lock.mutex());
         return lock.owns_lock();
     }
 
@@ -162,8 +219,10 @@ public:
 
     ~CCriticalBlock() UNLOCK_FUNCTION()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
+            LockHoldTimerReleased(lock.mutex());
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -3,7 +3,10 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <coins.h>
+#include <coinstats.h>
+#include <crypto/muhash.h>
 #include <script/standard.h>
+#include <txdb.h>
 #include <uint256.h>
 #include <undo.h>
 #include <utilstrencodings.h>
@@ -207,10 +210,21 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         }
 
         if (InsecureRandRange(100) == 0) {
-            // Every 100 iterations, flush an intermediate cache
+            // Every 100 iterations, flush an intermediate cache, possibly
+            // keeping some or all of its entries.
             if (stack.size() > 1 && InsecureRandBool() == 0) {
                 unsigned int flushIndex = InsecureRandRange(stack.size() - 1);
-                stack[flushIndex]->Flush();
+                switch (InsecureRandRange(3)) {
+                case 0:
+                    stack[flushIndex]->Flush();
+                    break;
+                case 1:
+                    stack[flushIndex]->Sync();
+                    break;
+                default:
+                    stack[flushIndex]->Sync(InsecureRandRange(stack[flushIndex]->DynamicMemoryUsage() + 1));
+                    stack[flushIndex]->SelfTest();
+                }
             }
         }
         if (InsecureRandRange(100) == 0) {
@@ -440,10 +454,21 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
         }
 
         if (InsecureRandRange(100) == 0) {
-            // Every 100 iterations, flush an intermediate cache
+            // Every 100 iterations, flush an intermediate cache, possibly
+            // keeping some or all of its entries.
             if (stack.size() > 1 && InsecureRandBool() == 0) {
                 unsigned int flushIndex = InsecureRandRange(stack.size() - 1);
-                stack[flushIndex]->Flush();
+                switch (InsecureRandRange(3)) {
+                case 0:
+                    stack[flushIndex]->Flush();
+                    break;
+                case 1:
+                    stack[flushIndex]->Sync();
+                    break;
+                default:
+                    stack[flushIndex]->Sync(InsecureRandRange(stack[flushIndex]->DynamicMemoryUsage() + 1));
+                    stack[flushIndex]->SelfTest();
+                }
             }
         }
         if (InsecureRandRange(100) == 0) {
@@ -656,6 +681,39 @@ BOOST_AUTO_TEST_CASE(ccoins_access)
     CheckAccessCoin(VALUE1, VALUE2, VALUE2, DIRTY|FRESH, DIRTY|FRESH);
 }
 
+static void CheckCacheCoin(CAmount cache_value, CAmount expected_value, char cache_flags, char expected_flags)
+{
+    SingleEntryCacheTest test(VALUE1, cache_value, cache_flags);
+    Coin coin;
+    SetCoinsValue(VALUE1, coin);
+    BOOST_CHECK_EQUAL(test.cache.CacheCoin(OUTPOINT, std::move(coin)), cache_flags == NO_ENTRY);
+    test.cache.SelfTest();
+
+    CAmount result_value;
+    char result_flags;
+    GetCoinsMapEntry(test.cache.map(), result_value, result_flags);
+    BOOST_CHECK_EQUAL(result_value, expected_value);
+    BOOST_CHECK_EQUAL(result_flags, expected_flags);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_cache)
+{
+    /* Check CacheCoin behavior, adding the coin the base view holds to a
+     * cache view layered on top of it, and checking the resulting entry in
+     * the cache. An entry already in the cache is never replaced.
+     *
+     *              Cache   Result  Cache        Result
+     *              Value   Value   Flags        Flags
+     */
+    CheckCacheCoin(ABSENT, VALUE1, NO_ENTRY   , 0          );
+    CheckCacheCoin(PRUNED, PRUNED, 0          , 0          );
+    CheckCacheCoin(PRUNED, PRUNED, DIRTY      , DIRTY      );
+    CheckCacheCoin(PRUNED, PRUNED, DIRTY|FRESH, DIRTY|FRESH);
+    CheckCacheCoin(VALUE2, VALUE2, 0          , 0          );
+    CheckCacheCoin(VALUE2, VALUE2, DIRTY      , DIRTY      );
+    CheckCacheCoin(VALUE2, VALUE2, DIRTY|FRESH, DIRTY|FRESH);
+}
+
 static void CheckSpendCoins(CAmount base_value, CAmount cache_value, CAmount expected_value, char cache_flags, char expected_flags)
 {
     SingleEntryCacheTest test(base_value, cache_value, cache_flags);
@@ -855,4 +913,179 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+// Flush a cache to a CCoinsViewWriteBehind over and over while changing it,
+// and check that every coin reads back right through it while writes are in
+// progress, and from the database once they are done.
+BOOST_AUTO_TEST_CASE(coins_write_behind)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<COutPoint, Coin> result;
+    uint256 hashBlock;
+    {
+        CCoinsViewWriteBehind writer(db);
+        CCoinsViewCache cache(&writer);
+        for (int round = 0; round < 40; round++) {
+            for (int i = 0; i < 200; i++) {
+                COutPoint outpoint(InsecureRand256(), 0);
+                // Spend a known coin now and then, possibly one in the write in progress.
+                if (!result.empty() && InsecureRandBool()) {
+                    auto it = result.begin();
+                    std::advance(it, InsecureRandRange(result.size()));
+                    BOOST_CHECK(cache.SpendCoin(it->first));
+                    result.erase(it);
+                    continue;
+                }
+                Coin coin;
+                coin.out.nValue = InsecureRand32();
+                coin.out.scriptPubKey.assign(InsecureRandRange(50) + 1, 0);
+                coin.nHeight = round + 1;
+                result[outpoint] = coin;
+                cache.AddCoin(outpoint, std::move(coin), false);
+            }
+            hashBlock = InsecureRand256();
+            cache.SetBestBlock(hashBlock);
+            BOOST_CHECK(cache.Flush());
+            BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+
+            // A fresh cache reads everything through the writer.
+            CCoinsViewCache check(&writer);
+            for (const auto& entry : result) {
+                BOOST_CHECK(check.AccessCoin(entry.first) == entry.second);
+            }
+        }
+        BOOST_CHECK(writer.Sync());
+        BOOST_CHECK(!writer.IsWriting());
+        BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    }
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    size_t count = 0;
+    std::unique_ptr<CCoinsViewCursor> cursor(db.Cursor());
+    for (; cursor->Valid(); cursor->Next()) {
+        COutPoint key;
+        Coin coin;
+        BOOST_CHECK(cursor->GetKey(key) && cursor->GetValue(coin));
+        BOOST_CHECK(result.count(key) && result[key] == coin);
+        count++;
+    }
+    BOOST_CHECK_EQUAL(count, result.size());
+}
+
+BOOST_AUTO_TEST_CASE(coins_sync_evict)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    std::vector<COutPoint> outpoints;
+    // Ten blocks' worth of coins, each block's written into the cache in a batch of its own.
+    for (int block = 0; block < 10; block++) {
+        CCoinsViewCacheTest child(&cache);
+        for (int i = 0; i < 100; i++) {
+            outpoints.emplace_back(InsecureRand256(), 0);
+            Coin coin;
+            coin.out.nValue = InsecureRand32();
+            coin.out.scriptPubKey.assign(InsecureRandRange(50) + 1, 0);
+            coin.nHeight = block + 1;
+            child.AddCoin(outpoints.back(), std::move(coin), false);
+        }
+        child.SetBestBlock(InsecureRand256());
+        BOOST_CHECK(child.Flush());
+    }
+    // Spend one coin, and use those of the first block again.
+    BOOST_CHECK(cache.SpendCoin(outpoints.back()));
+    outpoints.pop_back();
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+    }
+    BOOST_CHECK_EQUAL(cache.GetHits(), 101U);
+
+    // Everything but the spent coin stays, unmodified and in the base too.
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(base.GetBestBlock() == cache.GetBestBlock());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), outpoints.size());
+    for (const auto& entry : cache.map()) {
+        BOOST_CHECK_EQUAL(entry.second.flags, 0);
+        Coin coin;
+        BOOST_CHECK(base.GetCoin(entry.first, coin) && coin == entry.second.coin);
+    }
+    cache.SelfTest();
+
+    // Evict down to about half: the oldest blocks go first, the coins just used stay.
+    size_t target = cache.DynamicMemoryUsage() / 2;
+    BOOST_CHECK(cache.Sync(target));
+    size_t evicted = cache.GetEvicted();
+    BOOST_CHECK(evicted > 0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), outpoints.size() - evicted);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= target);
+    cache.SelfTest();
+    for (int i = 0; i < 100; i++) {
+        BOOST_CHECK(cache.HaveCoinInCache(outpoints[i]));
+    }
+    BOOST_CHECK(!cache.HaveCoinInCache(outpoints[100]));
+    BOOST_CHECK(cache.HaveCoinInCache(outpoints.back()));
+
+    // Evicted coins are read from the base again.
+    uint64_t misses = cache.GetMisses();
+    BOOST_CHECK(cache.HaveCoin(outpoints[100]));
+    BOOST_CHECK_EQUAL(cache.GetMisses(), misses + 1);
+
+    // Modified entries are evicted too, once they have been handed to the base.
+    COutPoint outpoint(InsecureRand256(), 0);
+    Coin coin;
+    coin.out.nValue = 1;
+    cache.AddCoin(outpoint, std::move(coin), false);
+    BOOST_CHECK(cache.Sync(0));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK(base.GetCoin(outpoint, coin) && coin.out.nValue == 1);
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_utxo_stats)
+{
+    CCoinsViewDB db(1 << 20, true);
+    MuHash3072 muhash;
+    CAmount total = 0;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 300; i++) {
+            uint256 txid = InsecureRand256();
+            // Put some transactions right at the edges of the ranges the set is split into.
+            if (i % 10 == 0) *txid.begin() = InsecureRandBool() ? 0x7f : 0x80;
+            const uint32_t outputs = 1 + InsecureRandRange(3);
+            for (uint32_t n = 0; n < outputs; n++) {
+                Coin coin;
+                coin.out.nValue = InsecureRand32();
+                coin.out.scriptPubKey.assign(InsecureRandRange(50) + 1, 0);
+                coin.nHeight = 1;
+                total += coin.out.nValue;
+                ApplyCoinHash(muhash, COutPoint(txid, n), coin);
+                cache.AddCoin(COutPoint(txid, n), std::move(coin), false);
+            }
+        }
+        cache.SetBestBlock(InsecureRand256());
+        BOOST_CHECK(cache.Flush());
+    }
+    uint256 expected;
+    muhash.Finalize(expected);
+
+    CCoinsStats serialized;
+    BOOST_CHECK(GetUTXOStats(&db, serialized, CoinStatsHashType::HASH_SERIALIZED, 4));
+    BOOST_CHECK_EQUAL(serialized.nTransactions, 300U);
+    BOOST_CHECK_EQUAL(serialized.nTotalAmount, total);
+    BOOST_CHECK(serialized.hashBlock == db.GetBestBlock());
+
+    // However the set is split, the ranges add up to the same statistics.
+    for (int threads : {1, 2, 3, 16}) {
+        for (CoinStatsHashType hash_type : {CoinStatsHashType::MUHASH, CoinStatsHashType::NONE}) {
+            CCoinsStats stats;
+            BOOST_CHECK(GetUTXOStats(&db, stats, hash_type, threads));
+            BOOST_CHECK_EQUAL(stats.nTransactions, serialized.nTransactions);
+            BOOST_CHECK_EQUAL(stats.nTransactionOutputs, serialized.nTransactionOutputs);
+            BOOST_CHECK_EQUAL(stats.nBogoSize, serialized.nBogoSize);
+            BOOST_CHECK_EQUAL(stats.nTotalAmount, serialized.nTotalAmount);
+            BOOST_CHECK(stats.hashBlock == serialized.hashBlock);
+            BOOST_CHECK(stats.hashSerialized == (hash_type == CoinStatsHashType::MUHASH ? expected : uint256()));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
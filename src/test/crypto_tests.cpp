@@ -4,6 +4,7 @@
 
 #include <crypto/aes.h>
 #include <crypto/chacha20.h>
+#include <crypto/muhash.h>
 #include <crypto/ripemd160.h>
 #include <crypto/sha1.h>
 #include <crypto/sha256.h>
@@ -11,6 +12,7 @@
 #include <crypto/hmac_sha256.h>
 #include <crypto/hmac_sha512.h>
 #include <random.h>
+#include <streams.h>
 #include <utilstrencodings.h>
 #include <test/test_bitcoin.h>
 
@@ -562,4 +564,87 @@ BOOST_AUTO_TEST_CASE(sha256d64)
     }
 }
 
+static MuHash3072 FromInt(unsigned char i) {
+    unsigned char tmp[32] = {i, 0};
+    MuHash3072 muhash;
+    muhash.Insert(Span<const unsigned char>(tmp, sizeof(tmp)));
+    return muhash;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests)
+{
+    uint256 out;
+
+    for (int iter = 0; iter < 10; ++iter) {
+        uint256 res;
+        int table[4];
+        for (int i = 0; i < 4; ++i) {
+            table[i] = InsecureRandBits(3);
+        }
+        // The same set, in a different order and built in different ways, hashes the same.
+        for (int order = 0; order < 4; ++order) {
+            MuHash3072 acc;
+            for (int i = 0; i < 4; ++i) {
+                int t = table[i ^ order];
+                if (t & 4) {
+                    acc /= FromInt(t & 3);
+                } else {
+                    acc *= FromInt(t & 3);
+                }
+            }
+            acc.Finalize(out);
+            if (order == 0) {
+                res = out;
+            } else {
+                BOOST_CHECK(res == out);
+            }
+        }
+
+        MuHash3072 x = FromInt(InsecureRandBits(4)); // x=X
+        MuHash3072 y = FromInt(InsecureRandBits(4)); // x=X, y=Y
+        MuHash3072 z;                                          // x=X, y=Y, z=1
+        z *= x;                                                // x=X, y=Y, z=X
+        z *= y;                                                // x=X, y=Y, z=X*Y
+        y *= x;                                                // x=X, y=Y*X, z=X*Y
+        z /= y;                                                // x=X, y=Y*X, z=1
+        z.Finalize(out);
+
+        uint256 out2;
+        MuHash3072 a;
+        a.Finalize(out2);
+
+        BOOST_CHECK(out == out2);
+    }
+
+    MuHash3072 acc = FromInt(0);
+    acc *= FromInt(1);
+    acc /= FromInt(2);
+    acc.Finalize(out);
+    BOOST_CHECK_EQUAL(out, uint256S("10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863"));
+
+    // Removing what was inserted, or inserting what was removed, cancels out.
+    unsigned char tmp[32] = {1, 2, 3};
+    const Span<const unsigned char> elem(tmp, sizeof(tmp));
+    MuHash3072 acc2 = FromInt(0);
+    acc2.Remove(elem);
+    acc2.Insert(elem).Insert(elem).Remove(elem);
+    uint256 out2;
+    acc2.Finalize(out2);
+    MuHash3072 acc3 = FromInt(0);
+    acc3.Finalize(out);
+    BOOST_CHECK(out == out2);
+
+    // A serialized accumulator picks up where it left off.
+    MuHash3072 acc4 = FromInt(0);
+    acc4 *= FromInt(1);
+    acc4 /= FromInt(2);
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << acc4;
+    MuHash3072 acc5;
+    ss >> acc5;
+    BOOST_CHECK(ss.empty());
+    acc5.Finalize(out);
+    BOOST_CHECK_EQUAL(out, uint256S("10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863"));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
 #include <dbwrapper.h>
 #include <uint256.h>
 #include <random.h>
@@ -317,6 +321,60 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    std::string db, error;
+    DBOptions options;
+    BOOST_CHECK(ParseDBOption("chainstate.compression=none", db, options, error));
+    BOOST_CHECK_EQUAL(db, "chainstate");
+    BOOST_CHECK(!options.compression);
+#ifdef USE_SNAPPY
+    BOOST_CHECK(ParseDBOption("chainstate.compression=snappy", db, options, error));
+    BOOST_CHECK(options.compression);
+#else
+    // Rejected, rather than silently not compressing.
+    BOOST_CHECK(!ParseDBOption("chainstate.compression=snappy", db, options, error));
+#endif
+    BOOST_CHECK(ParseDBOption("index.blocksize=16384", db, options, error));
+    BOOST_CHECK_EQUAL(db, "index");
+    BOOST_CHECK_EQUAL(options.block_size, 16384U);
+    BOOST_CHECK(ParseDBOption("txindex.bloombits=0", db, options, error));
+    BOOST_CHECK_EQUAL(options.bloom_bits, 0);
+    BOOST_CHECK(ParseDBOption("chainstate.writebuffer=64", db, options, error));
+    BOOST_CHECK_EQUAL(options.write_buffer_size, 64U << 20);
+
+    for (const char* arg : {"", "chainstate", ".blocksize=16384", "chainstate.blocksize", "chainstate.compression=zlib",
+                            "chainstate.blocksize=1", "chainstate.bloombits=-1", "chainstate.writebuffer=0", "chainstate.cache=1"}) {
+        BOOST_CHECK(!ParseDBOption(arg, db, options, error));
+    }
 
+    // Settings apply to the database of the same name, the last one for each option winning.
+    gArgs.ForceSetArg("-dboption", "dbwrapper_options.bloombits=20");
+    BOOST_CHECK_EQUAL(GetDBOptions("dbwrapper_options").bloom_bits, 20);
+    BOOST_CHECK_EQUAL(GetDBOptions("chainstate").bloom_bits, DBOptions().bloom_bits);
+
+    // A database written with one set of options reads fine with another.
+    fs::path ph = SetDataDir("dbwrapper_options");
+    std::vector<std::string> args{"dbwrapper_options.writebuffer=1", "dbwrapper_options.blocksize=1024", "dbwrapper_options.bloombits=0"};
+#ifdef USE_SNAPPY
+    args.push_back("dbwrapper_options.compression=snappy");
+    args.push_back("dbwrapper_options.compression=none");
+#endif
+    for (const std::string& arg : args) {
+        gArgs.ForceSetArg("-dboption", arg);
+        CDBWrapper dbw(ph, 1 << 20, false, false, true);
+        for (int i = 0; i < 1000; i++) {
+            BOOST_CHECK(dbw.Write(i, uint256S(strprintf("%x", i))));
+        }
+        for (int i = 0; i < 1000; i++) {
+            uint256 res;
+            BOOST_CHECK(dbw.Read(i, res) && res == uint256S(strprintf("%x", i)));
+        }
+        dbw.CompactRange(0, 1000);
+        uint256 res;
+        BOOST_CHECK(dbw.Read(999, res) && res == uint256S("3e7"));
+    }
+    gArgs.ForceSetArg("-dboption", "");
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,134 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <map>
+#include <string>
+
+#include <flathashmap.h>
+#include <prevector.h>
+#include <memusage.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(flathashmap_tests, BasicTestingSetup)
+
+// A poor hash, so that lookups have to probe past many colliding groups.
+struct WeakHasher
+{
+    size_t operator()(uint32_t key) const { return (key % 61) << 7; }
+};
+
+typedef flat_hash_map<uint32_t, std::string, WeakHasher> TestMap;
+
+static void CheckEqual(const TestMap& map, const std::map<uint32_t, std::string>& real)
+{
+    BOOST_CHECK_EQUAL(map.size(), real.size());
+    size_t count = 0;
+    for (const auto& entry : map) {
+        auto it = real.find(entry.first);
+        BOOST_CHECK(it != real.end() && it->second == entry.second);
+        ++count;
+    }
+    BOOST_CHECK_EQUAL(count, real.size());
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_random)
+{
+    TestMap map;
+    std::map<uint32_t, std::string> real;
+    for (int i = 0; i < 20000; i++) {
+        const uint32_t key = InsecureRandRange(2000);
+        switch (InsecureRandRange(4)) {
+        case 0:
+        case 1: {
+            const std::string value = std::to_string(InsecureRand32());
+            auto inserted = map.emplace(key, value);
+            BOOST_CHECK_EQUAL(inserted.second, real.emplace(key, value).second);
+            BOOST_CHECK_EQUAL(inserted.first->second, real[key]);
+            break;
+        }
+        case 2:
+            BOOST_CHECK_EQUAL(map.erase(key), real.erase(key));
+            break;
+        case 3: {
+            auto it = map.find(key);
+            BOOST_CHECK_EQUAL(it != map.end(), real.count(key) == 1);
+            if (it != map.end()) BOOST_CHECK_EQUAL(it->second, real[key]);
+            break;
+        }
+        }
+        if (i % 5000 == 0) CheckEqual(map, real);
+    }
+    CheckEqual(map, real);
+
+    // Erasing while iterating, as CCoinsViewCache::BatchWrite() does, visits every entry once.
+    size_t erased = 0;
+    for (auto it = map.begin(); it != map.end(); it = map.erase(it)) {
+        BOOST_CHECK_EQUAL(real.erase(it->first), 1U);
+        erased++;
+    }
+    BOOST_CHECK(real.empty());
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(erased > 0);
+
+    map[7] = "seven";
+    BOOST_CHECK_EQUAL(map.find(7)->second, "seven");
+    map.clear();
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map.find(7) == map.end());
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_stable_references)
+{
+    TestMap map;
+    std::string& first = map[0];
+    first = "zero";
+    // Growing the table many times over must not move the entry.
+    for (uint32_t i = 1; i < 1000; i++) {
+        map[i] = std::to_string(i);
+    }
+    BOOST_CHECK_EQUAL(&map.find(0)->second, &first);
+    BOOST_CHECK_EQUAL(first, "zero");
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_memusage)
+{
+    TestMap map;
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+    for (uint32_t i = 0; i < 1000; i++) {
+        map[i];
+    }
+    const size_t usage = memusage::DynamicUsage(map);
+    BOOST_CHECK(usage >= map.bucket_count() * TestMap::table_entry_size() + map.size() * TestMap::arena_entry_size());
+    // Erased entries are reused rather than growing the arena.
+    for (uint32_t i = 0; i < 500; i++) {
+        map.erase(i);
+    }
+    for (uint32_t i = 1000; i < 1500; i++) {
+        map[i];
+    }
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), usage);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_reserve)
+{
+    for (uint32_t n : {1, 14, 15, 1000}) {
+        TestMap map;
+        map.reserve(n);
+        const size_t buckets = map.bucket_count();
+        BOOST_CHECK_EQUAL(buckets, TestMap::bucket_count_for(n));
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), memusage::ReservedUsage(map, n));
+        // Filling it up allocates nothing more.
+        for (uint32_t i = 0; i < n; i++) {
+            map[i];
+        }
+        BOOST_CHECK_EQUAL(map.bucket_count(), buckets);
+        BOOST_CHECK_EQUAL(map.arena_chunks().size(), 1U);
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), memusage::ReservedUsage(map, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
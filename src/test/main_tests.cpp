@@ -58,6 +58,33 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK_EQUAL(nSum, CAmount{8399999990760000});
 }
 
+BOOST_FIXTURE_TEST_CASE(read_block_skips_pow_for_validated_header, TestChain100Setup)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        pindex = chainActive.Tip();
+    }
+    BOOST_CHECK(pindex->IsValid(BLOCK_VALID_TREE));
+
+    // A block read through its validated index entry skips the scrypt check.
+    const uint64_t skipped_before = g_pow_checks_skipped;
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex, consensusParams));
+    BOOST_CHECK_EQUAL(block.GetHash(), pindex->GetBlockHash());
+    BOOST_CHECK_EQUAL(g_pow_checks_skipped, skipped_before + 1);
+
+    // Reading by position alone always verifies the proof of work.
+    CDiskBlockPos pos;
+    {
+        LOCK(cs_main);
+        pos = pindex->GetBlockPos();
+    }
+    BOOST_CHECK(ReadBlockFromDisk(block, pos, consensusParams));
+    BOOST_CHECK_EQUAL(g_pow_checks_skipped, skipped_before + 1);
+}
+
 static bool ReturnFalse() { return false; }
 static bool ReturnTrue() { return true; }
 
@@ -11,6 +11,7 @@
 #include <validation.h>
 #include <miner.h>
 #include <policy/policy.h>
+#include <pow.h>
 #include <pubkey.h>
 #include <script/standard.h>
 #include <txmempool.h>
@@ -521,4 +522,49 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+// FindNonce needs no chain, so this does without the TestingSetup of the suite
+BOOST_FIXTURE_TEST_CASE(find_nonce_deterministic, BasicTestingSetup)
+{
+    Consensus::Params consensusParams = CreateChainParams(CBaseChainParams::MAIN)->GetConsensus();
+    consensusParams.powLimit = uint256S("ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff");
+
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = InsecureRand256();
+    header.hashMerkleRoot = InsecureRand256();
+    header.nTime = 1500000000;
+    // About one in 256 hashes passes, so the threads and multi-lane batches get used
+    header.nBits = 0x2000ffff;
+
+    for (uint32_t nNonceBegin : {0U, 7U, 100U}) {
+        // Reference: try the nonces one by one
+        CBlockHeader serial = header;
+        serial.nNonce = nNonceBegin;
+        while (serial.nNonce < 4000 && !CheckProofOfWork(serial.GetPoWHash(), serial.nBits, consensusParams))
+            ++serial.nNonce;
+        BOOST_CHECK(serial.nNonce < 4000);
+
+        for (int nThreads : {1, 2, 4}) {
+            CBlockHeader block = header;
+            block.nNonce = nNonceBegin;
+            BOOST_CHECK(FindNonce(block, 4000, nThreads, consensusParams));
+            BOOST_CHECK_EQUAL(block.nNonce, serial.nNonce);
+
+            // The end of the range is exclusive
+            block.nNonce = nNonceBegin;
+            BOOST_CHECK(!FindNonce(block, serial.nNonce, nThreads, consensusParams));
+            BOOST_CHECK_EQUAL(block.nNonce, serial.nNonce);
+        }
+    }
+
+    // With a regtest target the search stays on this thread, with the same result.
+    header.nBits = 0x207fffff;
+    CBlockHeader serial = header;
+    while (!CheckProofOfWork(serial.GetPoWHash(), serial.nBits, consensusParams))
+        ++serial.nNonce;
+    CBlockHeader block = header;
+    BOOST_CHECK(FindNonce(block, 1000, 4, consensusParams));
+    BOOST_CHECK_EQUAL(block.nNonce, serial.nNonce);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,11 +9,24 @@
 #include <serialize.h>
 #include <streams.h>
 #include <net.h>
+#include <netmessagemaker.h>
 #include <netbase.h>
 #include <chainparams.h>
+#include <scheduler.h>
 #include <util.h>
+#include <utiltime.h>
 
 #include <memory>
+#include <numeric>
+#include <thread>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
 
 class CAddrManSerializationMock : public CAddrMan
 {
@@ -73,6 +86,58 @@ static CDataStream AddrmanToStream(CAddrManSerializationMock& _addrman)
     return CDataStream(vchData, SER_DISK, CLIENT_VERSION);
 }
 
+//! Records which thread processed the pings of each node, and their nonces in order
+class ShardRecordingMsgProc final : public NetEventsInterface
+{
+public:
+    CConnman* m_connman = nullptr;
+    std::atomic<uint64_t> m_messages{0};
+    CCriticalSection cs;
+    std::map<NodeId, std::set<std::thread::id>> m_threads GUARDED_BY(cs);
+    std::map<NodeId, std::vector<uint64_t>> m_nonces GUARDED_BY(cs);
+
+    bool ProcessMessages(CNode* pnode, std::atomic<bool>& interrupt) override
+    {
+        std::list<CNetMessage> msgs;
+        {
+            LOCK(pnode->cs_vProcessMsg);
+            msgs.splice(msgs.end(), pnode->vProcessMsg);
+            pnode->nProcessQueueSize = 0;
+            pnode->fPauseRecv = false;
+        }
+        for (CNetMessage& msg : msgs) {
+            uint64_t nonce;
+            msg.vRecv >> nonce;
+            m_connman->RecordMessageLatency(pnode, msg.m_msg_id, GetTimeMicros() - msg.nTime);
+            m_connman->RecordMessageProfile(pnode, msg.m_msg_id, CMessageHeader::HEADER_SIZE + sizeof(nonce), GetTimeMicros() - msg.nTime, 0, 0);
+            LOCK(cs);
+            m_threads[pnode->GetId()].insert(std::this_thread::get_id());
+            m_nonces[pnode->GetId()].push_back(nonce);
+        }
+        m_messages += msgs.size();
+        return false;
+    }
+    bool SendMessages(CNode* pnode) override { return false; }
+    void InitializeNode(CNode* pnode) override {}
+    void FinalizeNode(NodeId id, bool& update_connection_time) override {}
+};
+
+//! A free port on the loopback interface to listen on
+static CService GetFreeLoopbackPort()
+{
+    CService addr = LookupNumeric("127.0.0.1", 0);
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(addr.GetSockAddr((struct sockaddr*)&sockaddr, &len));
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(s != INVALID_SOCKET);
+    BOOST_REQUIRE_EQUAL(bind(s, (struct sockaddr*)&sockaddr, len), 0);
+    BOOST_REQUIRE_EQUAL(getsockname(s, (struct sockaddr*)&sockaddr, &len), 0);
+    BOOST_REQUIRE(addr.SetSockAddr((struct sockaddr*)&sockaddr));
+    CloseSocket(s);
+    return addr;
+}
+
 BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
 
 BOOST_AUTO_TEST_CASE(cnode_listen_port)
@@ -227,4 +292,320 @@ BOOST_AUTO_TEST_CASE(ipv4_peer_with_ipv6_addrMe_test)
     BOOST_CHECK(1);
 }
 
+BOOST_AUTO_TEST_CASE(push_raw_message)
+{
+    CConnman connman(0x1337, 0x1337);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress{}, std::string{}, false);
+    const CNetMsgMaker msg_maker(PROTOCOL_VERSION);
+    const std::vector<uint8_t> payload{1, 2, 3, 4, 5};
+    const SharedBytes shared_payload{std::vector<uint8_t>(payload)};
+    {
+        // Keep the queue from being sent right away.
+        LOCK(node.cs_vSend);
+        node.vSendMsg.emplace_back();
+    }
+    connman.PushMessage(&node, msg_maker.Make(NetMsgType::BLOCK, MakeSpan(payload)));
+    connman.PushMessage(&node, msg_maker.MakeRaw(NetMsgType::BLOCK, shared_payload));
+
+    // Both are accounted to their type alone
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapSendBytesPerMsgCmd.size(), 1U);
+    BOOST_CHECK_EQUAL(stats.mapSendBytesPerMsgCmd[NetMsgType::BLOCK], 2 * (CMessageHeader::HEADER_SIZE + payload.size()));
+
+    LOCK(node.cs_vSend);
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 5U);
+    BOOST_CHECK_EQUAL(node.nSendSize, 2 * (CMessageHeader::HEADER_SIZE + payload.size()));
+    // The same header and payload are queued either way...
+    for (int i = 1; i <= 2; i++) {
+        const SendBuffer& header = node.vSendMsg[i];
+        const SendBuffer& raw_header = node.vSendMsg[i + 2];
+        BOOST_CHECK(header.size() == raw_header.size() && std::equal(header.data(), header.data() + header.size(), raw_header.data()));
+    }
+    // ...but the raw payload is not copied.
+    BOOST_CHECK(node.vSendMsg[4].data() == shared_payload.data());
+}
+
+BOOST_AUTO_TEST_CASE(net_msg_id)
+{
+    const std::vector<std::string>& types = getAllNetMessageTypes();
+    BOOST_REQUIRE_EQUAL(types.size(), NUM_NET_MSG_IDS);
+    for (size_t i = 0; i < types.size(); i++) {
+        CMessageHeader hdr(Params().MessageStart(), types[i].c_str(), 0);
+        BOOST_CHECK(GetNetMsgId(hdr.pchCommand) == static_cast<NetMsgId>(i));
+    }
+    for (const char* command : {"", "versio", "versionx", "Version", "getblocktxns"}) {
+        CMessageHeader hdr(Params().MessageStart(), command, 0);
+        BOOST_CHECK(GetNetMsgId(hdr.pchCommand) == NetMsgId::UNKNOWN);
+    }
+    // Not padded with zeros
+    const char command[CMessageHeader::COMMAND_SIZE] = {'t', 'x', 0, 'x'};
+    BOOST_CHECK(GetNetMsgId(command) == NetMsgId::UNKNOWN);
+
+    // Received messages are decoded once their header is complete.
+    CDataStream header(SER_NETWORK, PROTOCOL_VERSION);
+    header << CMessageHeader(Params().MessageStart(), NetMsgType::PING, 8);
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(msg.readHeader(header.data(), header.size() - 1), (int)header.size() - 1);
+    BOOST_CHECK(msg.m_msg_id == NetMsgId::UNKNOWN);
+    BOOST_CHECK_EQUAL(msg.readHeader(header.data() + header.size() - 1, 1), 1);
+    BOOST_CHECK(msg.m_msg_id == NetMsgId::PING);
+}
+
+BOOST_AUTO_TEST_CASE(net_message_pool)
+{
+    NetMessagePool pool(/* max_messages */ 2, /* max_bytes_per_class */ 1024);
+    // Receive a message with a payload of size bytes into msgs
+    auto receive = [&](std::list<CNetMessage>& msgs, unsigned int size) {
+        CDataStream header(SER_NETWORK, PROTOCOL_VERSION);
+        header << CMessageHeader(Params().MessageStart(), NetMsgType::TX, size);
+        const std::vector<char> payload(size, (char)size);
+        pool.NewMessage(msgs, Params().MessageStart());
+        CNetMessage& msg = msgs.back();
+        BOOST_CHECK_EQUAL(msg.readHeader(header.data(), header.size()), (int)header.size());
+        pool.ReserveData(msg);
+        if (size > 0) {
+            BOOST_CHECK_EQUAL(msg.readData(payload.data(), size), (int)size);
+        }
+        BOOST_REQUIRE(msg.complete());
+        BOOST_CHECK(msg.m_msg_id == NetMsgId::TX);
+        BOOST_CHECK(msg.vRecv.str() == std::string(payload.begin(), payload.end()));
+        BOOST_CHECK(msg.GetMessageHash() == Hash(payload.begin(), payload.end()));
+    };
+
+    std::list<CNetMessage> msgs;
+    receive(msgs, 100);
+    receive(msgs, 300);
+    receive(msgs, 1000);
+    // Buffers are sized to the power of two class of the message
+    BOOST_CHECK_EQUAL(msgs.front().vRecv.capacity(), 256U);
+    BOOST_CHECK_EQUAL(msgs.back().vRecv.capacity(), 1024U);
+    NetMessagePool::Stats stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.messages_allocated, 3U);
+    BOOST_CHECK_EQUAL(stats.buffers_allocated, 3U);
+
+    pool.Release(msgs);
+    BOOST_CHECK(msgs.empty());
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.messages_pooled, 2U);
+    BOOST_CHECK_EQUAL(stats.bytes_pooled, 256U + 512U + 1024U);
+
+    // Received messages are taken from the pool, and reset to receive into
+    receive(msgs, 200);
+    receive(msgs, 1000);
+    receive(msgs, 1000);
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.messages_allocated, 4U);
+    BOOST_CHECK_EQUAL(stats.messages_reused, 2U);
+    BOOST_CHECK_EQUAL(stats.buffers_allocated, 4U);
+    BOOST_CHECK_EQUAL(stats.buffers_reused, 2U);
+    BOOST_CHECK_EQUAL(stats.bytes_pooled, 512U);
+
+    // Only one buffer of the 1024 byte class fits in the limit.
+    pool.Release(msgs);
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.messages_pooled, 2U);
+    BOOST_CHECK_EQUAL(stats.bytes_pooled, 256U + 512U + 1024U);
+
+    // Messages without a payload, or too large to pool the buffer of, take none.
+    receive(msgs, 0);
+    receive(msgs, (1 << NetMessagePool::MAX_BUFFER_SIZE_LOG2) + 1);
+    pool.Release(msgs);
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.buffers_allocated, 4U);
+    BOOST_CHECK_EQUAL(stats.buffers_reused, 2U);
+    BOOST_CHECK_EQUAL(stats.bytes_pooled, 256U + 512U + 1024U);
+
+    // A buffer is pooled by its whole capacity, however much of it was read.
+    receive(msgs, 1000);
+    receive(msgs, 300);
+    char discard[600];
+    msgs.front().vRecv.read(discard, sizeof(discard));
+    msgs.back().vRecv.read(discard, 300);
+    BOOST_CHECK(msgs.back().vRecv.empty());
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.buffers_reused, 4U);
+    BOOST_CHECK_EQUAL(stats.bytes_pooled, 256U);
+    pool.Release(msgs);
+    stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.bytes_pooled, 256U + 512U + 1024U);
+}
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    LatencyHistogram latency;
+    BOOST_CHECK_EQUAL(latency.Count(), 0U);
+    BOOST_CHECK_EQUAL(latency.Percentile(0.5), 0);
+
+    // Small latencies get a bucket each.
+    for (int64_t micros = 0; micros < 5; micros++) {
+        latency.Add(micros);
+    }
+    BOOST_CHECK_EQUAL(latency.Percentile(0.2), 0);
+    BOOST_CHECK_EQUAL(latency.Percentile(0.6), 2);
+    BOOST_CHECK_EQUAL(latency.Percentile(1), 4);
+
+    latency = LatencyHistogram();
+    for (int64_t micros = 1; micros <= 100000; micros++) {
+        latency.Add(micros);
+    }
+    BOOST_CHECK_EQUAL(latency.Count(), 100000U);
+    BOOST_CHECK_EQUAL(latency.Max(), 100000);
+    for (double q : {0.01, 0.5, 0.9, 0.99}) {
+        // Never below the actual percentile, and at most a bucket above it.
+        const int64_t estimate = latency.Percentile(q);
+        BOOST_CHECK_GE(estimate, q * 100000);
+        BOOST_CHECK_LE(estimate, q * 100000 * 1.25);
+    }
+    BOOST_CHECK_EQUAL(latency.Percentile(1), 100000);
+
+    // Latencies beyond the last bucket are still counted.
+    latency.Add(std::numeric_limits<int64_t>::max());
+    BOOST_CHECK_EQUAL(latency.Percentile(1), std::numeric_limits<int64_t>::max());
+}
+
+BOOST_AUTO_TEST_CASE(message_profile)
+{
+    CConnman connman(0x1337, 0x1337);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress{}, std::string{}, false);
+    connman.RecordMessageProfile(&node, NetMsgId::PING, 32, 100, 20, 0);
+    connman.RecordMessageProfile(&node, NetMsgId::PING, 32, 300, 40, 10);
+    connman.RecordMessageProfile(&node, NetMsgId::UNKNOWN, 24, 0, 5, 0);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    for (const mapMsgCmdProfile& profiles : {stats.mapMsgProfile, connman.GetMessageProfile()}) {
+        BOOST_REQUIRE_EQUAL(profiles.size(), 2U);
+        const CMessageProfile& ping = profiles.at(NetMsgType::PING);
+        BOOST_CHECK_EQUAL(ping.nBytes, 64U);
+        BOOST_CHECK_EQUAL(ping.processing.Count(), 2U);
+        BOOST_CHECK_EQUAL(ping.queue_wait.Sum(), 400);
+        BOOST_CHECK_EQUAL(ping.processing.Max(), 40);
+        BOOST_CHECK_EQUAL(ping.cs_main_held.Sum(), 10);
+        BOOST_CHECK_EQUAL(ping.latency.Sum(), 460);
+        BOOST_CHECK_EQUAL(ping.latency.Max(), 340);
+        BOOST_CHECK_EQUAL(profiles.at("*other*").nBytes, 24U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(msg_handler_shards)
+{
+    // Peers connected over the loopback interface, sending pings to a
+    // CConnman with several message handler threads, all at once.
+    const int NUM_THREADS = 4;
+    const int NUM_PEERS = 8;
+    const int NUM_PINGS = 50;
+    SetDataDir("msg_handler_shards");
+    gArgs.ForceSetArg("-dnsseed", "0");
+    const CService addr = GetFreeLoopbackPort();
+    ShardRecordingMsgProc msgproc;
+    CScheduler scheduler;
+    CConnman connman(0x1337, 0x1337);
+    msgproc.m_connman = &connman;
+    CConnman::Options options;
+    options.nMaxConnections = NUM_PEERS + MAX_OUTBOUND_CONNECTIONS + 1;
+    options.nMaxOutbound = MAX_OUTBOUND_CONNECTIONS;
+    options.nMaxAddnode = MAX_ADDNODE_CONNECTIONS;
+    options.m_msgproc = &msgproc;
+    options.nSendBufferMaxSize = 1000 * DEFAULT_MAXSENDBUFFER;
+    options.nReceiveFloodSize = 1000 * DEFAULT_MAXRECEIVEBUFFER;
+    options.vBinds.push_back(addr);
+    options.m_use_addrman_outgoing = false;
+    options.m_msg_handler_threads = NUM_THREADS;
+    BOOST_REQUIRE(connman.Start(scheduler, options));
+
+    std::vector<SOCKET> peers;
+    for (int i = 0; i < NUM_PEERS; i++) {
+        SOCKET s = CreateSocket(addr);
+        BOOST_REQUIRE(ConnectSocketDirectly(addr, s, 5000, false));
+        peers.push_back(s);
+    }
+    // Boost.Test assertions are not thread safe, so the senders only count failures
+    std::atomic<int> send_failures{0};
+    std::vector<std::thread> senders;
+    for (SOCKET s : peers) {
+        senders.emplace_back([s, &send_failures] {
+            for (uint64_t nonce = 0; nonce < NUM_PINGS; nonce++) {
+                CSerializedNetMsg ping = CNetMsgMaker(INIT_PROTO_VERSION).Make(NetMsgType::PING, nonce);
+                CMessageHeader hdr(Params().MessageStart(), ping.command.c_str(), ping.data.size());
+                uint256 hash = Hash(ping.data.begin(), ping.data.end());
+                memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+                std::vector<unsigned char> msg;
+                CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, msg, 0, hdr};
+                msg.insert(msg.end(), ping.data.begin(), ping.data.end());
+                if (send(s, (const char*)msg.data(), msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size()) send_failures++;
+            }
+        });
+    }
+    for (std::thread& sender : senders) {
+        sender.join();
+    }
+    BOOST_CHECK_EQUAL(send_failures, 0);
+    for (int i = 0; i < 10000 && msgproc.m_messages < NUM_PEERS * NUM_PINGS; i++) {
+        MilliSleep(1);
+    }
+    BOOST_CHECK_EQUAL(msgproc.m_messages, NUM_PEERS * NUM_PINGS);
+
+    {
+        LOCK(msgproc.cs);
+        // Each node's messages are processed in order by the one thread it
+        // is pinned to, and the nodes are spread over all threads.
+        BOOST_CHECK_EQUAL(msgproc.m_nonces.size(), NUM_PEERS);
+        std::set<std::thread::id> threads;
+        for (const auto& entry : msgproc.m_nonces) {
+            std::vector<uint64_t> expected(NUM_PINGS);
+            std::iota(expected.begin(), expected.end(), 0);
+            BOOST_CHECK(entry.second == expected);
+            BOOST_CHECK_EQUAL(msgproc.m_threads[entry.first].size(), 1U);
+            threads.insert(msgproc.m_threads[entry.first].begin(), msgproc.m_threads[entry.first].end());
+        }
+        BOOST_CHECK_EQUAL(threads.size(), NUM_THREADS);
+    }
+    // The latencies and profiles recorded by each thread add up
+    BOOST_CHECK_EQUAL(connman.GetMessageLatencies().at(NetMsgType::PING).Count(), NUM_PEERS * NUM_PINGS);
+    const CMessageProfile ping = connman.GetMessageProfile().at(NetMsgType::PING);
+    BOOST_CHECK_EQUAL(ping.latency.Count(), NUM_PEERS * NUM_PINGS);
+    BOOST_CHECK_EQUAL(ping.nBytes, NUM_PEERS * NUM_PINGS * (CMessageHeader::HEADER_SIZE + sizeof(uint64_t)));
+
+    for (SOCKET& s : peers) {
+        CloseSocket(s);
+    }
+    connman.Interrupt();
+    connman.Stop();
+    gArgs.ForceSetArg("-dnsseed", "");
+}
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(epoll_disconnect)
+{
+    // The socket of a node registered with epoll, with a copy left open as
+    // in a child process started by system().
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    BOOST_REQUIRE(epoll_fd != -1);
+    CNode node(0, NODE_NETWORK, 0, fds[0], CAddress(), 0, 0, CAddress(), "", true);
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &node;
+    BOOST_REQUIRE_EQUAL(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, node.hSocket, &event), 0);
+    {
+        LOCK(node.cs_hSocket);
+        node.m_epoll_fd = epoll_fd;
+    }
+    const int inherited_fd = dup(fds[0]);
+    BOOST_REQUIRE(inherited_fd != -1);
+
+    // Once disconnected, data arriving on the copy raises no event for the node.
+    node.CloseSocketDisconnect();
+    BOOST_CHECK(node.hSocket == INVALID_SOCKET);
+    BOOST_REQUIRE_EQUAL(send(fds[1], "x", 1, MSG_NOSIGNAL), 1);
+    BOOST_CHECK_EQUAL(epoll_wait(epoll_fd, &event, 1, 0), 0);
+
+    close(inherited_fd);
+    close(fds[1]);
+    close(epoll_fd);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,68 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <powcache.h>
+#include <primitives/block.h>
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(powcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(lru_eviction)
+{
+    CPoWHashCache cache;
+    const uint256 a = InsecureRand256(), b = InsecureRand256(), c = InsecureRand256();
+    const uint256 pa = InsecureRand256(), pb = InsecureRand256(), pc = InsecureRand256();
+    uint256 out;
+
+    // Disabled until sized
+    cache.Insert(a, pa);
+    BOOST_CHECK(!cache.Get(a, out));
+
+    cache.Resize(2);
+    cache.Insert(a, pa);
+    cache.Insert(b, pb);
+    BOOST_CHECK(cache.Get(a, out));
+    BOOST_CHECK(out == pa);
+    // b is now the least recently used entry
+    cache.Insert(c, pc);
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    BOOST_CHECK(!cache.Get(b, out));
+    BOOST_CHECK(cache.Get(a, out));
+    BOOST_CHECK(cache.Get(c, out));
+    BOOST_CHECK(out == pc);
+    BOOST_CHECK_EQUAL(cache.Hits(), 3U);
+    BOOST_CHECK_EQUAL(cache.Misses(), 2U);
+
+    // c was used last, so shrinking keeps it
+    cache.Resize(1);
+    BOOST_CHECK(cache.Get(c, out));
+    BOOST_CHECK(!cache.Get(a, out));
+}
+
+BOOST_AUTO_TEST_CASE(cached_pow_hash)
+{
+    CBlockHeader header;
+    header.nVersion = 2;
+    header.hashPrevBlock = InsecureRand256();
+    header.hashMerkleRoot = InsecureRand256();
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = InsecureRand32();
+
+    const uint64_t hits = g_pow_hash_cache.Hits();
+    const uint64_t misses = g_pow_hash_cache.Misses();
+    BOOST_CHECK(GetPoWHashCached(header) == header.GetPoWHash());
+    BOOST_CHECK(GetPoWHashCached(header) == header.GetPoWHash());
+    BOOST_CHECK_EQUAL(g_pow_hash_cache.Misses(), misses + 1);
+    BOOST_CHECK_EQUAL(g_pow_hash_cache.Hits(), hits + 1);
+
+    // A different nonce is a different header
+    header.nNonce++;
+    BOOST_CHECK(GetPoWHashCached(header) == header.GetPoWHash());
+    BOOST_CHECK_EQUAL(g_pow_hash_cache.Misses(), misses + 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <primitives/block.h>
+#include <recentblocks.h>
+#include <streams.h>
+#include <test/test_bitcoin.h>
+#include <version.h>
+
+#include <limits>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(recentblocks_tests, BasicTestingSetup)
+
+static std::shared_ptr<const CBlock> MakeBlock(bool witness)
+{
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << InsecureRand32();
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50;
+    if (witness) {
+        coinbase.vin[0].scriptWitness.stack.push_back(std::vector<unsigned char>(32, 0));
+    }
+    auto block = std::make_shared<CBlock>();
+    block->hashPrevBlock = InsecureRand256();
+    block->vtx.push_back(MakeTransactionRef(std::move(coinbase)));
+    return block;
+}
+
+static bool Equals(const SharedBytes& bytes, const CDataStream& stream)
+{
+    return bytes.size() == stream.size() && std::equal(bytes.data(), bytes.data() + bytes.size(), (const uint8_t*)stream.data());
+}
+
+BOOST_AUTO_TEST_CASE(block_serializations)
+{
+    const std::shared_ptr<const CBlock> witness_block = MakeBlock(true);
+    const CRecentBlock entry(witness_block);
+    BOOST_CHECK(entry.hash == witness_block->GetHash());
+    CDataStream with_witness(SER_NETWORK, PROTOCOL_VERSION);
+    with_witness << *witness_block;
+    CDataStream without_witness(SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS);
+    without_witness << *witness_block;
+    BOOST_CHECK(Equals(entry.Data(true), with_witness));
+    BOOST_CHECK(Equals(entry.Data(false), without_witness));
+    BOOST_CHECK(with_witness.size() > without_witness.size());
+    // Made once, then kept
+    BOOST_CHECK(entry.Data(true).data() == entry.Data(true).data());
+    BOOST_CHECK(entry.DynamicMemoryUsage() >= 2 * with_witness.size());
+
+    // Both serializations are the same without witness data, and shared,
+    // whichever is asked for first.
+    const CRecentBlock plain_entry(MakeBlock(false));
+    BOOST_CHECK(plain_entry.Data(false).data() == plain_entry.Data(true).data());
+    BOOST_CHECK_EQUAL(plain_entry.Data(true).size(), plain_entry.Data(false).size());
+}
+
+BOOST_AUTO_TEST_CASE(lru_eviction)
+{
+    CRecentBlockCache cache;
+    const auto a = std::make_shared<const CRecentBlock>(MakeBlock(false));
+    const auto b = std::make_shared<const CRecentBlock>(MakeBlock(false));
+    const auto c = std::make_shared<const CRecentBlock>(MakeBlock(true));
+
+    // Disabled until sized
+    cache.Insert(a);
+    BOOST_CHECK(!cache.Get(a->hash));
+
+    cache.Resize(2, std::numeric_limits<size_t>::max());
+    cache.Insert(a);
+    cache.Insert(b);
+    BOOST_CHECK(cache.Get(a->hash) == a);
+    // b is now the least recently used entry
+    cache.Insert(c);
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    BOOST_CHECK(!cache.Get(b->hash));
+    BOOST_CHECK(cache.Get(a->hash) == a);
+    BOOST_CHECK(cache.Get(c->hash) == c);
+    BOOST_CHECK_EQUAL(cache.Hits(), 3U);
+    BOOST_CHECK_EQUAL(cache.Misses(), 2U);
+
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), a->DynamicMemoryUsage() + c->DynamicMemoryUsage());
+
+    // c was used last, so shrinking keeps it
+    cache.Resize(1, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(cache.Get(c->hash) == c);
+    BOOST_CHECK(!cache.Get(a->hash));
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), c->DynamicMemoryUsage());
+}
+
+BOOST_AUTO_TEST_CASE(memory_bound)
+{
+    CRecentBlockCache cache;
+    const auto a = std::make_shared<const CRecentBlock>(MakeBlock(false));
+    const auto b = std::make_shared<const CRecentBlock>(MakeBlock(false));
+    const auto c = std::make_shared<const CRecentBlock>(MakeBlock(false));
+    const size_t limit = std::max(a->DynamicMemoryUsage(), c->DynamicMemoryUsage()) + b->DynamicMemoryUsage();
+    cache.Resize(10, limit);
+    cache.Insert(a);
+    cache.Insert(b);
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    // Going over the memory limit evicts the least recently used block
+    cache.Insert(c);
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    BOOST_CHECK(!cache.Get(a->hash));
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), b->DynamicMemoryUsage() + c->DynamicMemoryUsage());
+
+    // A block larger than the limit is not kept at all.
+    cache.Resize(10, a->DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+    cache.Insert(a);
+    BOOST_CHECK(!cache.Get(a->hash));
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <chain.h>
 #include <serialize.h>
 #include <streams.h>
 #include <hash.h>
@@ -370,4 +371,48 @@ BOOST_AUTO_TEST_CASE(class_methods)
     BOOST_CHECK(methodtest3 == methodtest4);
 }
 
+BOOST_AUTO_TEST_CASE(disk_block_index_pow_hash)
+{
+    CBlockIndex index;
+    index.nHeight = 1;
+    index.nBits = 0x1e0ffff0;
+    CDiskBlockIndex diskindex(&index);
+
+    // Entries without a PoW hash serialize exactly as older versions wrote them
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << diskindex;
+    const size_t legacy_size = ss.size();
+    CDiskBlockIndex legacy;
+    ss >> legacy;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(legacy.hashPoW.IsNull());
+    BOOST_CHECK_EQUAL(legacy.nBits, index.nBits);
+
+    diskindex.hashPoW = uint256S("00000000000000000000000000000000000000000000000000000000deadbeef");
+    ss << diskindex;
+    // The flag lengthens the version by two bytes
+    BOOST_CHECK_EQUAL(ss.size(), legacy_size + 2 + 1 + 32);
+    CDiskBlockIndex read;
+    ss >> read;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(read.hashPoW == diskindex.hashPoW);
+
+    // Trailing bytes without DISK_BLOCK_INDEX_EXT_FLAG in the version are not read
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << legacy;
+    ss2 << VARINT(DISK_BLOCK_INDEX_EXT_VERSION, VarIntMode::NONNEGATIVE_SIGNED) << diskindex.hashPoW;
+    CDiskBlockIndex unflagged;
+    ss2 >> unflagged;
+    BOOST_CHECK(unflagged.hashPoW.IsNull());
+
+    // A later extension version still yields the hash
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    ss3 << diskindex;
+    ss3.resize(ss3.size() - 1 - 32);
+    ss3 << VARINT(DISK_BLOCK_INDEX_EXT_VERSION + 1, VarIntMode::NONNEGATIVE_SIGNED) << diskindex.hashPoW << uint8_t{0};
+    CDiskBlockIndex future;
+    ss3 >> future;
+    BOOST_CHECK(future.hashPoW == diskindex.hashPoW);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <mappedfile.h>
 #include <streams.h>
 #include <support/allocators/zeroafterfree.h>
 #include <test/test_bitcoin.h>
@@ -68,6 +69,84 @@ BOOST_AUTO_TEST_CASE(streams_vector_writer)
     vch.clear();
 }
 
+BOOST_AUTO_TEST_CASE(streams_span_reader)
+{
+    const std::vector<unsigned char> vch = {1, 255, 3, 4, 5, 6};
+
+    SpanReader reader(SER_NETWORK, INIT_PROTO_VERSION, MakeSpan(vch));
+    BOOST_CHECK_EQUAL(reader.size(), 6U);
+    BOOST_CHECK(!reader.empty());
+
+    // Read a single byte as an unsigned char.
+    unsigned char a;
+    reader >> a;
+    BOOST_CHECK_EQUAL(a, 1);
+    BOOST_CHECK_EQUAL(reader.size(), 5U);
+    BOOST_CHECK(!reader.empty());
+
+    // Read a single byte as a signed char.
+    signed char b;
+    reader >> b;
+    BOOST_CHECK_EQUAL(b, -1);
+    BOOST_CHECK_EQUAL(reader.size(), 4U);
+    BOOST_CHECK(!reader.empty());
+
+    // Read a 4 bytes as an unsigned int.
+    unsigned int c;
+    reader >> c;
+    BOOST_CHECK_EQUAL(c, 100992003U); // 3,4,5,6 in little-endian base-256
+    BOOST_CHECK_EQUAL(reader.size(), 0U);
+    BOOST_CHECK(reader.empty());
+
+    // Reading after end of span should cause an error.
+    signed int d;
+    BOOST_CHECK_THROW(reader >> d, std::ios_base::failure);
+
+    // Read a 4 bytes as a signed int from the beginning of the buffer.
+    SpanReader new_reader(SER_NETWORK, INIT_PROTO_VERSION, MakeSpan(vch));
+    new_reader >> d;
+    BOOST_CHECK_EQUAL(d, 67370753); // 1,255,3,4 in little-endian base-256
+    BOOST_CHECK_EQUAL(new_reader.size(), 2U);
+    BOOST_CHECK(!new_reader.empty());
+
+    // Reading after end of span should cause an error, and consume nothing.
+    BOOST_CHECK_THROW(new_reader >> d, std::ios_base::failure);
+    BOOST_CHECK_EQUAL(new_reader.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(streams_mapped_file)
+{
+    const fs::path path = SetDataDir("streams_mapped_file") / "file";
+    BOOST_CHECK(!MappedFile::Open(path));
+
+    std::vector<unsigned char> vch(10000);
+    for (size_t i = 0; i < vch.size(); i++) {
+        vch[i] = InsecureRandBits(8);
+    }
+    {
+        CAutoFile fileout(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        fileout.write((const char*)vch.data(), vch.size());
+    }
+
+    std::shared_ptr<const MappedFile> file = MappedFile::Open(path);
+#ifdef WIN32
+    BOOST_CHECK(!file);
+#else
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(file->size(), vch.size());
+    BOOST_CHECK(file->data() == MakeSpan(static_cast<const std::vector<unsigned char>&>(vch)));
+
+    // The bytes outlive the reference to the file they are in.
+    const Span<const unsigned char> span = file->data().subspan(100, 50);
+    SharedBytes bytes(std::move(file), span);
+    BOOST_CHECK(!file);
+    BOOST_CHECK(bytes.span() == Span<const unsigned char>(vch.data() + 100, 50));
+#endif
+
+    SharedBytes copied{std::vector<unsigned char>(vch)};
+    BOOST_CHECK(copied.span() == MakeSpan(static_cast<const std::vector<unsigned char>&>(vch)));
+}
+
 BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
 {
     std::vector<char> in;
@@ -12,6 +12,7 @@
 #include <miner.h>
 #include <net_processing.h>
 #include <pow.h>
+#include <powcache.h>
 #include <ui_interface.h>
 #include <streams.h>
 #include <rpc/server.h>
@@ -54,6 +55,7 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
     SetupEnvironment();
     SetupNetworking();
     InitSignatureCache();
+    InitPoWHashCache();
     InitScriptExecutionCache();
     fCheckBlockIndex = true;
     SelectParams(chainName);
@@ -103,8 +105,10 @@ TestingSetup::TestingSetup(const std::string& chainName) : BasicTestingSetup(cha
             }
         }
         nScriptCheckThreads = 3;
-        for (int i=0; i < nScriptCheckThreads-1; i++)
+        for (int i=0; i < nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadPoWCheck);
+        }
         g_connman = std::unique_ptr<CConnman>(new CConnman(0x1337, 0x1337)); // Deterministic randomness for tests.
         connman = g_connman.get();
         peerLogic.reset(new PeerLogicValidation(connman, scheduler, /*enable_bip61=*/true));
@@ -43,6 +43,31 @@ BOOST_AUTO_TEST_CASE(util_criticalsection)
     } while(0);
 }
 
+#ifdef HAVE_THREAD_LOCAL
+BOOST_AUTO_TEST_CASE(util_lockholdtimer)
+{
+    CCriticalSection cs, other;
+    LockHoldTimer timer(cs);
+    {
+        LOCK(other);
+        MilliSleep(5);
+    }
+    BOOST_CHECK_EQUAL(timer.Elapsed(), 0);
+    {
+        LOCK(cs);
+        {
+            TRY_LOCK(cs, locked);
+            BOOST_CHECK(bool(locked));
+        }
+        MilliSleep(5);
+    }
+    const int64_t held = timer.Elapsed();
+    BOOST_CHECK_GE(held, 5000);
+    MilliSleep(5);
+    BOOST_CHECK_EQUAL(timer.Elapsed(), held);
+}
+#endif
+
 static const unsigned char ParseHex_expected[65] = {
     0x04, 0x67, 0x8a, 0xfd, 0xb0, 0xfe, 0x55, 0x48, 0x27, 0x19, 0x67, 0xf1, 0xa6, 0x71, 0x30, 0xb7,
     0x10, 0x5c, 0xd6, 0xa8, 0x28, 0xe0, 0x39, 0x09, 0xa6, 0x79, 0x62, 0xe0, 0xea, 0x1f, 0x61, 0xde,
@@ -81,6 +81,15 @@ std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    return WriteCoins(mapCoins, hashBlock, true);
+}
+
+bool CCoinsViewDB::BatchWriteShared(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    // Nothing in mapCoins is modified without fErase.
+    return WriteCoins(const_cast<CCoinsMap&>(mapCoins), hashBlock, false);
+}
+
+bool CCoinsViewDB::WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
@@ -115,8 +124,12 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase) {
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        } else {
+            ++it;
+        }
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
             db.WriteBatch(batch);
@@ -146,6 +159,131 @@ size_t CCoinsViewDB::EstimateSize() const
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsViewDB& dbIn) : CCoinsViewBacked(&dbIn), db(dbIn)
+{
+    threadWrite = std::thread(&CCoinsViewWriteBehind::ThreadWrite, this);
+}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind()
+{
+    {
+        WaitableLock lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    // A write in progress is finished first.
+    threadWrite.join();
+}
+
+void CCoinsViewWriteBehind::ThreadWrite()
+{
+    RenameThread("stredle-coinsdb");
+    WaitableLock lock(cs);
+    while (true) {
+        cond.wait(lock, [this] { return fStop || fWriting; });
+        if (!fWriting)
+            return;
+        lock.unlock();
+        const int64_t nStart = GetTimeMillis();
+        bool fOk = false;
+        try {
+            fOk = db.BatchWriteShared(mapPending, hashPending);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint(BCLog::COINDB, "Background write of %u coins to coin database took %dms\n", mapPending.size(), GetTimeMillis() - nStart);
+        CCoinsMap mapWritten;
+        lock.lock();
+        if (fOk) {
+            mapPending.swap(mapWritten);
+            hashPending.SetNull();
+            nPendingUsage = 0;
+        } else {
+            fFailed = true;
+        }
+        fWriting = false;
+        cond.notify_all();
+        // Free the written entries without holding up readers.
+        lock.unlock();
+        mapWritten.clear();
+        lock.lock();
+    }
+}
+
+bool CCoinsViewWriteBehind::GetCoin(const COutPoint &outpoint, Coin &coin) const
+{
+    {
+        WaitableLock lock(cs);
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    // Only coins in mapPending are being written, so the database is current for this one.
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewWriteBehind::HaveCoin(const COutPoint &outpoint) const
+{
+    Coin coin;
+    return GetCoin(outpoint, coin);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const
+{
+    {
+        WaitableLock lock(cs);
+        if (!hashPending.IsNull())
+            return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    WaitableLock lock(cs);
+    cond.wait(lock, [this] { return !fWriting; });
+    if (fFailed)
+        return false;
+    nWriteCount++;
+    assert(mapPending.empty());
+    mapPending.swap(mapCoins);
+    hashPending = hashBlock;
+    nPendingUsage = memusage::DynamicUsage(mapPending);
+    for (const auto& entry : mapPending) {
+        nPendingUsage += entry.second.coin.DynamicMemoryUsage();
+    }
+    fWriting = true;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewWriteBehind::Sync()
+{
+    WaitableLock lock(cs);
+    cond.wait(lock, [this] { return !fWriting; });
+    return !fFailed;
+}
+
+bool CCoinsViewWriteBehind::IsWriting() const
+{
+    WaitableLock lock(cs);
+    return fWriting;
+}
+
+bool CCoinsViewWriteBehind::Failed() const
+{
+    WaitableLock lock(cs);
+    return fFailed;
+}
+
+size_t CCoinsViewWriteBehind::DynamicMemoryUsage() const
+{
+    WaitableLock lock(cs);
+    return nPendingUsage;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(gArgs.IsArgSet("-blocksdir") ? GetDataDir() / "blocks" / "index" : GetBlocksDir() / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -176,14 +314,47 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
        that restriction.  */
     i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    if (i->pcursor->Valid()) {
-        CoinEntry entry(&i->keyTmp.second);
-        i->pcursor->GetKey(entry);
-        i->keyTmp.first = entry.key;
+    i->ReadKey();
+    return i;
+}
+
+std::vector<std::unique_ptr<CCoinsViewCursor>> CCoinsViewDB::Cursors(int nRanges) const
+{
+    assert(nRanges >= 1 && nRanges <= 256);
+    std::shared_ptr<const leveldb::Snapshot> snapshot = db.GetSnapshot();
+    CDBWrapper& dbw = const_cast<CDBWrapper&>(db);
+
+    // The best block has to come from the snapshot too.
+    uint256 hashBestChain;
+    {
+        std::unique_ptr<CDBIterator> pcursor(dbw.NewIterator(snapshot));
+        pcursor->Seek(DB_BEST_BLOCK);
+        char key;
+        if (!pcursor->Valid() || !pcursor->GetKey(key) || key != DB_BEST_BLOCK || !pcursor->GetValue(hashBestChain)) {
+            hashBestChain.SetNull();
+        }
+    }
+
+    std::vector<std::unique_ptr<CCoinsViewCursor>> cursors;
+    for (int i = 0; i < nRanges; i++) {
+        CCoinsViewDBCursor *c = new CCoinsViewDBCursor(dbw.NewIterator(snapshot), hashBestChain, 256 * (i + 1) / nRanges);
+        cursors.emplace_back(c);
+        COutPoint start(uint256(), 0);
+        *start.hash.begin() = 256 * i / nRanges;
+        c->pcursor->Seek(CoinEntry(&start));
+        c->ReadKey();
+    }
+    return cursors;
+}
+
+void CCoinsViewDBCursor::ReadKey()
+{
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry) || *keyTmp.second.hash.begin() >= nEnd) {
+        keyTmp.first = 0; // Make sure Valid() and GetKey() return false
     } else {
-        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+        keyTmp.first = entry.key;
     }
-    return i;
 }
 
 bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
@@ -214,12 +385,8 @@ bool CCoinsViewDBCursor::Valid() const
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    CoinEntry entry(&keyTmp.second);
-    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
-    } else {
-        keyTmp.first = entry.key;
-    }
+    // Invalidate cached key after last record so that Valid() and GetKey() return false
+    ReadKey();
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -246,7 +413,7 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex, bool fCheckPoW)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
 
@@ -273,15 +440,14 @@ bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams,
                 pindexNew->nNonce         = diskindex.nNonce;
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
-
-                // Stredle: Disable PoW Sanity check while loading block index from disk.
-                // We use the sha256 hash for the block index for performance reasons, which is recorded for later use.
-                // CheckProofOfWork() uses the scrypt hash which is discarded after a block is accepted.
-                // While it is technically feasible to verify the PoW, doing so takes several minutes as it
-                // requires recomputing every PoW hash during every Stredle startup.
-                // We opt instead to simply trust the data that is on your local disk.
-                //if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, consensusParams))
-                //    return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
+                pindexNew->hashPoW        = diskindex.hashPoW;
+
+                // Stredle: The block index is keyed by the sha256 hash, while CheckProofOfWork()
+                // needs the scrypt hash. Recomputing every scrypt hash here would take several
+                // minutes on every startup, so only entries that recorded their scrypt hash are
+                // checked. Entries written by older versions are trusted; see AuditBlockIndexPoW().
+                if (fCheckPoW && !pindexNew->hashPoW.IsNull() && !CheckProofOfWork(pindexNew->hashPoW, pindexNew->nBits, consensusParams))
+                    return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
 
                 pcursor->Next();
             } else {
@@ -10,10 +10,13 @@
 #include <dbwrapper.h>
 #include <chain.h>
 #include <primitives/block.h>
+#include <sync.h>
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -45,6 +48,8 @@ class CCoinsViewDB final : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    bool WriteCoins(CCoinsMap &mapCoins, const uint256 &hashBlock, bool fErase);
 public:
     explicit CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -55,9 +60,69 @@ public:
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
     CCoinsViewCursor *Cursor() const override;
 
+    //! Cursors over nRanges (at most 256) equal ranges of txids that make up
+    //! the whole set, all reading one snapshot of the database, so that they
+    //! can be walked in parallel and still add up to a consistent state.
+    std::vector<std::unique_ptr<CCoinsViewCursor>> Cursors(int nRanges) const;
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
+
+    //! Like BatchWrite(), but leaves mapCoins as it is, so that other threads can keep reading it meanwhile
+    bool BatchWriteShared(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+};
+
+/**
+ * CCoinsView between the coins cache and the coin database that writes to
+ * the database in the background. BatchWrite() hands the flushed entries to a
+ * writer thread and returns without waiting for the write; until it is done,
+ * reads are answered from those entries first. Only the next BatchWrite(), or
+ * Sync(), waits for a write in progress.
+ *
+ * The database is written exactly as with a synchronous flush, so a crash
+ * during a background write is recovered from through DB_HEAD_BLOCKS by
+ * ReplayBlocks() as usual.
+ */
+class CCoinsViewWriteBehind final : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB& db;
+
+    mutable CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    //! Entries handed over by the last BatchWrite(), until they are written. The writer reads it without cs.
+    CCoinsMap mapPending;
+    //! Best block of mapPending, null if there is none
+    uint256 hashPending;
+    size_t nPendingUsage = 0;
+    bool fWriting = false;
+    bool fFailed = false;
+    bool fStop = false;
+    std::atomic<uint64_t> nWriteCount{0};
+
+    std::thread threadWrite;
+    void ThreadWrite();
+
+public:
+    explicit CCoinsViewWriteBehind(CCoinsViewDB& dbIn);
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    bool HaveCoin(const COutPoint &outpoint) const override;
+    uint256 GetBestBlock() const override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+
+    //! Wait for the write in progress, if any. Returns false if a write failed.
+    bool Sync();
+    //! Whether a write is in progress
+    bool IsWriting() const;
+    //! Whether a write failed; the coins it held stay here, and the database is not written to again
+    bool Failed() const;
+    //! Memory taken by the entries not written yet
+    size_t DynamicMemoryUsage() const;
+    //! Number of BatchWrite() calls so far. Coins read from here while it changed may be stale.
+    uint64_t GetWriteCount() const { return nWriteCount; }
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -74,10 +139,15 @@ public:
     void Next() override;
 
 private:
-    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn, int nEndIn = 256):
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), nEnd(nEndIn) {}
     std::unique_ptr<CDBIterator> pcursor;
     std::pair<char, COutPoint> keyTmp;
+    //! Coins from the txid starting with this byte on are past the end
+    int nEnd;
+
+    //! Cache the key pcursor points at, or invalidate it past the last coin
+    void ReadKey();
 
     friend class CCoinsViewDB;
 };
@@ -95,7 +165,7 @@ public:
     void ReadReindexing(bool &fReindexing);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex, bool fCheckPoW = true);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -14,13 +14,17 @@
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <consensus/validation.h>
+#include <crypto/common.h>
+#include <crypto/scrypt.h>
 #include <cuckoocache.h>
 #include <hash.h>
 #include <index/txindex.h>
+#include <mappedfile.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
 #include <policy/rbf.h>
 #include <pow.h>
+#include <powcache.h>
 #include <primitives/block.h>
 #include <primitives/transaction.h>
 #include <random.h>
@@ -41,8 +45,13 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <condition_variable>
 #include <future>
+#include <list>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <unordered_set>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
@@ -163,8 +172,10 @@ public:
     /**
      * If a block header hasn't already been seen, call CheckBlockHeader on it, ensure
      * that it doesn't descend from an invalid block, and then add it to mapBlockIndex.
+     * If phashPoW is set, the header's proof of work was already checked and
+     * *phashPoW is its scrypt hash.
      */
-    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const uint256* phashPoW = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     // Block (dis)connection on a given view:
@@ -221,6 +232,7 @@ CWaitableCriticalSection g_best_block_mutex;
 CConditionVariable g_best_block_cv;
 uint256 g_best_block;
 int nScriptCheckThreads = 0;
+int nCoinPrefetchThreads = 0;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
 bool fHavePruned = false;
@@ -228,8 +240,10 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+bool fCoinsWriteBehind = DEFAULT_COINS_WRITE_BEHIND;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
+int nCoinCacheRetain = DEFAULT_COINS_CACHE_RETAIN;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
@@ -294,6 +308,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 std::unique_ptr<CCoinsViewDB> pcoinsdbview;
+std::unique_ptr<CCoinsViewWriteBehind> pcoinswritebehind;
 std::unique_ptr<CCoinsViewCache> pcoinsTip;
 std::unique_ptr<CBlockTreeDB> pblocktree;
 
@@ -1073,48 +1088,168 @@ static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMes
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+std::atomic<uint64_t> g_pow_checks_skipped{0};
+
+/** Block files stay mapped until this many others were read from more recently. */
+static const size_t MAX_MAPPED_BLOCK_FILES = 32;
+
+static CCriticalSection cs_mapped_block_files;
+/** Mapped block files by number, the most recently used last */
+static std::list<std::pair<int, std::shared_ptr<const MappedFile>>> g_mapped_block_files GUARDED_BY(cs_mapped_block_files);
+/** Incremented by UnmapBlockFiles, so that a file mapped meanwhile is not kept */
+static uint64_t g_unmap_block_files_count GUARDED_BY(cs_mapped_block_files) = 0;
+
+/** Map a block file that blocks are no longer appended to, or return the
+ *  mapping it already has. Returns null for the file being appended to, and
+ *  for any file that cannot be mapped; those are read the usual way.
+ *  An I/O error while reading from a mapping raises SIGBUS, which stops the
+ *  node, where reading the file would have failed the read with an error. */
+static std::shared_ptr<const MappedFile> GetMappedBlockFile(int nFile)
 {
-    block.SetNull();
+    // Up to 4 GiB of mappings is more address space than 32-bit hosts have to spare.
+    if (sizeof(void*) < 8) {
+        return nullptr;
+    }
+    {
+        LOCK(cs_LastBlockFile);
+        if (nFile >= nLastBlockFile) {
+            return nullptr;
+        }
+    }
+    uint64_t unmap_count;
+    {
+        LOCK(cs_mapped_block_files);
+        for (auto it = g_mapped_block_files.begin(); it != g_mapped_block_files.end(); ++it) {
+            if (it->first == nFile) {
+                g_mapped_block_files.splice(g_mapped_block_files.end(), g_mapped_block_files, it);
+                return it->second;
+            }
+        }
+        unmap_count = g_unmap_block_files_count;
+    }
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    // Opening and mapping the file happens without the lock, so reads from
+    // files that are already mapped don't wait for it.
+    std::shared_ptr<const MappedFile> file = MappedFile::Open(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+    if (!file) {
+        return nullptr;
+    }
 
-    // Read block
-    try {
-        filein >> block;
+    LOCK(cs_mapped_block_files);
+    if (unmap_count != g_unmap_block_files_count) {
+        // The file may have been pruned since; use the mapping for this read only.
+        return file;
     }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    for (const auto& entry : g_mapped_block_files) {
+        if (entry.first == nFile) {
+            // Another thread mapped it first
+            return entry.second;
+        }
+    }
+    g_mapped_block_files.emplace_back(nFile, file);
+    if (g_mapped_block_files.size() > MAX_MAPPED_BLOCK_FILES) {
+        g_mapped_block_files.pop_front();
+    }
+    return file;
+}
+
+/** Drop the mappings of the given block files, or of all of them. Reads in
+ *  progress keep theirs until they are done. */
+static void UnmapBlockFiles(const std::set<int>* files = nullptr)
+{
+    LOCK(cs_mapped_block_files);
+    g_unmap_block_files_count++;
+    g_mapped_block_files.remove_if([files](const std::pair<int, std::shared_ptr<const MappedFile>>& entry) {
+        return !files || files->count(entry.first);
+    });
+}
+
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW)
+{
+    block.SetNull();
+
+    std::shared_ptr<const MappedFile> file = GetMappedBlockFile(pos.nFile);
+    if (file && pos.nPos < file->size()) {
+        // Read block straight from the mapped file
+        try {
+            SpanReader(SER_DISK, CLIENT_VERSION, file->data().subspan(pos.nPos)) >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check the header
-    if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+    if (fCheckPOW && !CheckProofOfWork(GetPoWHashCached(block), block.nBits, consensusParams))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
 
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    return ReadBlockFromDisk(block, pos, consensusParams, true);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
     CDiskBlockPos blockPos;
+    bool fHeaderValidated;
     {
         LOCK(cs_main);
         blockPos = pindex->GetBlockPos();
+        // The genesis block is added by LoadGenesisBlock without going
+        // through CheckBlockHeader, so it never counts as validated here.
+        fHeaderValidated = pindex->pprev && pindex->IsValid(BLOCK_VALID_TREE);
     }
 
-    if (!ReadBlockFromDisk(block, blockPos, consensusParams))
+    // A header that reached BLOCK_VALID_TREE already passed CheckProofOfWork
+    // when it was accepted. Comparing the SHA256d hash of the header read
+    // from disk against the index entry is then sufficient to know we read
+    // that same header back, so the scrypt evaluation can be skipped.
+    if (!ReadBlockFromDisk(block, blockPos, consensusParams, !fHeaderValidated))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
                 pindex->ToString(), pindex->GetBlockPos().ToString());
+    if (fHeaderValidated)
+        ++g_pow_checks_skipped;
     return true;
 }
 
-bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start)
+bool ReadRawBlockFromDisk(SharedBytes& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start)
 {
+    // Hand out the block where it is in the mapped file, behind its magic and size
+    std::shared_ptr<const MappedFile> file = GetMappedBlockFile(pos.nFile);
+    if (file && pos.nPos >= 8 && pos.nPos <= file->size()) {
+        const uint8_t* header = file->data().data() + pos.nPos - 8;
+        if (memcmp(header, message_start, CMessageHeader::MESSAGE_START_SIZE)) {
+            return error("%s: Block magic mismatch for %s: %s versus expected %s", __func__, pos.ToString(),
+                    HexStr(header, header + CMessageHeader::MESSAGE_START_SIZE),
+                    HexStr(message_start, message_start + CMessageHeader::MESSAGE_START_SIZE));
+        }
+        const uint32_t blk_size = ReadLE32(header + CMessageHeader::MESSAGE_START_SIZE);
+        if (blk_size > file->size() - pos.nPos) {
+            return error("%s: Block data runs past the end of the block file for %s", __func__, pos.ToString());
+        }
+        const Span<const uint8_t> data = file->data().subspan(pos.nPos, blk_size);
+        block = SharedBytes(std::move(file), data);
+        return true;
+    }
+
     CDiskBlockPos hpos = pos;
     hpos.nPos -= 8; // Seek back 8 bytes for meta header
     CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
@@ -1139,8 +1274,9 @@ bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos,
                     blk_size, MAX_SIZE);
         }
 
-        block.resize(blk_size); // Zeroing of memory is intentional here
-        filein.read((char*)block.data(), blk_size);
+        std::vector<uint8_t> data(blk_size); // Zeroing of memory is intentional here
+        filein.read((char*)data.data(), blk_size);
+        block = SharedBytes(std::move(data));
     } catch(const std::exception& e) {
         return error("%s: Read from block file failed: %s for %s", __func__, e.what(), pos.ToString());
     }
@@ -1148,7 +1284,7 @@ bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos,
     return true;
 }
 
-bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start)
+bool ReadRawBlockFromDisk(SharedBytes& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start)
 {
     CDiskBlockPos block_pos;
     {
@@ -1489,7 +1625,9 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
-static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+} // namespace
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
 {
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull()) {
@@ -1520,6 +1658,8 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 static bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1689,6 +1829,269 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Closure representing the proof-of-work check of one block header.
+ * The result and the scrypt hash are written to *pfValid and *phashPoW so that
+ * the caller can match them back to the header they belong to once the whole
+ * batch has been evaluated.
+ */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader* pheader;
+    const Consensus::Params* pconsensusParams;
+    char* pfValid;
+    uint256* phashPoW;
+
+public:
+    CHeaderPoWCheck(): pheader(nullptr), pconsensusParams(nullptr), pfValid(nullptr), phashPoW(nullptr) {}
+    CHeaderPoWCheck(const CBlockHeader& headerIn, const Consensus::Params& consensusParamsIn, char* pfValidIn, uint256* phashPoWIn) :
+        pheader(&headerIn), pconsensusParams(&consensusParamsIn), pfValid(pfValidIn), phashPoW(phashPoWIn) { }
+
+    bool operator()() {
+        *phashPoW = GetPoWHashCached(*pheader);
+        *pfValid = CheckProofOfWork(*phashPoW, pheader->nBits, *pconsensusParams);
+        return *pfValid;
+    }
+
+    void swap(CHeaderPoWCheck& check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pconsensusParams, check.pconsensusParams);
+        std::swap(pfValid, check.pfValid);
+        std::swap(phashPoW, check.phashPoW);
+    }
+};
+
+// Scrypt is expensive enough that small batches keep all workers busy.
+static CCheckQueue<CHeaderPoWCheck> powcheckqueue(4);
+
+void ThreadPoWCheck() {
+    RenameThread("stredle-powcheck");
+    powcheckqueue.Thread();
+}
+
+/**
+ * Closure representing the database read of one coin a block is about to
+ * spend. The coin, or a spent one if the database has none, and the time the
+ * read took are written to *pcoin and *pnMicros.
+ */
+class CCoinPrefetch
+{
+private:
+    const CCoinsView* pview;
+    const COutPoint* poutpoint;
+    Coin* pcoin;
+    int64_t* pnMicros;
+
+public:
+    CCoinPrefetch(): pview(nullptr), poutpoint(nullptr), pcoin(nullptr), pnMicros(nullptr) {}
+    CCoinPrefetch(const CCoinsView& viewIn, const COutPoint& outpointIn, Coin* pcoinIn, int64_t* pnMicrosIn) :
+        pview(&viewIn), poutpoint(&outpointIn), pcoin(pcoinIn), pnMicros(pnMicrosIn) { }
+
+    bool operator()() {
+        const int64_t nTimeStart = GetTimeMicros();
+        try {
+            if (!pview->GetCoin(*poutpoint, *pcoin))
+                pcoin->Clear();
+        } catch (const std::exception&) {
+            // Leave read errors for ConnectBlock to run into and report.
+            pcoin->Clear();
+        }
+        *pnMicros = GetTimeMicros() - nTimeStart;
+        return true;
+    }
+
+    void swap(CCoinPrefetch& check) {
+        std::swap(pview, check.pview);
+        std::swap(poutpoint, check.poutpoint);
+        std::swap(pcoin, check.pcoin);
+        std::swap(pnMicros, check.pnMicros);
+    }
+};
+
+// Each read mostly waits on the disk, so hand them out a few at a time.
+static CCheckQueue<CCoinPrefetch> coinprefetchqueue(4);
+
+void ThreadCoinPrefetch() {
+    RenameThread("stredle-prefetch");
+    coinprefetchqueue.Thread();
+}
+
+static int64_t nTimePrefetch = 0;
+static int64_t nTimePrefetchSaved = 0;
+static uint64_t nPrefetchInputs = 0;
+static uint64_t nPrefetchHits = 0;
+
+/**
+ * Read the coins a block spends that are not in pcoinsTip yet from the
+ * database, with the coin prefetch threads, and add them to pcoinsTip. This
+ * turns the random reads ConnectBlock would do one at a time into concurrent
+ * ones, done before the block takes cs_main for validation.
+ */
+static void PrefetchBlockCoins(const CBlock& block)
+{
+    if (!nCoinPrefetchThreads || !pcoinswritebehind)
+        return;
+
+    const int64_t nTimeStart = GetTimeMicros();
+    std::vector<COutPoint> vOutPoints;
+    size_t nInputs = 0;
+    size_t nCached = 0;
+    uint64_t nWriteCount;
+    {
+        LOCK(cs_main);
+        // A block that doesn't extend the tip won't be connected right away,
+        // and its coins would only push others out of the cache.
+        if (!chainActive.Tip() || block.hashPrevBlock != chainActive.Tip()->GetBlockHash())
+            return;
+        std::unordered_set<uint256, BlockHasher> setTxids;
+        for (const auto& tx : block.vtx) {
+            if (!tx->IsCoinBase()) {
+                for (const CTxIn& txin : tx->vin) {
+                    // Outputs created earlier in the block aren't in any database.
+                    if (setTxids.count(txin.prevout.hash))
+                        continue;
+                    nInputs++;
+                    if (pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                        nCached++;
+                    } else {
+                        vOutPoints.push_back(txin.prevout);
+                    }
+                }
+            }
+            setTxids.insert(tx->GetHash());
+        }
+        nWriteCount = pcoinswritebehind->GetWriteCount();
+    }
+
+    std::vector<Coin> vCoins(vOutPoints.size());
+    std::vector<int64_t> vMicros(vOutPoints.size());
+    if (!vOutPoints.empty()) {
+        std::vector<CCoinPrefetch> vChecks;
+        vChecks.reserve(vOutPoints.size());
+        for (size_t i = 0; i < vOutPoints.size(); i++) {
+            vChecks.emplace_back(*pcoinswritebehind, vOutPoints[i], &vCoins[i], &vMicros[i]);
+        }
+        CCheckQueueControl<CCoinPrefetch> control(&coinprefetchqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+    const int64_t nTimeRead = GetTimeMicros();
+    // What the reads would have taken one after another, as ConnectBlock does them.
+    int64_t nTimeSerial = 0;
+    for (int64_t nMicros : vMicros)
+        nTimeSerial += nMicros;
+
+    LOCK(cs_main);
+    size_t nFetched = 0;
+    // A flush in the meantime may have written coins the block's inputs
+    // spend, or spent ones that were read; drop everything rather than
+    // cache anything stale.
+    if (pcoinswritebehind->GetWriteCount() == nWriteCount) {
+        for (size_t i = 0; i < vOutPoints.size(); i++) {
+            if (!vCoins[i].IsSpent() && pcoinsTip->CacheCoin(vOutPoints[i], std::move(vCoins[i])))
+                nFetched++;
+        }
+    }
+    const int64_t nTimeEnd = GetTimeMicros();
+    nTimePrefetch += nTimeEnd - nTimeStart;
+    nTimePrefetchSaved += std::max<int64_t>(0, nTimeSerial - (nTimeRead - nTimeStart));
+    nPrefetchInputs += nInputs;
+    nPrefetchHits += nCached + nFetched;
+    LogPrint(BCLog::BENCH, "  - Prefetch %u inputs: %u cached, %u of %u read: %.2fms (%.2fms serial) [hit rate %.1f%% (%.1f%% total), %.2fs (%.2fs saved)]\n",
+        nInputs, nCached, nFetched, vOutPoints.size(), MILLI * (nTimeEnd - nTimeStart), MILLI * nTimeSerial,
+        nInputs ? 100.0 * (nCached + nFetched) / nInputs : 100.0, nPrefetchInputs ? 100.0 * nPrefetchHits / nPrefetchInputs : 100.0,
+        nTimePrefetch * MICRO, nTimePrefetchSaved * MICRO);
+}
+
+// Block index entries are audited in chunks, so that cs_main is only taken
+// briefly and the recomputed hashes don't have to be held for the whole index.
+static const size_t POW_AUDIT_CHUNK_SIZE = 65536;
+// Headers handed to scrypt_1024_1_1_256_multi at once.
+static const size_t POW_AUDIT_BATCH_SIZE = 64;
+
+void ThreadAuditBlockIndexPoW(const CChainParams& chainparams)
+{
+    RenameThread("stredle-powaudit");
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+
+    std::vector<CBlockIndex*> vIndex;
+    {
+        LOCK(cs_main);
+        vIndex.reserve(mapBlockIndex.size());
+        for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex) {
+            // The genesis block is added without CheckBlockHeader, see LoadGenesisBlock.
+            if (item.second->pprev)
+                vIndex.push_back(item.second);
+        }
+    }
+    LogPrintf("Auditing the proof of work of %u block index entries in the background\n", vIndex.size());
+    const int64_t nStart = GetTimeMillis();
+    const int nThreads = std::max(1, nScriptCheckThreads);
+    size_t nUpgraded = 0;
+    std::vector<uint256> vHashes;
+    for (size_t nChunkBegin = 0; nChunkBegin < vIndex.size(); nChunkBegin += POW_AUDIT_CHUNK_SIZE) {
+        const size_t nChunkEnd = std::min(vIndex.size(), nChunkBegin + POW_AUDIT_CHUNK_SIZE);
+        vHashes.assign(nChunkEnd - nChunkBegin, uint256());
+
+        std::atomic<size_t> nNext{nChunkBegin};
+        auto worker = [&] {
+            std::vector<char> vInput(POW_AUDIT_BATCH_SIZE * 80);
+            while (!ShutdownRequested() && !boost::this_thread::interruption_requested()) {
+                const size_t nBegin = nNext.fetch_add(POW_AUDIT_BATCH_SIZE);
+                if (nBegin >= nChunkEnd)
+                    break;
+                const size_t nEnd = std::min(nChunkEnd, nBegin + POW_AUDIT_BATCH_SIZE);
+                for (size_t i = nBegin; i < nEnd; i++) {
+                    // The header fields of an entry never change once it is in
+                    // mapBlockIndex, so they can be read without cs_main.
+                    const CBlockHeader header = vIndex[i]->GetBlockHeader();
+                    memcpy(&vInput[(i - nBegin) * 80], BEGIN(header.nVersion), 80);
+                }
+                scrypt_1024_1_1_256_multi(vInput.data(), BEGIN(vHashes[nBegin - nChunkBegin]), nEnd - nBegin);
+            }
+        };
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads - 1; i++)
+            workers.create_thread(worker);
+        worker();
+        try {
+            workers.join_all();
+        } catch (const boost::thread_interrupted&) {
+            // The workers use this frame, so they are stopped and joined
+            // before the interruption leaves it.
+            workers.interrupt_all();
+            boost::this_thread::disable_interruption no_interruption;
+            workers.join_all();
+            throw;
+        }
+        if (ShutdownRequested())
+            return;
+
+        LOCK(cs_main);
+        for (size_t i = nChunkBegin; i < nChunkEnd; i++) {
+            CBlockIndex* pindex = vIndex[i];
+            const uint256& hashPoW = vHashes[i - nChunkBegin];
+            if (!CheckProofOfWork(hashPoW, pindex->nBits, consensusParams)) {
+                AbortNode(strprintf("Block index entry %s fails its proof of work", pindex->GetBlockHash().ToString()),
+                          _("Corrupted block database detected"));
+                return;
+            }
+            if (pindex->hashPoW == hashPoW)
+                continue;
+            if (!pindex->hashPoW.IsNull()) {
+                LogPrintf("%s: replacing wrong stored proof-of-work hash of block %s\n", __func__, pindex->GetBlockHash().ToString());
+            } else {
+                nUpgraded++;
+            }
+            // Written out with the next flush, so later startups can check it.
+            pindex->hashPoW = hashPoW;
+            setDirtyBlockIndex.insert(pindex);
+        }
+    }
+    LogPrintf("Block index proof-of-work audit passed, recorded %u missing hashes (%dms)\n", nUpgraded, GetTimeMillis() - nStart);
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2098,6 +2501,8 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
     std::set<int> setFilesToPrune;
     bool full_flush_completed = false;
     try {
+    if (pcoinswritebehind && pcoinswritebehind->Failed())
+        return AbortNode(state, "Failed to write to coin database");
     {
         bool fFlushForPrune = false;
         bool fDoFullFlush = false;
@@ -2127,17 +2532,27 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
         }
         int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
         int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // Coins still being written in the background take up memory too.
+        const bool fWriting = pcoinswritebehind && pcoinswritebehind->IsWriting();
+        if (pcoinswritebehind)
+            cacheSize += pcoinswritebehind->DynamicMemoryUsage();
         int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
+        // What a flush leaves cached: the most recently used coins, up to this much.
+        int64_t nRetainSpace = nTotalSpace * nCoinCacheRetain / 100;
         // The cache is large and we're within 10% and 10 MiB of the limit, but we have time now (not in the middle of a block processing).
         bool fCacheLarge = mode == FlushStateMode::PERIODIC && cacheSize > std::max((9 * nTotalSpace) / 10, nTotalSpace - MAX_BLOCK_COINSDB_USAGE * 1024 * 1024);
         // The cache is over the limit, we have to write now.
         bool fCacheCritical = mode == FlushStateMode::IF_NEEDED && cacheSize > nTotalSpace;
+        // Writing in the background, the cache is handed over once it is halfway from what
+        // a flush retains to the limit, so that the rest can fill up meanwhile instead of
+        // waiting for the write.
+        bool fCacheHalfFull = mode == FlushStateMode::IF_NEEDED && fCoinsWriteBehind && pcoinswritebehind && !fWriting && cacheSize > (nTotalSpace + nRetainSpace) / 2;
         // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
         bool fPeriodicWrite = mode == FlushStateMode::PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
         // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
         bool fPeriodicFlush = mode == FlushStateMode::PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
         // Combine all conditions that result in a full cache flush.
-        fDoFullFlush = (mode == FlushStateMode::ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
+        fDoFullFlush = (mode == FlushStateMode::ALWAYS) || fCacheLarge || fCacheCritical || fCacheHalfFull || fPeriodicFlush || fFlushForPrune;
         // Write blocks and block index to disk.
         if (fDoFullFlush || fPeriodicWrite) {
             // Depend on nMinDiskSpace to ensure we can write block index
@@ -2178,7 +2593,23 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // Flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Only modified coins are written when some are to stay cached;
+            // those kept and the modified ones waiting to be written together
+            // stay within the retained share of the cache.
+            // This only waits for an earlier background write, if any.
+            int64_t nTimeSync = GetTimeMicros();
+            uint64_t nEvicted = pcoinsTip->GetEvicted();
+            if (!(nCoinCacheRetain > 0 ? pcoinsTip->Sync(nRetainSpace) : pcoinsTip->Flush()))
+                return AbortNode(state, "Failed to write to coin database");
+            if (nCoinCacheRetain > 0) {
+                LogPrint(BCLog::COINDB, "Synced coins in %.2fms, evicting %u and keeping %u (%.1fMiB) cached\n", (GetTimeMicros() - nTimeSync) * MILLI, pcoinsTip->GetEvicted() - nEvicted, pcoinsTip->GetCacheSize(), pcoinsTip->DynamicMemoryUsage() * (1.0 / 1024 / 1024));
+            }
+            // Wait for the write unless it can be left to the background:
+            // on shutdown and for callers reading the database directly it
+            // has to be complete, and pruned blocks are no longer around to
+            // replay it from after a crash.
+            const bool fSync = !fCoinsWriteBehind || mode == FlushStateMode::ALWAYS || fFlushForPrune;
+            if (fSync && pcoinswritebehind && !pcoinswritebehind->Sync())
                 return AbortNode(state, "Failed to write to coin database");
             nLastFlush = nNow;
             full_flush_completed = true;
@@ -3071,11 +3502,16 @@ static bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos,
     return true;
 }
 
-static bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true)
+static bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, uint256* phashPoW = nullptr)
 {
     // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
-        return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
+    if (fCheckPOW) {
+        const uint256 hashPoW = GetPoWHashCached(block);
+        if (phashPoW)
+            *phashPoW = hashPoW;
+        if (!CheckProofOfWork(hashPoW, block.nBits, consensusParams))
+            return state.DoS(50, false, REJECT_INVALID, "high-hash", false, "proof of work failed");
+    }
 
     return true;
 }
@@ -3350,13 +3786,14 @@ static bool ContextualCheckBlock(const CBlock& block, CValidationState& state, c
     return true;
 }
 
-bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const uint256* phashPoW)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
     uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = nullptr;
+    uint256 hashPoW = phashPoW ? *phashPoW : uint256();
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
         if (miSelf != mapBlockIndex.end()) {
             // Block header is already known.
@@ -3368,7 +3805,7 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), !phashPoW, &hashPoW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3400,8 +3837,10 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
             }
         }
     }
-    if (pindex == nullptr)
+    if (pindex == nullptr) {
         pindex = AddToBlockIndex(block);
+        pindex->hashPoW = hashPoW;
+    }
 
     if (ppindex)
         *ppindex = pindex;
@@ -3411,15 +3850,49 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
     return true;
 }
 
+void CheckBlockHeadersPoW(const std::vector<CBlockHeader>& headers, const Consensus::Params& consensusParams, std::vector<char>& vPoWValid, std::vector<uint256>& vPoWHash)
+{
+    vPoWValid.assign(headers.size(), 0);
+    vPoWHash.assign(headers.size(), uint256());
+    if (!nScriptCheckThreads || headers.size() < 2)
+        return;
+
+    std::vector<CHeaderPoWCheck> vChecks;
+    vChecks.reserve(headers.size());
+    {
+        LOCK(cs_main);
+        // Don't spend scrypt work on a batch AcceptBlockHeader will reject
+        // straight away for not connecting to anything we know.
+        if (!mapBlockIndex.count(headers[0].hashPrevBlock))
+            return;
+        // The queue hands out work from the back, so add the headers in
+        // reverse to have an invalid header early in the batch stop it early.
+        for (size_t i = headers.size(); i-- > 0; ) {
+            if (!mapBlockIndex.count(headers[i].GetHash()))
+                vChecks.emplace_back(headers[i], consensusParams, &vPoWValid[i], &vPoWHash[i]);
+        }
+    }
+    if (vChecks.size() < 2)
+        return;
+
+    CCheckQueueControl<CHeaderPoWCheck> control(&powcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader *first_invalid)
 {
     if (first_invalid != nullptr) first_invalid->SetNull();
+    std::vector<char> vPoWValid;
+    std::vector<uint256> vPoWHash;
+    CheckBlockHeadersPoW(headers, chainparams.GetConsensus(), vPoWValid, vPoWHash);
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex)) {
+            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex, vPoWValid[i] ? &vPoWHash[i] : nullptr)) {
                 if (first_invalid) *first_invalid = header;
                 return false;
             }
@@ -3542,6 +4015,8 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
         // Ensure that CheckBlock() passes before calling AcceptBlock, as
         // belt-and-suspenders.
         bool ret = CheckBlock(*pblock, state, chainparams.GetConsensus());
+        if (ret)
+            PrefetchBlockCoins(*pblock);
 
         LOCK(cs_main);
 
@@ -3648,6 +4123,7 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
         fs::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
     }
+    UnmapBlockFiles(&setFilesToPrune);
 }
 
 /* Calculate the block/rev files to delete based on height specified by user with RPC command pruneblockchain */
@@ -3823,7 +4299,8 @@ CBlockIndex * CChainState::InsertBlockIndex(const uint256& hash)
 
 bool CChainState::LoadBlockIndex(const Consensus::Params& consensus_params, CBlockTreeDB& blocktree)
 {
-    if (!blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }))
+    const bool fCheckPoW = gArgs.GetArg("-checkpowindex", DEFAULT_CHECKPOWINDEX) >= 1;
+    if (!blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }, fCheckPoW))
         return false;
 
     boost::this_thread::interruption_point();
@@ -4282,6 +4759,7 @@ void UnloadBlockIndex()
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
+    UnmapBlockFiles();
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
     versionbitscache.Clear();
@@ -4350,20 +4828,122 @@ bool LoadGenesisBlock(const CChainParams& chainparams)
     return g_chainstate.LoadGenesisBlock(chainparams);
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+namespace {
+
+// Blocks (and bytes) the import reader may run ahead of the commit stage.
+static const size_t IMPORT_QUEUE_MAX_BLOCKS = 1024;
+static const size_t IMPORT_QUEUE_MAX_BYTES = 64 << 20;
+// How often the import logs its progress, in milliseconds.
+static const int64_t IMPORT_PROGRESS_INTERVAL = 10000;
+
+/** A block on its way from the import reader to the commit stage. */
+struct ImportedBlock
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    std::shared_ptr<CBlock> pblock;
+    CDiskBlockPos pos;
+    size_t nSize;
+    //! Whether a worker ran CheckBlock on it; if that succeeded block.fChecked is set too
+    bool fChecked;
+};
 
-    int nLoaded = 0;
+/**
+ * The stages of LoadExternalBlockFile. A reader thread scans the file with
+ * large sequential reads and deserializes the blocks. A pool of workers runs
+ * the context-free CheckBlock on them (proof of work, merkle root), which
+ * AcceptBlock then skips. The calling thread commits the blocks in file order.
+ *
+ * Deserializing stays in the reader: where the next block starts depends on
+ * whether this one parses, since a corrupt record is rescanned from one byte
+ * past its message start.
+ */
+class CBlockImporter
+{
+private:
+    const CChainParams& chainparams;
+    CDiskBlockPos posFile;
+
+    std::mutex mutex;
+    std::condition_variable condReader;
+    std::condition_variable condWorker;
+    std::condition_variable condCommit;
+    //! Blocks in file order; the front one is committed next
+    std::deque<ImportedBlock> queue;
+    //! Number of blocks at the front of queue handed to workers already
+    size_t nClaimed = 0;
+    size_t nQueuedBytes = 0;
+    bool fReaderDone = false;
+    bool fStop = false;
+    std::string strSystemError;
+
+    std::vector<std::thread> threads;
+
+    // Per-stage statistics
+    std::atomic<uint64_t> nReadBlocks{0};
+    std::atomic<uint64_t> nReadBytes{0};
+    std::atomic<int64_t> nReadMicros{0};
+    std::atomic<uint64_t> nCheckedBlocks{0};
+    std::atomic<int64_t> nCheckMicros{0};
+
+    void Read(FILE* fileIn);
+    void Check();
+
+public:
+    uint64_t nCommitted = 0;
+    int64_t nCommitMicros = 0;
+    const int nWorkers;
+
+    CBlockImporter(const CChainParams& chainparamsIn, FILE* fileIn, const CDiskBlockPos* dbp, int nWorkersIn)
+        : chainparams(chainparamsIn), posFile(dbp ? *dbp : CDiskBlockPos()), nWorkers(nWorkersIn)
+    {
+        threads.emplace_back(&CBlockImporter::Read, this, fileIn);
+        for (int i = 0; i < nWorkers; i++)
+            threads.emplace_back(&CBlockImporter::Check, this);
+    }
+
+    ~CBlockImporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fStop = true;
+        }
+        condReader.notify_all();
+        condWorker.notify_all();
+        condCommit.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    /** Wait for the next block in file order to be checked. Returns false once the file is done. */
+    bool Next(ImportedBlock& block);
+
+    /** Stop reading; blocks already queued are discarded. */
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fStop = true;
+        condReader.notify_all();
+        condWorker.notify_all();
+    }
+
+    /** Error that made the reader give up, if any. */
+    std::string SystemError()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return strSystemError;
+    }
+
+    void LogProgress(int64_t nElapsedMillis);
+};
+
+void CBlockImporter::Read(FILE* fileIn)
+{
+    RenameThread("stredle-blkread");
+    const int64_t nStart = GetTimeMicros();
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
         while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
@@ -4387,86 +4967,196 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
             try {
                 // read block
                 uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
-                std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
+                ImportedBlock block{std::make_shared<CBlock>(), posFile, nSize, false};
+                block.pos.nPos = nBlockPos;
+                blkdat >> *block.pblock;
                 nRewind = blkdat.GetPos();
+                nReadBlocks++;
+                nReadBytes += nSize;
 
-                uint256 hash = block.GetHash();
-                {
-                    LOCK(cs_main);
-                    // detect out of order blocks, and store them for later
-                    if (hash != chainparams.GetConsensus().hashGenesisBlock && !LookupBlockIndex(block.hashPrevBlock)) {
-                        LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                                block.hashPrevBlock.ToString());
-                        if (dbp)
-                            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                        continue;
-                    }
+                std::unique_lock<std::mutex> lock(mutex);
+                condReader.wait(lock, [this] { return fStop || queue.empty() || (queue.size() < IMPORT_QUEUE_MAX_BLOCKS && nQueuedBytes < IMPORT_QUEUE_MAX_BYTES); });
+                if (fStop)
+                    break;
+                nQueuedBytes += nSize;
+                queue.push_back(std::move(block));
+                condWorker.notify_one();
+            } catch (const std::exception& e) {
+                LogPrintf("LoadExternalBlockFile: Deserialize or I/O error - %s\n", e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        strSystemError = e.what();
+    }
+    nReadMicros += GetTimeMicros() - nStart;
+    std::lock_guard<std::mutex> lock(mutex);
+    fReaderDone = true;
+    condCommit.notify_all();
+}
 
-                    // process in case the block isn't known yet
-                    CBlockIndex* pindex = LookupBlockIndex(hash);
-                    if (!pindex || (pindex->nStatus & BLOCK_HAVE_DATA) == 0) {
-                      CValidationState state;
-                      if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr)) {
-                          nLoaded++;
-                      }
-                      if (state.IsError()) {
-                          break;
-                      }
-                    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && pindex->nHeight % 1000 == 0) {
-                      LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), pindex->nHeight);
-                    }
+void CBlockImporter::Check()
+{
+    RenameThread("stredle-blkchk");
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        condWorker.wait(lock, [this] { return fStop || nClaimed < queue.size(); });
+        if (fStop)
+            return;
+        // Element references stay valid while the reader pushes to the back
+        // and the commit stage pops checked blocks off the front.
+        ImportedBlock& block = queue[nClaimed++];
+        lock.unlock();
+        const int64_t nStart = GetTimeMicros();
+        try {
+            CValidationState state;
+            CheckBlock(*block.pblock, state, chainparams.GetConsensus());
+        } catch (const std::exception&) {
+            // Left unchecked; AcceptBlock will run CheckBlock again
+        }
+        nCheckMicros += GetTimeMicros() - nStart;
+        nCheckedBlocks++;
+        lock.lock();
+        block.fChecked = true;
+        condCommit.notify_all();
+    }
+}
+
+bool CBlockImporter::Next(ImportedBlock& block)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condCommit.wait(lock, [this] { return fStop || (!queue.empty() && queue.front().fChecked) || (queue.empty() && fReaderDone); });
+    if (fStop || queue.empty())
+        return false;
+    block = std::move(queue.front());
+    queue.pop_front();
+    nClaimed--;
+    nQueuedBytes -= block.nSize;
+    condReader.notify_one();
+    return true;
+}
+
+void CBlockImporter::LogProgress(int64_t nElapsedMillis)
+{
+    const double nSeconds = std::max<int64_t>(nElapsedMillis, 1) * 0.001;
+    size_t nQueued;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        nQueued = queue.size();
+    }
+    LogPrint(BCLog::IMPORT, "Import: %.1fs, read %u blocks (%.2f MiB/s, %.2fs busy), checked %u (%.1f blocks/s, %d threads, %.2fs busy), committed %u (%.1f blocks/s, %.2fs busy), %u queued\n",
+        nSeconds,
+        nReadBlocks.load(), nReadBytes.load() / nSeconds / (1 << 20), nReadMicros.load() * 0.000001,
+        nCheckedBlocks.load(), nCheckedBlocks.load() / nSeconds, nWorkers, nCheckMicros.load() * 0.000001,
+        nCommitted, nCommitted / nSeconds, nCommitMicros * 0.000001,
+        nQueued);
+}
+
+} // namespace
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastProgress = nStart;
+
+    int nLoaded = 0;
+    CBlockImporter importer(chainparams, fileIn, dbp, std::max(1, nScriptCheckThreads));
+    ImportedBlock imported;
+    while (importer.Next(imported)) {
+        boost::this_thread::interruption_point();
+
+        importer.nCommitted++;
+        const int64_t nCommitStart = GetTimeMicros();
+        try {
+            std::shared_ptr<CBlock> pblock = imported.pblock;
+            CBlock& block = *pblock;
+            if (dbp)
+                *dbp = imported.pos;
+
+            uint256 hash = block.GetHash();
+            {
+                LOCK(cs_main);
+                // detect out of order blocks, and store them for later
+                if (hash != chainparams.GetConsensus().hashGenesisBlock && !LookupBlockIndex(block.hashPrevBlock)) {
+                    LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                            block.hashPrevBlock.ToString());
+                    if (dbp)
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                    importer.nCommitMicros += GetTimeMicros() - nCommitStart;
+                    continue;
                 }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
-                    }
+                // process in case the block isn't known yet
+                CBlockIndex* pindex = LookupBlockIndex(hash);
+                if (!pindex || (pindex->nStatus & BLOCK_HAVE_DATA) == 0) {
+                  CValidationState state;
+                  if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr)) {
+                      nLoaded++;
+                  }
+                  if (state.IsError()) {
+                      break;
+                  }
+                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && pindex->nHeight % 1000 == 0) {
+                  LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), pindex->nHeight);
+                }
+            }
+
+            // Activate the genesis block so normal node progress can continue
+            if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+                CValidationState state;
+                if (!ActivateBestChain(state, chainparams)) {
+                    break;
                 }
+            }
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+            NotifyHeaderTip();
+
+            // Recursively process earlier encountered successors of this block
+            std::deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 head = queue.front();
+                queue.pop_front();
+                std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                while (range.first != range.second) {
+                    std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                    std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+                    if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+                    {
+                        LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
+                                head.ToString());
+                        LOCK(cs_main);
+                        CValidationState dummy;
+                        if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
                         {
-                            LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
-                            {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
-                            }
+                            nLoaded++;
+                            queue.push_back(pblockrecursive->GetHash());
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
                     }
+                    range.first++;
+                    mapBlocksUnknownParent.erase(it);
+                    NotifyHeaderTip();
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+        importer.nCommitMicros += GetTimeMicros() - nCommitStart;
+
+        if (GetTimeMillis() - nLastProgress >= IMPORT_PROGRESS_INTERVAL) {
+            nLastProgress = GetTimeMillis();
+            importer.LogProgress(nLastProgress - nStart);
         }
-    } catch (const std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
     }
+    importer.Stop();
+    const std::string strSystemError = importer.SystemError();
+    if (!strSystemError.empty())
+        AbortNode(std::string("System error: ") + strSystemError);
+    importer.LogProgress(GetTimeMillis() - nStart);
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -32,12 +32,15 @@
 #include <atomic>
 
 class CBlockIndex;
+class CBlockUndo;
 class CBlockTreeDB;
 class CChainParams;
 class CCoinsViewDB;
+class CCoinsViewWriteBehind;
 class CInv;
 class CConnman;
 class CScriptCheck;
+class SharedBytes;
 class CBlockPolicyEstimator;
 class CTxMemPool;
 class CValidationState;
@@ -81,6 +84,16 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of coin prefetch threads allowed */
+static const int MAX_COIN_PREFETCH_THREADS = 64;
+/** -prefetchthreads default (number of threads reading a new block's inputs ahead of validation, 0 = off) */
+static const int DEFAULT_COIN_PREFETCH_THREADS = 4;
+/** Default for -dbwritebehind, writing the coins cache to the database in the background */
+static const bool DEFAULT_COINS_WRITE_BEHIND = true;
+/** Default for -dbcacheretain, the percentage of the coins cache kept after a flush (0 = empty it) */
+static const int DEFAULT_COINS_CACHE_RETAIN = 50;
+/** Maximum for -dbcacheretain, leaving room to fill up before the next flush */
+static const int MAX_COINS_CACHE_RETAIN = 90;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -117,6 +130,7 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+static const bool DEFAULT_COINSTATSINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
@@ -157,11 +171,15 @@ extern uint256 g_best_block;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
+extern int nCoinPrefetchThreads;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+extern bool fCoinsWriteBehind;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
+/** Percentage of the coins cache space filled with the most recently used coins after a flush. */
+extern int nCoinCacheRetain;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
 /** Absolute maximum transaction fee (in satoshis) used by wallet and mempool (rejects high fee in sendrawtransaction) */
@@ -196,6 +214,7 @@ static const unsigned int NODE_NETWORK_LIMITED_MIN_BLOCKS = 288;
 
 static const signed int DEFAULT_CHECKBLOCKS = 6 * 4;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+static const int DEFAULT_CHECKPOWINDEX = 1;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -243,6 +262,18 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
  */
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& block, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex = nullptr, CBlockHeader* first_invalid = nullptr) LOCKS_EXCLUDED(cs_main);
 
+/**
+ * Check the proof of work of a batch of block headers ahead of
+ * ProcessNewBlockHeaders, spreading the scrypt evaluations over the header
+ * proof-of-work checking threads. Headers already in mapBlockIndex are skipped.
+ *
+ * @param[in]  headers The block headers to check
+ * @param[in]  consensusParams The consensus parameters the headers are checked against
+ * @param[out] vPoWValid Same size as headers; non-zero only for headers known to satisfy their claimed target
+ * @param[out] vPoWHash  Same size as headers; the scrypt hash of every header with vPoWValid set
+ */
+void CheckBlockHeadersPoW(const std::vector<CBlockHeader>& headers, const Consensus::Params& consensusParams, std::vector<char>& vPoWValid, std::vector<uint256>& vPoWHash) LOCKS_EXCLUDED(cs_main);
+
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0, bool blocks_dir = false);
 /** Open a block file (blk?????.dat) */
@@ -262,6 +293,16 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header proof-of-work checking thread */
+void ThreadPoWCheck();
+/** Run an instance of the coin prefetch thread */
+void ThreadCoinPrefetch();
+/**
+ * Recompute the scrypt hash of every block index entry and check it against
+ * the entry's target, recording it for entries that have none stored yet.
+ * Meant to run in the background after LoadBlockIndex (-checkpowindex=2).
+ */
+void ThreadAuditBlockIndexPoW(const CChainParams& chainparams) LOCKS_EXCLUDED(cs_main);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -391,8 +432,14 @@ void InitScriptExecutionCache();
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
-bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start);
-bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
+/** Read a block's serialization as it is on disk. Blocks in block files that
+ *  are no longer appended to are handed out where they are in the mapped file. */
+bool ReadRawBlockFromDisk(SharedBytes& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start);
+bool ReadRawBlockFromDisk(SharedBytes& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
+
+/** Number of scrypt PoW evaluations ReadBlockFromDisk skipped for blocks whose header was already validated. */
+extern std::atomic<uint64_t> g_pow_checks_skipped;
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -457,6 +504,9 @@ extern CChain& chainActive;
 /** Global variable that points to the coins database (protected by cs_main) */
 extern std::unique_ptr<CCoinsViewDB> pcoinsdbview;
 
+/** Global variable that points to the background writer in front of pcoinsdbview (protected by cs_main) */
+extern std::unique_ptr<CCoinsViewWriteBehind> pcoinswritebehind;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern std::unique_ptr<CCoinsViewCache> pcoinsTip;
 
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the coinstatsindex.
+
+Node 0 maintains the index, node 1 computes the same statistics by walking its
+chainstate. They have to agree at the tip, including across a reorganization
+and a restart.
+"""
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    assert_raises_rpc_error,
+    connect_nodes,
+    wait_until,
+)
+
+KEYS = ['height', 'bestblock', 'txouts', 'bogosize', 'total_amount', 'muhash']
+
+
+class CoinStatsIndexTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.num_nodes = 2
+        self.extra_args = [["-coinstatsindex"], []]
+
+    def skip_test_if_missing_module(self):
+        self.skip_if_no_wallet()
+
+    def assert_same_stats(self):
+        self.sync_all()
+
+        def synced():
+            # Until the index catches up, node 0 scans its chainstate too,
+            # and reports the number of transactions only then.
+            return 'transactions' not in self.nodes[0].gettxoutsetinfo('muhash')
+        wait_until(synced, timeout=60)
+        res0 = self.nodes[0].gettxoutsetinfo('muhash')
+        res1 = self.nodes[1].gettxoutsetinfo('muhash')
+        for key in KEYS:
+            assert_equal(res0[key], res1[key])
+        return res0
+
+    def run_test(self):
+        self.log.info("Index agrees with a scan of the chainstate")
+        self.assert_same_stats()
+
+        self.nodes[0].sendtoaddress(self.nodes[1].getnewaddress(), 10)
+        self.nodes[0].generate(1)
+        self.assert_same_stats()
+
+        self.log.info("The serialized hash is still computed from the chainstate")
+        res = self.nodes[0].gettxoutsetinfo()
+        assert 'transactions' in res and 'hash_serialized_2' in res
+
+        self.log.info("Index follows a reorganization")
+        tip = self.nodes[0].getbestblockhash()
+        before = self.assert_same_stats()
+        for node in self.nodes:
+            node.invalidateblock(tip)
+        self.nodes[1].generate(2)
+        self.assert_same_stats()
+        for node in self.nodes:
+            node.reconsiderblock(tip)
+        assert_equal(self.nodes[0].getblockcount(), before['height'] + 1)
+        self.assert_same_stats()
+
+        self.log.info("Index survives a restart")
+        self.restart_node(0, ["-coinstatsindex"])
+        connect_nodes(self.nodes[0], 1)
+        self.nodes[1].generate(1)
+        self.assert_same_stats()
+
+        self.log.info("Index is incompatible with pruning")
+        self.stop_node(0)
+        self.nodes[0].assert_start_raises_init_error(["-coinstatsindex", "-prune=550"], "Error: Prune mode is incompatible with -coinstatsindex.")
+        self.start_node(0)
+        assert_raises_rpc_error(-8, "foo is not a valid hash_type", self.nodes[0].gettxoutsetinfo, "foo")
+
+
+if __name__ == '__main__':
+    CoinStatsIndexTest().main()
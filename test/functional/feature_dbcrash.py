@@ -7,6 +7,9 @@
 - 4 nodes
   * node0, node1, and node2 will have different dbcrash ratios, and different
     dbcache sizes
+  * node0 and node1 write the chainstate in the background (-dbwritebehind),
+    so they crash in the writer thread while validation goes on; node2
+    writes it synchronously.
   * node3 will be a regular node, with no crashing.
   * The nodes will not connect to each other.
 
@@ -57,7 +60,7 @@ class ChainstateWriteCrashTest(BitcoinTestFramework):
         # -dbcache goes to pcoinsTip.
         self.node0_args = ["-dbcrashratio=8", "-dbcache=4"] + self.base_args
         self.node1_args = ["-dbcrashratio=16", "-dbcache=8"] + self.base_args
-        self.node2_args = ["-dbcrashratio=24", "-dbcache=16"] + self.base_args
+        self.node2_args = ["-dbcrashratio=24", "-dbcache=16", "-dbwritebehind=0"] + self.base_args
 
         # Node3 is a normal node with default args, except will mine full blocks
         self.node3_args = ["-blockmaxweight=4000000"]
@@ -7,6 +7,7 @@
 Test the following RPCs:
     - getblockchaininfo
     - gettxoutsetinfo
+    - getcoinscacheinfo
     - getdifficulty
     - getbestblockhash
     - getblockhash
@@ -57,6 +58,7 @@ class BlockchainTest(BitcoinTestFramework):
         self._test_getblockchaininfo()
         self._test_getchaintxstats()
         self._test_gettxoutsetinfo()
+        self._test_getcoinscacheinfo()
         self._test_getblockheader()
         self._test_getdifficulty()
         self._test_getnetworkhashps()
@@ -203,6 +205,29 @@ class BlockchainTest(BitcoinTestFramework):
         del res['disk_size'], res3['disk_size']
         assert_equal(res, res3)
 
+        self.log.info("Test gettxoutsetinfo() with the other hash types")
+        res4 = node.gettxoutsetinfo('muhash')
+        assert_equal(len(res4['muhash']), 64)
+        assert 'hash_serialized_2' not in res4
+        res5 = node.gettxoutsetinfo('none')
+        assert 'muhash' not in res5 and 'hash_serialized_2' not in res5
+        del res4['disk_size'], res4['muhash'], res5['disk_size']
+        del res3['hash_serialized_2']
+        assert_equal(res3, res4)
+        assert_equal(res3, res5)
+        assert_raises_rpc_error(-8, "foo is not a valid hash_type", node.gettxoutsetinfo, "foo")
+
+    def _test_getcoinscacheinfo(self):
+        node = self.nodes[0]
+        res = node.getcoinscacheinfo()
+
+        # The flushes of gettxoutsetinfo() above keep the coins cached.
+        assert res['coins'] > 0
+        assert res['usage'] <= res['maxusage']
+        assert_equal(res['retain'], 50)
+        assert_equal(res['evicted'], 0)
+        assert 0 <= res['hitrate'] <= 1
+
     def _test_getblockheader(self):
         node = self.nodes[0]
 